@@ -6,4 +6,8 @@
 // Helps make code stable and tests predictable.
 static const double gTolerance = 1e-7;
 
+// Largest absolute value of the logarithm of a point weight relative
+// to the current scale before point weights are rescaled.
+static const double gMaxLogWeight = 600.0;
+
 #endif
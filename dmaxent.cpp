@@ -1,61 +1,129 @@
 #include <stdlib.h>
 #include <cmath>
 #include <algorithm>
+#include <iterator>
 #include "dmaxent.hpp"
+#include "kernels.hpp"
+#include "pool.hpp"
 #include "constants.hpp"
 #include "glog/logging.h"
 
 
+// Number of features whose gradients are compared by one task of
+// FindDescentDirection. Features are split into chunks of this size
+// whatever the number of threads, so that the chosen feature does not
+// depend on it.
+static const int gGradientChunkSize = 256;
+
+// Number of points whose weights are updated by one task of UpdateModel
+// and RescaleWeights (a multiple of gKernelLanes). Blocks of the space
+// are split into chunks of this size whatever the number of threads, so
+// that the normalizer does not depend on it.
+static const int gUpdateChunkSize = 4096;
+
+// Number of incremental updates of the normalizer by UpdateModel after
+// which it is recomputed from the weights of all points, and the fraction
+// of the normalizer the absolute changes added up by these updates may
+// reach before it is recomputed earlier, so that rounding errors do not
+// accumulate over long fits.
+static const int gNormalizerRefreshPeriod = 64;
+static const double gNormalizerRefreshFraction = 0.5;
+
 // Returns 1 if x > 0 and -1 otherwise.
 inline double sgn(double x) {
   return (x > 0 ? 1.0 : -1.0);
 }
 
+// Returns the sum of count values added up in a fixed pairwise order:
+// the sums of the first and the second half are added up recursively.
+static double PairwiseSum(const double *values, int count) {
+  if (count <= 2) {
+    return (count == 0 ? 0.0 : count == 1 ? values[0] : values[0] + values[1]);
+  }
+  int half = count / 2;
+  return PairwiseSum(values, half) + PairwiseSum(values + half, count - half);
+}
+
+// Calls function(chunk, &chunk_max_log_score) in parallel (see
+// ParallelFor) for every chunk of gUpdateChunkSize consecutive points of
+// every block of the given space (see Space::ForEachShard) with raw
+// features of the given indices. Each call starts from the value of
+// max_log_score, which is set to the largest one set by the calls.
+// Returns the sum of the values returned by the calls, added up in
+// a fixed pairwise order within each block (see PairwiseSum) and in
+// the order of blocks and shards otherwise, so that it is the same bit
+// for bit whatever the number of threads.
+static double SumOverChunks
+  (Space &space, const std::vector<int> *indices,
+   const std::function<double(const SpaceBlock&, double*)> &function,
+   double *max_log_score) {
+  std::vector<double> partials(space.NumShards(), 0.0);
+  std::vector<double> shard_max_log_scores(space.NumShards(),
+					   *max_log_score);
+  space.ForEachShard(indices, [&](SpaceBlock &block, int shard) {
+      int num_chunks = (block.size + gUpdateChunkSize - 1) / gUpdateChunkSize;
+      std::vector<double> chunk_sums(num_chunks, 0.0);
+      std::vector<double> chunk_max_log_scores(num_chunks,
+					       shard_max_log_scores[shard]);
+      ParallelFor(num_chunks, [&](int number) {
+	  int start = number * gUpdateChunkSize;
+	  SpaceBlock chunk = block;
+	  chunk.begin = block.begin + start;
+	  chunk.size = std::min(gUpdateChunkSize, block.size - start);
+	  chunk.weights = block.weights + start;
+	  for (auto &column : chunk.columns) {
+	    if (column != NULL) {
+	      column += start;
+	    }
+	  }
+	  chunk_sums[number] = function(chunk, &chunk_max_log_scores[number]);
+	});
+      partials[shard] += PairwiseSum(chunk_sums.data(), num_chunks);
+      for (double chunk_max_log_score : chunk_max_log_scores) {
+	shard_max_log_scores[shard] = std::max(shard_max_log_scores[shard],
+					       chunk_max_log_score);
+      }
+    });
+  *max_log_score = *std::max_element(shard_max_log_scores.begin(),
+				     shard_max_log_scores.end());
+  return SumShardPartials(partials);
+}
+
 // Sets direction attribute of this model to an index of a feature (stored 
 // internally) that corresponds to coordinate descent direction based
 // on the current state of the model (weights of features and probability
 // density over the space).
 // Note that it is assumed that sample expectations of features has been
 // already computed.
+// Weak learners do not modify the space or the sample and share no
+// mutable state with each other (see WLearner), so each of them is
+// trained as a separate task running concurrently with the others and
+// with the search among the features of this model (see FindBestFeature).
+// Trained features are then compared in the order of weak learners, so
+// the result is the same as if they were trained one after another.
 void DMaxEntModel::FindDescentDirection() {
-  Feature *feature;
   int best_feature_index = 0;
-  double beta;
-  double gradient;
-  double diff_expectations;
-  double feature_weight;
   double best_absolute_gradient = -1.0;
-  for (unsigned index = 0; index < weighted_features.size(); index++) {
-    feature_weight = weighted_features[index].first;
-    feature = weighted_features[index].second;
-    feature->ComputeUnnormalizedPopulationExpectation(*space);
-    diff_expectations = -feature->GetSampleExpectation() + 
-      (feature->GetUnnormalizedPopulationExpectation() / normalizer);
-    beta = 2 * model_parameter_alpha * feature->Complexity() +
-      model_parameter_beta;
-    if (std::abs(feature_weight) > gTolerance) {
-      gradient = beta * sgn(feature_weight) + diff_expectations;
-    } else if (std::abs(diff_expectations) <  beta) {
-      gradient = 0;
-    } else {
-      gradient = -beta * sgn(diff_expectations) + diff_expectations;
-    }
-    if (std::abs(gradient) >= best_absolute_gradient) {
-      best_feature_index = index;
-      best_absolute_gradient = std::abs(gradient);
-    }
-  }
+  int num_learners = weak_learners.size();
+  std::vector<Feature*> learned_features(num_learners, NULL);
+  std::vector<double> learned_gradients(num_learners, 0.0);
+  ParallelFor(num_learners + 1, [&](int task) {
+      if (task < num_learners) {
+	weak_learners[task]->Train(*space, sample, &learned_features[task],
+				   &learned_gradients[task]);
+      } else {
+	FindBestFeature(&best_feature_index, &best_absolute_gradient);
+      }
+    });
   Feature *new_feature;
   bool new_feature_found = false;
-  for (auto learner : weak_learners) {
-    double gradient;
-    Feature *feature;
-    learner->Train(*space, sample, &feature, &gradient);
+  for (int learner = 0; learner < num_learners; learner++) {
+    double gradient = learned_gradients[learner];
     if (std::abs(gradient) > best_absolute_gradient + gTolerance) {
       new_feature_found = true;
       best_feature_index = weighted_features.size();
       best_absolute_gradient = std::abs(gradient);
-      new_feature = feature;
+      new_feature = learned_features[learner];
     }
   }
   if (new_feature_found) {
@@ -65,12 +133,266 @@ void DMaxEntModel::FindDescentDirection() {
   direction = best_feature_index;
 }
 
-// Sets step_size attribute of this model to a value defined by
+// Returns the gradient of the objective along the feature with the given
+// index, assuming that its population expectation is up to date.
+double DMaxEntModel::Gradient(int index) {
+  double feature_weight = weighted_features[index].first;
+  Feature *feature = weighted_features[index].second;
+  double diff_expectations = -feature->GetSampleExpectation() +
+    (feature->GetUnnormalizedPopulationExpectation() / normalizer);
+  double beta = 2 * model_parameter_alpha * feature->Complexity() +
+    model_parameter_beta;
+  if (std::abs(feature_weight) > gTolerance) {
+    return beta * sgn(feature_weight) + diff_expectations;
+  } else if (std::abs(diff_expectations) <  beta) {
+    return 0;
+  } else {
+    return -beta * sgn(diff_expectations) + diff_expectations;
+  }
+}
+
+// Stores in best_feature_index and best_absolute_gradient the index of
+// the feature of this model with the largest absolute gradient and that
+// gradient. Population expectations of all features are computed first
+// (see ComputePopulationExpectations) unless lazy gradients are enabled
+// (see FindBestFeatureLazily).
+// Gradients of chunks of features are compared in parallel (see
+// ParallelFor) and the best features of chunks are then compared in
+// the order of chunks, so that the last feature with the largest absolute
+// gradient is chosen as if all features were compared one by one.
+void DMaxEntModel::FindBestFeature(int *best_feature_index,
+				   double *best_absolute_gradient) {
+  if (lazy_gradients) {
+    FindBestFeatureLazily(best_feature_index, best_absolute_gradient);
+    return;
+  }
+  *best_feature_index = 0;
+  *best_absolute_gradient = -1.0;
+  ComputePopulationExpectations(NULL);
+  if (features_per_iteration > 1) {
+    absolute_gradients.assign(weighted_features.size(), NAN);
+  }
+  int num_chunks = (weighted_features.size() + gGradientChunkSize - 1) /
+    gGradientChunkSize;
+  std::vector<int> chunk_best_indices(num_chunks, 0);
+  std::vector<double> chunk_best_gradients(num_chunks, -1.0);
+  ParallelFor(num_chunks, [&](int chunk) {
+      int end = std::min<int>(weighted_features.size(),
+			      (chunk + 1) * gGradientChunkSize);
+      for (int index = chunk * gGradientChunkSize; index < end; index++) {
+	double gradient = Gradient(index);
+	if (features_per_iteration > 1) {
+	  absolute_gradients[index] = std::abs(gradient);
+	}
+	if (std::abs(gradient) >= chunk_best_gradients[chunk]) {
+	  chunk_best_indices[chunk] = index;
+	  chunk_best_gradients[chunk] = std::abs(gradient);
+	}
+      }
+    });
+  for (int chunk = 0; chunk < num_chunks; chunk++) {
+    if (chunk_best_gradients[chunk] >= *best_absolute_gradient) {
+      *best_feature_index = chunk_best_indices[chunk];
+      *best_absolute_gradient = chunk_best_gradients[chunk];
+    }
+  }
+}
+
+// Returns a score of the feature with the given index such that its
+// absolute gradient is max(0, score) and the score changes at most as much
+// as the population expectation of the feature does (see Gradient).
+// For features with zero weight the score is the difference of
+// expectations minus beta, which may be negative.
+double DMaxEntModel::GradientScore(int index) {
+  double feature_weight = weighted_features[index].first;
+  Feature *feature = weighted_features[index].second;
+  if (std::abs(feature_weight) > gTolerance) {
+    return std::abs(Gradient(index));
+  }
+  double diff_expectations = -feature->GetSampleExpectation() +
+    (feature->GetUnnormalizedPopulationExpectation() / normalizer);
+  double beta = 2 * model_parameter_alpha * feature->Complexity() +
+    model_parameter_beta;
+  return std::abs(diff_expectations) - beta;
+}
+
+// Same as FindBestFeature, but only evaluates features whose absolute
+// gradient may be within gTolerance of the largest one.
+// If values of all features are bounded by lambda, a step of coordinate
+// descent changes expectations of features (and thus their gradient
+// scores, see GradientScore) by at most the amount added to
+// gradient_drift in UpdateModel. Features are kept in a max-heap keyed by
+// their gradient score at their last evaluation minus gradient_drift at
+// that time, so that the key plus the current gradient_drift bounds the
+// current score and the order of the heap never changes.
+// New features and the last descent directions (whose weights have
+// changed) are evaluated first. Then features whose bound is within
+// gTolerance of the best absolute gradient found so far are popped from
+// the heap and evaluated in batches, until no bound is, and pushed back once
+// the search is over. The chosen feature is thus the same as the one
+// chosen by evaluating all features.
+void DMaxEntModel::FindBestFeatureLazily(int *best_feature_index,
+					 double *best_absolute_gradient) {
+  *best_feature_index = 0;
+  *best_absolute_gradient = -1.0;
+  std::vector<int> indices;
+  for (int index = gradient_keys.size();
+       index < (int) weighted_features.size(); index++) {
+    indices.push_back(index);
+  }
+  if (direction < (int) gradient_keys.size()) {
+    indices.push_back(direction);
+  }
+  indices.insert(indices.end(), block_directions.begin(),
+		 block_directions.end());
+  if (features_per_iteration > 1) {
+    absolute_gradients.assign(weighted_features.size(), NAN);
+  }
+  gradient_keys.resize(weighted_features.size(), NAN);
+  if (gradient_heap.size() > 2 * gradient_keys.size()) {
+    // Drops entries left behind by features evaluated since they were
+    // pushed, which are otherwise only dropped once they are popped.
+    gradient_heap = std::priority_queue<std::pair<double, int> >();
+    for (int index = 0; index < (int) gradient_keys.size(); index++) {
+      if (!std::isnan(gradient_keys[index])) {
+	gradient_heap.push(std::make_pair(gradient_keys[index], index));
+      }
+    }
+  }
+  std::vector<int> evaluated;
+  while (!indices.empty()) {
+    ComputePopulationExpectations(&indices);
+    for (int index : indices) {
+      double gradient = std::abs(Gradient(index));
+      if (features_per_iteration > 1) {
+	absolute_gradients[index] = gradient;
+      }
+      if (gradient > *best_absolute_gradient ||
+	  (gradient == *best_absolute_gradient &&
+	   index > *best_feature_index)) {
+	*best_feature_index = index;
+	*best_absolute_gradient = gradient;
+      }
+      gradient_keys[index] = GradientScore(index) - gradient_drift;
+      evaluated.push_back(index);
+    }
+    indices.clear();
+    // Features whose absolute gradient may be zero tie with the best one
+    // if it is zero as well, so all of them are evaluated in that case.
+    while (!gradient_heap.empty() &&
+	   (*best_absolute_gradient <= gTolerance ||
+	    gradient_heap.top().first + gradient_drift + gTolerance >=
+	    *best_absolute_gradient)) {
+      std::pair<double, int> top = gradient_heap.top();
+      gradient_heap.pop();
+      // Keys of entries of features evaluated since they were pushed
+      // differ from the current keys of these features.
+      if (top.first == gradient_keys[top.second]) {
+	gradient_keys[top.second] = NAN;
+	indices.push_back(top.second);
+      }
+    }
+  }
+  for (int index : evaluated) {
+    gradient_heap.push(std::make_pair(gradient_keys[index], index));
+  }
+}
+
+// Stores in block_directions up to features_per_iteration - 1 features
+// to be updated together with the descent direction: the features with
+// the largest absolute gradients found by the last search (see
+// FindBestFeature) whose raw features are disjoint from those of
+// the direction and of each other, so that their steps hardly affect each
+// other. Features whose raw features are not known and features with
+// zero gradient are skipped.
+void DMaxEntModel::FindBlockDirections() {
+  block_directions.clear();
+  std::vector<int> used_indices;
+  if (features_per_iteration <= 1 ||
+      weighted_features[direction].second->RawFeatureIndices(&used_indices)
+      != 0) {
+    return;
+  }
+  std::vector<std::pair<double, int> > candidates;
+  for (int index = 0; index < (int) absolute_gradients.size(); index++) {
+    if (index != direction && absolute_gradients[index] > gTolerance) {
+      candidates.push_back(std::make_pair(absolute_gradients[index], index));
+    }
+  }
+  // Of features with equal gradients the last one comes first, as in
+  // FindBestFeature.
+  std::sort(candidates.rbegin(), candidates.rend());
+  for (auto &candidate : candidates) {
+    if ((int) block_directions.size() + 1 >= features_per_iteration) {
+      break;
+    }
+    std::vector<int> indices;
+    if (weighted_features[candidate.second].second->
+	RawFeatureIndices(&indices) != 0) {
+      continue;
+    }
+    std::vector<int> common;
+    std::set_intersection(indices.begin(), indices.end(),
+			  used_indices.begin(), used_indices.end(),
+			  std::back_inserter(common));
+    if (!common.empty()) {
+      continue;
+    }
+    block_directions.push_back(candidate.second);
+    used_indices.insert(used_indices.end(), indices.begin(), indices.end());
+    std::sort(used_indices.begin(), used_indices.end());
+  }
+}
+
+// Computes un-normalized population expectations of features of this
+// model with the given indices (of all features if indices is NULL).
+// Features known to be zero outside of a few points (see
+// Feature::NonZeroKeys) and features packed on the space (see
+// Feature::IsPacked) are cheap to evaluate and are evaluated one by one
+// in parallel (see ParallelFor).
+// All other features are evaluated together in a single pass over
+// the space (see ComputeUnnormalizedPopulationExpectations). If feature
+// cache is enabled, their values are cached first and expectations are
+// computed from the cached values. Inserting values of one feature may
+// evict values of another, so columns are looked up only once all of
+// them have been inserted.
+void DMaxEntModel::ComputePopulationExpectations
+  (const std::vector<int> *indices) {
+  std::vector<Feature*> dense_features;
+  std::vector<Feature*> cheap_features;
+  int count = (indices != NULL ? indices->size() : weighted_features.size());
+  for (int i = 0; i < count; i++) {
+    Feature *feature =
+      weighted_features[indices != NULL ? (*indices)[i] : i].second;
+    std::vector<int> keys;
+    if (feature->NonZeroKeys(*space, &keys) == 0 ||
+	feature->IsPacked(*space)) {
+      cheap_features.push_back(feature);
+      continue;
+    }
+    dense_features.push_back(feature);
+    if (feature_cache != NULL) {
+      feature_cache->Insert(feature, *space);
+    }
+  }
+  ParallelFor(cheap_features.size(), [&](int i) {
+      cheap_features[i]->ComputeUnnormalizedPopulationExpectation(*space);
+    });
+  std::vector<const FeatureColumn*> columns;
+  for (Feature *feature : dense_features) {
+    columns.push_back(feature_cache != NULL ?
+		      feature_cache->Find(feature) : NULL);
+  }
+  ComputeUnnormalizedPopulationExpectations(dense_features, columns,
+					    *space);
+}
+
+// Returns the step size along the feature with the given index defined by
 // version 1 of DMaxEnt algorithm. Assumes that population and
-// sample expectations of each feature are up to date. 
-void DMaxEntModel::FindStepSize1() {
-  double feature_weight = weighted_features[direction].first;
-  Feature *feature = weighted_features[direction].second;
+// sample expectations of the feature are up to date. 
+double DMaxEntModel::FindStepSize1(int index) {
+  double feature_weight = weighted_features[index].first;
+  Feature *feature = weighted_features[index].second;
   double Phi_pt = lambda +
     (feature->GetUnnormalizedPopulationExpectation() / normalizer);
   double Phi_mt = -lambda +
@@ -83,51 +405,221 @@ void DMaxEntModel::FindStepSize1() {
   double beta_k = 2 * model_parameter_alpha * feature->Complexity() +
     model_parameter_beta;
   if (std::abs(beta) < beta_k) {
-    step_size = -feature_weight;
+    return -feature_weight;
   } else if (beta > beta_k) {
-    step_size = 0.5 * log(Phi_mt * (beta_k - Phi_p) /
-			  (Phi_pt * (beta_k - Phi_m))) / lambda;
+    return 0.5 * log(Phi_mt * (beta_k - Phi_p) /
+		     (Phi_pt * (beta_k - Phi_m))) / lambda;
   } else {
-    step_size = 0.5 * log(Phi_mt * (beta_k + Phi_p) /
-			  (Phi_pt * (beta_k + Phi_m))) / lambda;
+    return 0.5 * log(Phi_mt * (beta_k + Phi_p) /
+		     (Phi_pt * (beta_k + Phi_m))) / lambda;
   }
 }
 
-// Sets step_size attribute of this model to a value defined by
+// Returns the step size along the feature with the given index defined by
 // version 2 of DMaxEnt algorithm. Assumes that population and
-// sample expectations of each feature are up to date. 
-void DMaxEntModel::FindStepSize2() {
-  double feature_weight = weighted_features[direction].first;
-  Feature *feature = weighted_features[direction].second;
+// sample expectations of the feature are up to date. 
+double DMaxEntModel::FindStepSize2(int index) {
+  double feature_weight = weighted_features[index].first;
+  Feature *feature = weighted_features[index].second;
   double diff_expectations = -feature->GetSampleExpectation() +
     feature->GetUnnormalizedPopulationExpectation() / normalizer;
   double beta_k = 2 * model_parameter_alpha * feature->Complexity() +
     model_parameter_beta;
   double beta = feature_weight * lambda * lambda - diff_expectations; 
   if (std::abs(beta) <= beta_k) {
-    step_size = -feature_weight;
+    return -feature_weight;
   } else if (beta > beta_k) {
-    step_size = - (beta_k + diff_expectations) / (lambda * lambda);
+    return - (beta_k + diff_expectations) / (lambda * lambda);
   } else {
-    step_size = - (-beta_k + diff_expectations) / (lambda * lambda);
+    return - (-beta_k + diff_expectations) / (lambda * lambda);
   }
 }
 
 // Updates this model, by computing new weights of each point in the space
 // according to the last step of coordinate descent and sets appropriate
-// value for the normalizer.
+// value for the normalizer. The step is added to log-scores of the points
+// and their weights are recomputed from the log-scores relative to the
+// current shift. If the feature is known to be zero outside of
+// some points (e.g. it depends on sparse raw features) only weights of
+// these points change and the normalizer is updated incrementally, with
+// the feature evaluated at all of them as a batch (see FeatureMapBatch).
+// The normalizer and the bound on log-scores are recomputed from all
+// points (see RecomputeNormalizer) after gNormalizerRefreshPeriod such
+// updates or once the changes of the normalizer add up to more than
+// gNormalizerRefreshFraction of it.
+// Otherwise cached values of the feature are used if there are any or
+// the feature is evaluated chunk by chunk (see SumOverChunks) so that
+// chunked spaces are streamed once and chunks of points are updated in
+// parallel. Scores, weights and the normalizer of a chunk are updated
+// in a single pass (see StepExpSum).
+// Weights are rescaled (see RescaleWeights) once the largest of them
+// drifts too far from one.
+// Other features updated in the same iteration (see FindBlockDirections)
+// are evaluated chunk by chunk as well and their weighted sum is added
+// to the log-scores in the same pass.
+// If lazy gradients are enabled, gradient_drift is increased by lambda
+// times the L1 distance between the old and the new probabilities of
+// points, which bounds the change of the expectation of any feature
+// bounded by lambda (see FindBestFeatureLazily).
 void DMaxEntModel::UpdateModel() {
-  double weight;
   double new_normalizer = 0.0;
   weighted_features[direction].first += step_size;
+  for (unsigned i = 0; i < block_directions.size(); i++) {
+    weighted_features[block_directions[i]].first += block_step_sizes[i];
+  }
   Feature *feature = weighted_features[direction].second;
-  for (auto &point : *space) {
-    weight = point.GetProbWeight() *
-      exp(step_size * feature->FeatureMap(&point));
-    new_normalizer += weight;
-    point.SetProbWeight(weight);
+  double old_normalizer = normalizer;
+  Span<double> weights = space->ProbWeights();
+  std::vector<int> keys;
+  if (block_directions.empty() && feature->NonZeroKeys(*space, &keys) == 0) {
+    std::vector<Example> examples(keys.size());
+    for (unsigned i = 0; i < keys.size(); i++) {
+      examples[i] = &(space->GetPoint(keys[i]));
+    }
+    std::vector<double> values(keys.size());
+    feature->FeatureMapBatch(examples.data(), keys.size(), values.data());
+    double old_weight = 0.0;
+    std::vector<double> old_weights(keys.size());
+    for (unsigned i = 0; i < keys.size(); i++) {
+      int key = keys[i];
+      old_weights[i] = weights[key];
+      old_weight += weights[key];
+      log_scores[key] += step_size * values[i];
+      weights[key] = KernelExp(log_scores[key] - log_shift);
+      new_normalizer += weights[key];
+      max_log_score = std::max(max_log_score, log_scores[key]);
+    }
+    normalizer += new_normalizer - old_weight;
+    incremental_updates++;
+    incremental_change += std::abs(new_normalizer - old_weight);
+    if (incremental_updates >= gNormalizerRefreshPeriod ||
+	incremental_change > gNormalizerRefreshFraction * normalizer) {
+      RecomputeNormalizer();
+    }
+    if (lazy_gradients) {
+      // Probabilities of all other points change by the same factor.
+      double distance = std::abs(old_normalizer - old_weight) *
+	std::abs(1.0 / normalizer - 1.0 / old_normalizer);
+      for (unsigned i = 0; i < keys.size(); i++) {
+	distance += std::abs(weights[keys[i]] / normalizer -
+			     old_weights[i] / old_normalizer);
+      }
+      gradient_drift += lambda * distance;
+    }
+  } else {
+    std::vector<double> old_weights;
+    if (lazy_gradients) {
+      old_weights.assign(weights.begin(), weights.end());
+    }
+    std::vector<int> updated(1, direction);
+    updated.insert(updated.end(), block_directions.begin(),
+		   block_directions.end());
+    std::vector<double> steps(1, step_size);
+    steps.insert(steps.end(), block_step_sizes.begin(),
+		 block_step_sizes.end());
+    std::vector<const FeatureColumn*> columns;
+    std::vector<int> indices;
+    bool known_indices = true;
+    for (int index : updated) {
+      Feature *updated_feature = weighted_features[index].second;
+      columns.push_back(feature_cache != NULL ?
+			feature_cache->Find(updated_feature) : NULL);
+      std::vector<int> feature_indices;
+      if (columns.back() == NULL) {
+	known_indices = (known_indices &&
+			 updated_feature->RawFeatureIndices(&feature_indices)
+			 == 0);
+	indices.insert(indices.end(), feature_indices.begin(),
+		       feature_indices.end());
+      }
+    }
+    std::sort(indices.begin(), indices.end());
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+    max_log_score = -INFINITY;
+    incremental_updates = 0;
+    incremental_change = 0.0;
+    normalizer = SumOverChunks
+      (*space, known_indices ? &indices : NULL,
+       [&](const SpaceBlock &chunk, double *chunk_max_log_score) {
+	std::vector<double> values(chunk.size);
+	std::vector<double> other_values(updated.size() > 1 ? chunk.size : 0);
+	for (unsigned i = 0; i < updated.size(); i++) {
+	  double *target = (i == 0 ? values.data() : other_values.data());
+	  if (columns[i] != NULL) {
+	    for (int offset = 0; offset < chunk.size; offset++) {
+	      target[offset] = columns[i]->Value(chunk.begin + offset);
+	    }
+	  } else {
+	    weighted_features[updated[i]].second->FeatureMapBlock(chunk,
+								   target);
+	  }
+	  if (i == 0 && updated.size() > 1) {
+	    for (int offset = 0; offset < chunk.size; offset++) {
+	      values[offset] *= steps[0];
+	    }
+	  } else if (i > 0) {
+	    for (int offset = 0; offset < chunk.size; offset++) {
+	      values[offset] += steps[i] * other_values[offset];
+	    }
+	  }
+	}
+	// Values of several features are already multiplied by their steps.
+	return StepExpSum(updated.size() > 1 ? 1.0 : step_size, values.data(),
+			  log_shift, log_scores.data() + chunk.begin,
+			  chunk.weights, chunk.size, chunk_max_log_score);
+      }, &max_log_score);
+    if (lazy_gradients) {
+      std::vector<int> no_indices;
+      double unused_max_log_score = -INFINITY;
+      gradient_drift += lambda * SumOverChunks
+	(*space, &no_indices,
+	 [&](const SpaceBlock &chunk, double *) {
+	  double distance = 0.0;
+	  for (int offset = 0; offset < chunk.size; offset++) {
+	    distance += std::abs(chunk.weights[offset] / normalizer -
+				 old_weights[chunk.begin + offset] /
+				 old_normalizer);
+	  }
+	  return distance;
+	}, &unused_max_log_score);
+    }
+  }
+  if (std::abs(max_log_score - log_shift) > gMaxLogWeight ||
+      !std::isfinite(normalizer)) {
+    RescaleWeights();
+  }
+}
+
+// Makes the largest log-score of a point the new shift and recomputes
+// weights of all points and the normalizer from the log-scores, so that
+// the largest weight becomes one. Weights only change by a common factor,
+// which is accounted for by the shift, so relative weights of the points
+// (and thus the density defined by this model) do not change.
+void DMaxEntModel::RescaleWeights() {
+  double new_max_log_score = -INFINITY;
+  for (double score : log_scores) {
+    new_max_log_score = std::max(new_max_log_score, score);
   }
-  normalizer = new_normalizer;
+  log_shift = (std::isfinite(new_max_log_score) ? new_max_log_score : 0.0);
+  RecomputeNormalizer();
+}
+
+// Recomputes weights of all points from their log-scores relative to
+// the current shift, the normalizer as the sum of these weights and
+// the largest log-score of a point, discarding any rounding errors of
+// incremental updates of the normalizer (see UpdateModel).
+void DMaxEntModel::RecomputeNormalizer() {
+  std::vector<int> indices;
+  max_log_score = -INFINITY;
+  normalizer = SumOverChunks
+    (*space, &indices,
+     [&](const SpaceBlock &chunk, double *chunk_max_log_score) {
+      return StepExpSum(0.0, NULL, log_shift,
+			log_scores.data() + chunk.begin, chunk.weights,
+			chunk.size, chunk_max_log_score);
+    }, &max_log_score);
+  incremental_updates = 0;
+  incremental_change = 0.0;
 }
 
 // Constructor for this model. Client needs to specify regularization
@@ -148,7 +640,23 @@ DMaxEntModel::DMaxEntModel(double alpha, double beta,
   lambda = l;
   space = X;
   sample = S;
-  normalizer = X->NumPoints();
+  normalizer = X->TotalProbWeight();
+  Span<double> weights = X->ProbWeights();
+  log_scores.resize(weights.size());
+  for (unsigned key = 0; key < weights.size(); key++) {
+    log_scores[key] = log(weights[key]);
+  }
+  max_log_score = (log_scores.empty() ? 0.0 :
+		   *std::max_element(log_scores.begin(), log_scores.end()));
+  log_shift = 0.0;
+  incremental_updates = 0;
+  incremental_change = 0.0;
+  feature_cache = NULL;
+  direction = 0;
+  lazy_gradients = false;
+  gradient_drift = 0.0;
+  features_per_iteration = 1;
+  step_size = 0.0;
   for (auto feature : *features) {
     weighted_features.push_back(std::make_pair(0.0, feature));
   }
@@ -159,6 +667,7 @@ DMaxEntModel::DMaxEntModel(double alpha, double beta,
 
 // Destructor for this model.
 DMaxEntModel::~DMaxEntModel() {
+  delete feature_cache;
   delete space;
   for (auto weight_feature_pair : weighted_features) {
     delete weight_feature_pair.second;
@@ -169,22 +678,51 @@ DMaxEntModel::~DMaxEntModel() {
   }
 }
 
+// Enables caching of feature values (see FeatureCache) using at most
+// budget_bytes of memory. Replaces the previous cache if there is one.
+void DMaxEntModel::EnableFeatureCache(size_t budget_bytes) {
+  delete feature_cache;
+  feature_cache = new FeatureCache(budget_bytes);
+}
+
+// Makes each iteration of Fit only evaluate features whose gradient may
+// be the largest one (see FindBestFeatureLazily). Assumes that absolute
+// values of all features are at most lambda.
+void DMaxEntModel::EnableLazyGradients() {
+  lazy_gradients = true;
+}
+
+// Makes each iteration of Fit update the given number of features (see
+// FindBlockDirections) instead of one. Returns 0 on success and -1 if
+// the number of features is not positive.
+int DMaxEntModel::SetFeaturesPerIteration(int count) {
+  if (count < 1) {
+    return -1;
+  }
+  features_per_iteration = count;
+  return 0;
+}
+
 // Fits this model to the data using parameters which are specified
 // during construction.
 void DMaxEntModel::Fit() {
   for (int iter = 0; iter < max_descent_steps; iter++) {
     FindDescentDirection();
-    if (version == 1) {
-      FindStepSize1();
-    } else {
-      FindStepSize2();
+    FindBlockDirections();
+    step_size = (version == 1 ? FindStepSize1(direction) :
+		 FindStepSize2(direction));
+    block_step_sizes.clear();
+    for (int index : block_directions) {
+      block_step_sizes.push_back(version == 1 ? FindStepSize1(index) :
+				 FindStepSize2(index));
     }
     UpdateModel();
 
     // log some statistics if needed
     VLOG(1) << "Completed iteration #" << iter + 1 <<
       " of coordinate descent: direction=" << direction <<
-      " weight=" << step_size << " absolute gradient=" << model_gradient; 
+      " weight=" << step_size << " absolute gradient=" << model_gradient <<
+      " other directions=" << block_directions.size();
     VLOG(2) << "Training Log loss: " << LogLoss(&sample);
     VLOG(3) << "Training AUC: " << AUC(&sample);
 
@@ -199,59 +737,91 @@ void DMaxEntModel::Fit() {
 }
 
 // Returns the log loss of this model on the given sample.
+// Weight of a point is shared by all the points merged into it, so
+// probability of an example is its weight divided by its multiplicity.
+// Losses of examples in the space are computed from their log-scores,
+// which stay accurate even if their weights underflow.
 double DMaxEntModel::LogLoss(Sample *sample) {
   double loss = 0.0;
+  double log_normalizer = GetLogNormalizer();
   for (auto example : *sample) {
-    loss += log(normalizer / example->GetProbWeight());
+    int key = example->GetKey();
+    if (key < 0) {
+      loss += log(normalizer * example->GetMultiplicity() /
+		  example->GetProbWeight());
+      continue;
+    }
+    loss += log_normalizer + log(example->GetMultiplicity()) - log_scores[key];
   }
   return loss;
 }
 
-// A functor to compare pointers to Points. The points are compared
+// A functor to compare keys of points in space. The points are compared
 // based on the probability weights and ties are broken based on
 // positive examples supplied with positive examples ranked higher.
-// TODO: this should be moved to Point class as a friend class.
-class PointProbLessThanOperator : std::binary_function<Point*, Point*, bool> {
+// Positive examples are indexed by keys of points.
+class KeyProbLessThanOperator : std::binary_function<int, int, bool> {
 public:
-  PointProbLessThanOperator(std::vector<bool> *positive) {
+  KeyProbLessThanOperator(Span<double> weights, std::vector<bool> *positive)
+    : weights_(weights) {
     positive_ = positive;
   }
-  inline bool operator()(Point* point1, Point* point2) {
-    return ((point1->GetProbWeight() < point2->GetProbWeight()) ||
-	    ((point1->GetProbWeight() == point2->GetProbWeight()) &&
-	     !(positive_->at(point1->GetId())) &&
-	     (positive_->at(point2->GetId()))));
+  inline bool operator()(int key1, int key2) {
+    return ((weights_[key1] < weights_[key2]) ||
+	    ((weights_[key1] == weights_[key2]) &&
+	     !((*positive_)[key1]) && ((*positive_)[key2])));
   }
 private:
+  Span<double> weights_;
   std::vector<bool> *positive_;
 };
 
 
 // Returns AUC of this model on the given sample.
+// Points are ranked by their weights divided by multiplicities (compared
+// through their log-scores). Points merged into a positive point are
+// counted as negatives that tie with it.
 double DMaxEntModel::AUC(Sample *sample) {
-  std::vector<bool> positive(space->NumPoints(), false);
+  std::vector<bool> positive_ids(space->NumPoints(), false);
   for (auto point : *sample) {
-    positive[point->GetId()] = true;
+    positive_ids[point->GetId()] = true;
   }
-  std::vector<Point*> all_points;
-  for (auto &point : *space) {
-    all_points.push_back(&point);
+  std::vector<bool> positive(space->NumPoints(), false);
+  std::vector<int> all_keys(space->NumPoints());
+  std::vector<double> point_weights(space->NumPoints());
+  for (int key = 0; key < space->NumPoints(); key++) {
+    positive[key] = positive_ids[space->GetPoint(key).GetId()];
+    all_keys[key] = key;
+    point_weights[key] = log_scores[key] - log(space->GetMultiplicity(key));
   }
 
-  std::sort(all_points.begin(), all_points.end(),
-	    PointProbLessThanOperator(&positive));
+  std::sort(all_keys.begin(), all_keys.end(),
+	    KeyProbLessThanOperator(Span<double>(point_weights.data(),
+						 point_weights.size()),
+				    &positive));
   double n = 0.0;
   double r = 0.0;
 
-  for (auto point : all_points) {
-    if (positive[point->GetId()]) {
-      r += n;
-    } else {
-      n += 1.0;
+  // Points with equal weights are processed together since positive
+  // examples are ranked above all negative ones they tie with.
+  unsigned begin = 0;
+  while (begin < all_keys.size()) {
+    unsigned end = begin;
+    while (end < all_keys.size() &&
+	   point_weights[all_keys[end]] == point_weights[all_keys[begin]]) {
+      int key = all_keys[end];
+      n += space->GetMultiplicity(key) - (positive[key] ? 1 : 0);
+      end++;
+    }
+    for (unsigned index = begin; index < end; index++) {
+      if (positive[all_keys[index]]) {
+	r += n;
+      }
     }
+    begin = end;
   }
-  // TODO: check that n > 0 and n < all_points.size()
-  return r / (n * (all_points.size() - n));
+  // TODO: check that n > 0 and n < space->TotalMultiplicity()
+  return r / (n * (space->TotalMultiplicity() - n));
 }
 
 // Returns the value stored in direction attribute. Typically this
@@ -278,6 +848,13 @@ double DMaxEntModel::GetNormalizer() {
   return normalizer;
 }
 
+// Returns the logarithm of the total weight of points in the space before
+// weights are rescaled (see RescaleWeights), i.e. the log-sum-exp of
+// log-scores of the points.
+double DMaxEntModel::GetLogNormalizer() {
+  return log_shift + log(normalizer);
+}
+
 // Returns a weight of the feature stored internally at specified index.
 // If index is not specified correctly then returns -1. 
 // This method is provided primarily for testing purposes.
@@ -1,3 +1,4 @@
+#include <queue>
 #include "space.hpp"
 #include "feature.hpp"
 #include "wlearner.hpp"
@@ -15,6 +16,13 @@
 //                      the performance metric that is used is log loss
 //   AUC(sample) - evaluates fitted model using provided test sample;
 //                      the performance metric that is used is AUC
+//   EnableFeatureCache(budget) - caches values of features at points of
+//                                the space using at most budget bytes
+//   EnableLazyGradients() - evaluates only features whose gradients may
+//                           be the largest in each iteration of Fit()
+//   SetFeaturesPerIteration(count) - updates up to count features on
+//                                    disjoint raw features in each
+//                                    iteration of Fit()
 //   ~DMaxEntModel() - destructor
 //
 // This class also provides auxiliary methods listed below (primarily for
@@ -25,6 +33,8 @@
 //   GetWeight(coordinate) - returns the weight of the specified coordinate
 //                           in the model
 //   GetNormalizer() - returns value of normalizer stored in the model
+//   GetLogNormalizer() - returns logarithm of the normalizer before
+//                        weights were rescaled
 //
 //
 // Recall that (Deep) Max Entropy model is a Gibbs distribution
@@ -59,6 +69,9 @@ public:
 	       Sample sample, std::vector<Feature*> *features,
 	       std::vector<WLearner*> weak_learners, Sample test_sample);
   ~DMaxEntModel();
+  void EnableFeatureCache(size_t budget_bytes);
+  void EnableLazyGradients();
+  int SetFeaturesPerIteration(int count);
   void Fit();
   double LogLoss(Sample *sample);
   double AUC(Sample *sample);
@@ -66,19 +79,53 @@ public:
   double GetStepSize();
   double GetWeight(int coordinate);
   double GetNormalizer();
+  double GetLogNormalizer();
   typedef std::vector< std::pair<double, Feature*> >::iterator FeatureIterator;
   FeatureIterator FeatureBegin();
   FeatureIterator FeatureEnd();
 private:
   void FindDescentDirection();
-  void FindStepSize1();
-  void FindStepSize2();
+  void FindBestFeature(int *best_feature_index,
+		       double *best_absolute_gradient);
+  void FindBestFeatureLazily(int *best_feature_index,
+			     double *best_absolute_gradient);
+  double Gradient(int index);
+  double GradientScore(int index);
+  void FindBlockDirections();
+  double FindStepSize1(int index);
+  double FindStepSize2(int index);
   void UpdateModel();
+  void RescaleWeights();
+  void RecomputeNormalizer();
+  void ComputePopulationExpectations(const std::vector<int> *indices);
   std::vector<std::pair<double, Feature*>> weighted_features;
   std::vector<WLearner*> weak_learners; 
   Space *space;
   Sample sample;
   double normalizer;
+  // Log-scores of points: log of the initial weight of a point plus
+  // the weighted sum of features at it. Weight of a point in the space is
+  // exp(log_scores[key] - log_shift) and the normalizer is the sum of
+  // these weights. The shift is only changed when weights drift too far
+  // from one, so weights neither overflow nor underflow in long fits.
+  std::vector<double> log_scores;
+  double log_shift;
+  double max_log_score; // upper bound on log-scores of all points
+  // Incremental updates of the normalizer since it was last recomputed
+  // and the sum of absolute changes they made (see UpdateModel).
+  int incremental_updates;
+  double incremental_change;
+  FeatureCache *feature_cache; // cache of feature values (or NULL)
+  // Lazy evaluation of gradients (see FindBestFeatureLazily).
+  bool lazy_gradients;
+  double gradient_drift; // bound on the change of gradients so far
+  std::vector<double> gradient_keys; // keys of features in gradient_heap
+  std::priority_queue<std::pair<double, int> > gradient_heap;
+  // Block coordinate descent (see FindBlockDirections).
+  int features_per_iteration;
+  std::vector<double> absolute_gradients; // NAN for features not evaluated
+  std::vector<int> block_directions; // features updated besides direction
+  std::vector<double> block_step_sizes;
   double model_parameter_alpha;
   double model_parameter_beta;
   double lambda;
@@ -1,7 +1,9 @@
+#include <algorithm>
 #include <cmath>
 #include "gtest/gtest.h"
 #include "constants.hpp"
 #include "dmaxent.hpp"
+#include "pool.hpp"
 
 // Test Feature for DMaxEntModel class.
 class DMaxEntModelTest : public ::testing::Test {
@@ -62,6 +64,32 @@ TEST_F(DMaxEntModelTest, TestFitAfterOneIterationVer1) {
   EXPECT_NEAR(1.0, (space->GetPoint(1)).GetProbWeight(), gTolerance);
 }
 
+// Tests that fit method gives the same result after 3 iterations if values
+// of features are cached.
+TEST_F(DMaxEntModelTest, TestFitWithFeatureCache) {
+  model = new DMaxEntModel(0.0, 0.07, 3, 1, 1, true, space, sample, &features,
+			   learners, test);
+  model->EnableFeatureCache(1 << 20);
+  model->Fit();
+  EXPECT_NEAR(1.6256354062769477, model->GetNormalizer(), gTolerance);
+}
+
+// Tests that fit method gives the same result after 1 iteration if raw
+// features are stored sparsely and only some of the weights are updated.
+TEST_F(DMaxEntModelTest, TestFitAfterOneIterationOnSparseSpace) {
+  space->Sparsify(1.0);
+  model = new DMaxEntModel(0.0, 0.07, 1, 1, 1, true, space, sample, &features,
+			   learners, test);
+  model->Fit();
+  EXPECT_EQ(2, model->GetDescentDirection());
+  EXPECT_NEAR(-0.21765903562892275, model->GetStepSize(), gTolerance);
+  EXPECT_NEAR(1.8043996665398437, model->GetNormalizer(), gTolerance);
+  EXPECT_NEAR(-0.21765903562892275, model->GetWeight(2), gTolerance);
+  EXPECT_NEAR(0.8043996665398437, (space->GetPoint(0)).GetProbWeight(),
+	      gTolerance);
+  EXPECT_NEAR(1.0, (space->GetPoint(1)).GetProbWeight(), gTolerance);
+}
+
 // Tests that fit method modifies the state correctly after 2 iterations
 // where we update step size using version 1 formulation
 TEST_F(DMaxEntModelTest, TestFitAfterTwoIterationsVer1) {
@@ -128,6 +156,107 @@ TEST_F(DMaxEntModelTest, TestLogLoss) {
   EXPECT_NEAR(3.3674687842873072, model->LogLoss(&test_sample), gTolerance);
 }
 
+// Tests that fitting a model over a space where identical points are
+// merged gives the same density as fitting it over the original space.
+TEST_F(DMaxEntModelTest, TestFitOnDeduplicatedSpace) {
+  Space *full_space = new Space();
+  Space *deduplicated_space = new Space();
+  EXPECT_EQ(0, deduplicated_space->EnableDeduplication());
+  Point *points[4] = {point1, point2, point2, point2};
+  for (auto point : points) {
+    full_space->AddPoint(*point);
+    deduplicated_space->AddPoint(*point);
+  }
+  full_space->Finalize();
+  deduplicated_space->Finalize();
+  EXPECT_EQ(2, deduplicated_space->NumPoints());
+  DMaxEntModel *full_model =
+    new DMaxEntModel(0.0, 0.07, 3, 1, 1, true, full_space, sample,
+		     &features, learners, test);
+  full_model->Fit();
+  model = new DMaxEntModel(0.0, 0.07, 3, 1, 1, true, deduplicated_space,
+			   sample, &features, learners, test);
+  model->Fit();
+  for (int coordinate = 0; coordinate < 3; coordinate++) {
+    EXPECT_NEAR(full_model->GetWeight(coordinate), model->GetWeight(coordinate),
+		gTolerance);
+  }
+  EXPECT_NEAR(full_model->GetNormalizer(), model->GetNormalizer(), gTolerance);
+  EXPECT_NEAR(3 * full_space->GetPoint(1).GetProbWeight(),
+	      deduplicated_space->GetPoint(1).GetProbWeight(), gTolerance);
+
+  Sample full_test;
+  full_test.push_back(&(full_space->GetPoint(0)));
+  full_test.push_back(&(full_space->GetPoint(1)));
+  Sample deduplicated_test;
+  deduplicated_test.push_back(&(deduplicated_space->GetPoint(0)));
+  deduplicated_test.push_back(&(deduplicated_space->GetPoint(1)));
+  EXPECT_NEAR(full_model->LogLoss(&full_test),
+	      model->LogLoss(&deduplicated_test), gTolerance);
+  full_test.pop_back();
+  deduplicated_test.pop_back();
+  EXPECT_NEAR(full_model->AUC(&full_test), model->AUC(&deduplicated_test),
+	      gTolerance);
+}
+
+// Tests that a step which would overflow point weights rescales them
+// instead and that log loss is still computed from log-scores.
+TEST_F(DMaxEntModelTest, TestFitRescalesWeights) {
+  Space *large_space = new Space();
+  double values[2] = {1000.0, -1000.0};
+  large_space->AddPoint(1, values, 1, 1.0);
+  large_space->AddPoint(2, values + 1, 1, 1.0);
+  large_space->Finalize();
+  Sample large_sample(1, &(large_space->GetPoint(0)));
+  std::vector<Feature*> *large_features = new std::vector<Feature*>();
+  large_features->push_back(new RawFeature(0));
+  (*large_features)[0]->ComputeSampleExpectation(large_sample);
+  (*large_features)[0]->SetComplexity(0.0);
+  model = new DMaxEntModel(0.0, 0.0, 1, 2, 1, true, large_space,
+			   large_sample, large_features, learners, test);
+  model->Fit();
+  EXPECT_NEAR(1000.0, model->GetWeight(0), gTolerance);
+  EXPECT_NEAR(1.0, model->GetNormalizer(), gTolerance);
+  EXPECT_NEAR(1e6, model->GetLogNormalizer(), gTolerance);
+  EXPECT_NEAR(1.0, large_space->GetPoint(0).GetProbWeight(), gTolerance);
+  EXPECT_NEAR(0.0, large_space->GetPoint(1).GetProbWeight(), gTolerance);
+  EXPECT_NEAR(0.0, model->LogLoss(&large_sample), gTolerance);
+  Sample other_sample(1, &(large_space->GetPoint(1)));
+  EXPECT_NEAR(2e6, model->LogLoss(&other_sample), gTolerance);
+}
+
+// Tests that the normalizer of a long fit on a sparse space, updated
+// incrementally from the weights of few points in each iteration, is
+// still the sum of the weights of all points.
+TEST_F(DMaxEntModelTest, TestLongFitOnSparseSpace) {
+  Space *sparse_space = new Space();
+  for (int key = 0; key < 5000; key++) {
+    double values[8] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+    values[key % 8] = 0.05 * ((key * 7) % 13 + 1);
+    sparse_space->AddPoint(key, values, 8, 1.0 + (key % 3));
+  }
+  sparse_space->Finalize();
+  EXPECT_EQ(8, sparse_space->Sparsify(0.2));
+  Sample sparse_sample;
+  for (int key = 0; key < 5000; key += 5) {
+    sparse_sample.push_back(&sparse_space->GetPoint(key));
+  }
+  std::vector<Feature*> *sparse_features = new std::vector<Feature*>();
+  for (int index = 0; index < 8; index++) {
+    sparse_features->push_back(new RawFeature(index));
+    sparse_features->back()->ComputeSampleExpectation(sparse_sample);
+    sparse_features->back()->SetComplexity(0.0);
+  }
+  model = new DMaxEntModel(0.0, 0.0001, 1000, 1, 1, false, sparse_space,
+			   sparse_sample, sparse_features, learners, test);
+  model->Fit();
+  double sum = 0.0;
+  for (int key = 0; key < 5000; key++) {
+    sum += sparse_space->GetPoint(key).GetProbWeight();
+  }
+  EXPECT_NEAR(sum, model->GetNormalizer(), gTolerance * sum);
+}
+
 // Tests that AUC method returns correct result.
 TEST_F(DMaxEntModelTest, TestAUC) {
   space = new Space();
@@ -216,3 +345,219 @@ TEST_F(DMaxEntModelTest, TestFitWithWeakLearnersIterationVer1) {
   	      gTolerance);
   EXPECT_NEAR(1.0, (space->GetPoint(1)).GetProbWeight(), gTolerance);
 }
+
+// Tests that fit method gives exactly the same result whatever the number
+// of threads (with weak learners trained concurrently) and that of
+// features with equal gradients the last one is chosen as the descent
+// direction.
+TEST(DMaxEntModelThreadsTest, TestFitWithThreads) {
+  std::vector<double> weights[2];
+  int directions[2];
+  for (int run = 0; run < 2; run++) {
+    EXPECT_EQ(0, SetNumThreads(run == 0 ? 1 : 4));
+    Space *space = new Space();
+    for (int key = 0; key < 500; key++) {
+      double values[2] = {(key % 10) * 0.1, (key % 7) * 0.1};
+      space->AddPoint(key, values, 2, 1.0);
+    }
+    space->Finalize();
+    Sample sample;
+    for (int key = 0; key < 500; key += 7) {
+      sample.push_back(&space->GetPoint(key));
+    }
+    std::vector<Feature*> features;
+    for (int copy = 0; copy < 300; copy++) {
+      features.push_back(new ThresholdFeature(0, 0.45));
+      features.push_back(new ThresholdFeature(1, 0.25));
+      features.push_back(new ProductFeature(0, 1));
+    }
+    for (Feature *feature : features) {
+      feature->ComputeSampleExpectation(sample);
+      feature->SetComplexity(0.0);
+    }
+    std::vector< std::map<double, double> > vtot(2);
+    for (int value = 0; value < 10; value++) {
+      vtot[0][value * 0.1] = value * 0.1 + 0.05;
+      vtot[1][value * 0.1] = value * 0.1 + 0.05;
+    }
+    std::vector<WLearner*> learners;
+    learners.push_back(new TreeLearner(2, 0.0, 0.01, vtot));
+    learners.push_back(new MonomialLearner(2, 0.0, 0.01, 1.0));
+    Sample test;
+    DMaxEntModel *model = new DMaxEntModel(0.0, 0.01, 5, 1, 1, true, space,
+					   sample, &features, learners, test);
+    model->Fit();
+    directions[run] = model->GetDescentDirection();
+    for (auto it = model->FeatureBegin(); it != model->FeatureEnd(); it++) {
+      weights[run].push_back(it->first);
+    }
+  }
+  EXPECT_EQ(directions[0], directions[1]);
+  EXPECT_GE(directions[0], 897);
+  EXPECT_TRUE(weights[0] == weights[1]);
+  EXPECT_GT(weights[0].size(), 900u);
+  EXPECT_EQ(0, SetNumThreads(1));
+}
+
+
+// Tests that weights of points split into many chunks are updated in
+// parallel to the same normalizer bit for bit whatever the number of
+// threads and that the normalizer is the sum of the weights.
+TEST(DMaxEntModelThreadsTest, TestUpdateWithThreads) {
+  double normalizers[2];
+  for (int run = 0; run < 2; run++) {
+    EXPECT_EQ(0, SetNumThreads(run == 0 ? 1 : 4));
+    Space *space = new Space();
+    for (int key = 0; key < 20000; key++) {
+      double values[1] = {(key % 101) * 0.01};
+      space->AddPoint(key, values, 1, 1.0);
+    }
+    space->Finalize();
+    Sample sample;
+    for (int key = 0; key < 20000; key += 3) {
+      sample.push_back(&space->GetPoint(key));
+    }
+    std::vector<Feature*> features;
+    features.push_back(new RawFeature(0));
+    features.push_back(new ProductFeature(0, 0));
+    for (Feature *feature : features) {
+      feature->ComputeSampleExpectation(sample);
+      feature->SetComplexity(0.0);
+    }
+    std::vector<WLearner*> learners;
+    Sample test;
+    DMaxEntModel *model = new DMaxEntModel(0.0, 0.001, 4, 1, 1, true, space,
+					   sample, &features, learners, test);
+    model->Fit();
+    normalizers[run] = model->GetNormalizer();
+    double sum = 0.0;
+    for (int key = 0; key < 20000; key++) {
+      sum += space->GetPoint(key).GetProbWeight();
+    }
+    EXPECT_NEAR(sum, normalizers[run], gTolerance * sum);
+  }
+  EXPECT_EQ(normalizers[0], normalizers[1]);
+  EXPECT_EQ(0, SetNumThreads(1));
+}
+
+// Tests that fit method gives the same result whether gradients of all
+// features are evaluated in each iteration or only of those that may
+// have the largest one.
+TEST(DMaxEntModelLazyGradientsTest, TestFitWithLazyGradients) {
+  std::vector<double> weights[2];
+  int directions[2];
+  for (int run = 0; run < 2; run++) {
+    Space *space = new Space();
+    for (int key = 0; key < 1000; key++) {
+      double values[2] = {(key % 10) * 0.1, (key % 13) / 13.0};
+      space->AddPoint(key, values, 2, 1.0);
+    }
+    space->Finalize();
+    Sample sample;
+    for (int key = 0; key < 1000; key += 3) {
+      if (key % 10 < 4 || key % 13 > 9) {
+	sample.push_back(&space->GetPoint(key));
+      }
+    }
+    std::vector<Feature*> features;
+    for (int bin = 0; bin < 20; bin++) {
+      features.push_back(new ThresholdFeature(0, bin * 0.05));
+      features.push_back(new ThresholdFeature(1, bin * 0.05));
+    }
+    features.push_back(new RawFeature(0));
+    features.push_back(new RawFeature(1));
+    features.push_back(new ProductFeature(0, 1));
+    for (Feature *feature : features) {
+      feature->ComputeSampleExpectation(sample);
+      feature->SetComplexity(0.0);
+    }
+    std::vector<WLearner*> learners;
+    Sample test;
+    DMaxEntModel *model = new DMaxEntModel(0.0, 0.001, 30, 1, 1, false, space,
+					   sample, &features, learners, test);
+    if (run == 1) {
+      model->EnableLazyGradients();
+    }
+    model->Fit();
+    directions[run] = model->GetDescentDirection();
+    for (auto it = model->FeatureBegin(); it != model->FeatureEnd(); it++) {
+      weights[run].push_back(it->first);
+    }
+  }
+  EXPECT_EQ(directions[0], directions[1]);
+  ASSERT_EQ(weights[0].size(), weights[1].size());
+  for (unsigned i = 0; i < weights[0].size(); i++) {
+    EXPECT_NEAR(weights[0][i], weights[1][i], gTolerance);
+  }
+}
+
+// Tests that in block mode features on disjoint raw features are updated
+// together in one pass, whether gradients are evaluated lazily or not.
+TEST(DMaxEntModelBlockTest, TestFitWithFeaturesPerIteration) {
+  std::vector<double> weights[2];
+  for (int run = 0; run < 2; run++) {
+    Space *space = new Space();
+    for (int key = 0; key < 600; key++) {
+      double values[3] = {(key % 10) * 0.1, (key % 7) / 7.0, (key % 3) / 3.0};
+      space->AddPoint(key, values, 3, 1.0);
+    }
+    space->Finalize();
+    Sample sample;
+    for (int key = 0; key < 600; key += 2) {
+      if (key % 10 < 3 || key % 7 == 5 || key % 3 == 0) {
+	sample.push_back(&space->GetPoint(key));
+      }
+    }
+    std::vector<Feature*> features;
+    features.push_back(new RawFeature(0));
+    features.push_back(new RawFeature(1));
+    features.push_back(new RawFeature(2));
+    features.push_back(new ProductFeature(0, 1));
+    features.push_back(new ThresholdFeature(2, 0.5));
+    for (Feature *feature : features) {
+      feature->ComputeSampleExpectation(sample);
+      feature->SetComplexity(0.0);
+    }
+    std::vector<WLearner*> learners;
+    Sample test;
+    DMaxEntModel *model = new DMaxEntModel(0.0, 0.001, 1, 1, 1, false, space,
+					   sample, &features, learners, test);
+    EXPECT_EQ(-1, model->SetFeaturesPerIteration(0));
+    EXPECT_EQ(0, model->SetFeaturesPerIteration(3));
+    if (run == 1) {
+      model->EnableLazyGradients();
+    }
+    model->Fit();
+    std::vector<int> used_indices;
+    int num_updated = 0;
+    for (auto it = model->FeatureBegin(); it != model->FeatureEnd(); it++) {
+      weights[run].push_back(it->first);
+      if (it->first != 0.0) {
+	num_updated++;
+	std::vector<int> indices;
+	EXPECT_EQ(0, it->second->RawFeatureIndices(&indices));
+	for (int index : indices) {
+	  EXPECT_TRUE(std::find(used_indices.begin(), used_indices.end(),
+				index) == used_indices.end());
+	  used_indices.push_back(index);
+	}
+      }
+    }
+    EXPECT_EQ(3, num_updated);
+    double sum = 0.0;
+    for (int key = 0; key < 600; key++) {
+      Point &point = space->GetPoint(key);
+      double score = 0.0;
+      for (auto it = model->FeatureBegin(); it != model->FeatureEnd(); it++) {
+	score += it->first * it->second->FeatureMap(&point);
+      }
+      EXPECT_NEAR(std::exp(score), point.GetProbWeight(), gTolerance);
+      sum += point.GetProbWeight();
+    }
+    EXPECT_NEAR(sum, model->GetNormalizer(), gTolerance * sum);
+  }
+  ASSERT_EQ(weights[0].size(), weights[1].size());
+  for (unsigned i = 0; i < weights[0].size(); i++) {
+    EXPECT_NEAR(weights[0][i], weights[1][i], gTolerance);
+  }
+}
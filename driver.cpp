@@ -4,10 +4,12 @@
 #include "dmaxent.hpp"
 #include "space.hpp"
 #include "feature.hpp"
+#include "pool.hpp"
 #include "constants.hpp"
 #include <stdio.h>
 #include <dirent.h>
 #include <fstream>
+#include <iterator>
 #include <cmath>
 #include <algorithm>
 
@@ -19,14 +21,50 @@ DEFINE_int32(dmaxent_version, 1,
 DEFINE_double(feature_bound, 1.0,
 	      "Uniform bound bound on features used.");
 DEFINE_string(data_path, "", "Path to a file with the data set.");
+DEFINE_string(data_format, "text", "Format of the data set: text, binary "
+	      "or chunked. Binary files are memory-mapped and can be produced "
+	      "from text files using --binary_output_path. Chunked format "
+	      "reads the same binary files block by block for data sets "
+	      "that do not fit in memory.");
+DEFINE_int32(block_size, 65536, "Number of points per block read from "
+	     "a binary file in chunked format.");
+DEFINE_string(binary_output_path, "", "If not empty, the data set is saved "
+	      "in binary format to this path once it is read.");
 DEFINE_int32(seed, 1, "Seed for random number generator.");
 DEFINE_int32(train_size, 1, "Size of the training set.");
 DEFINE_int32(num_bins, 10, "Number of bins used for threshold features.");
 DEFINE_bool(raw, false, "If true raw features are used.");
-DEFINE_bool(prod, false, "If true product features are used.");
+DEFINE_bool(prod, false, "If true product features are used (one for "
+	    "each unordered pair of raw features, including squares).");
 DEFINE_bool(th, false, "If true threshold features are used.");
 DEFINE_bool(mon, false, "If true monomial features are used.");
 DEFINE_bool(tr, false, "If true tree features are used.");
+DEFINE_bool(quantize, false, "If true raw features are also stored as bin "
+	    "codes which are used by threshold features and tree learner.");
+DEFINE_bool(drop_raw_columns, false, "If true raw feature values are released "
+	    "once they are quantized. Requires --quantize and can not be used "
+	    "with raw, product or monomial features.");
+DEFINE_bool(pack_threshold_features, false, "If true values of threshold "
+	    "features at all points are stored as bits, so that their "
+	    "expectations are computed from these bits.");
+DEFINE_bool(deduplicate, false, "If true points with identical raw features "
+	    "are merged into a single point when the data set is read.");
+DEFINE_double(sparse_density, 0.0, "Raw features with at most this fraction "
+	      "of non-zero values are stored sparsely. Zero disables sparse "
+	      "storage.");
+DEFINE_int32(num_shards, 1, "Number of shards the space is split into. "
+	     "Shards are placed on NUMA nodes round-robin and processed in "
+	     "parallel. Requires text data format.");
+DEFINE_int32(feature_cache_mb, 0, "Size (in megabytes) of the cache of "
+	     "feature values at all points of the space. Zero disables "
+	     "the cache.");
+DEFINE_int32(threads, 1, "Number of threads used to evaluate features. "
+	     "Results do not depend on the number of threads.");
+DEFINE_bool(lazy_gradients, false, "If true each iteration only evaluates "
+	    "features whose gradient may be the largest one. Requires "
+	    "absolute values of all features to be at most feature_bound.");
+DEFINE_int32(features_per_iteration, 1, "Number of features on disjoint "
+	     "raw features updated in each iteration of coordinate descent.");
 DEFINE_bool(stop_if_converged, true, "If true coordinate descent will "
 	    "terminate once gradient is sufficiently small.");
 
@@ -40,7 +78,20 @@ void ValidateFlags() {
   CHECK(FLAGS_dmaxent_version == 1 || FLAGS_dmaxent_version == 2);
   CHECK_GE(FLAGS_feature_bound, 0);
   CHECK(!FLAGS_data_path.empty());
+  CHECK(FLAGS_data_format == "text" || FLAGS_data_format == "binary" ||
+	FLAGS_data_format == "chunked");
+  CHECK_GE(FLAGS_block_size, 1);
   CHECK(FLAGS_raw || FLAGS_prod || FLAGS_th || FLAGS_mon || FLAGS_tr);
+  CHECK(!FLAGS_quantize || FLAGS_th || FLAGS_tr);
+  CHECK(!FLAGS_drop_raw_columns ||
+	(FLAGS_quantize && !FLAGS_raw && !FLAGS_prod && !FLAGS_mon));
+  CHECK(!FLAGS_pack_threshold_features || FLAGS_th);
+  CHECK(FLAGS_sparse_density >= 0 && FLAGS_sparse_density <= 1);
+  CHECK_GE(FLAGS_num_shards, 1);
+  CHECK_GE(FLAGS_feature_cache_mb, 0);
+  CHECK(FLAGS_num_shards == 1 || FLAGS_data_format == "text");
+  CHECK_GE(FLAGS_threads, 1);
+  CHECK_GE(FLAGS_features_per_iteration, 1);
 }
 
 // Splits a given string using specified delimeter character and
@@ -59,66 +110,114 @@ void split(const std::string &s, const char delim,
   }
 }
 
-// A functor to compare pointers to Points. The points are compared
-// based on the raw feature values at an index that defines this
-// functor.
-class PointLessThanOperator : std::binary_function<Point*, Point*, bool> {
-public:
-  PointLessThanOperator(int index) {
-    raw_feature_index = index;
+// Stores values of the specified raw feature at all points of the space
+// together with multiplicities of these points in sorted_values, sorted
+// in ascending order of values. Values are read from the space at once,
+// so that chunked spaces are streamed instead of read point by point.
+void SortedRawFeatureValues(Space *space, int index,
+			    std::vector<std::pair<double, int> >
+			    *sorted_values) {
+  std::vector<int> keys(space->NumPoints());
+  for (int key = 0; key < space->NumPoints(); key++) {
+    keys[key] = key;
   }
-  bool operator()(Point* point1, Point* point2) {
-    return (point1->GetRawFeature(raw_feature_index) <
-	    point2->GetRawFeature(raw_feature_index));
+  std::vector<double> values;
+  space->GatherRawFeature(index, keys, &values);
+  sorted_values->clear();
+  for (int key = 0; key < space->NumPoints(); key++) {
+    sorted_values->push_back(std::make_pair(values[key],
+					    space->GetMultiplicity(key)));
   }
-private:
-  int raw_feature_index;
-};
+  std::sort(sorted_values->begin(), sorted_values->end());
+}
 
-// Reads in data from a file specified by the given file name.
+// Reads in points from a text file specified by the given file name.
 // Each line in the file is assumed to contain a data on a particular
 // point in space in the following format:
 //   feature_value_1 .... feature_value_k num_of_observations_at_this_point
-// Stores the points in the provided space and adds appropriate
-// observations to the sample. Sample is split between training and
-// testing according to specified value.
-// Builds raw, product and threshold features, computes their expectations
-// and stores them in feature vector.
-void ReadData(std::string filename, int train_size,
-	      Space *space, std::vector<Feature*> *features,
-	      std::vector<WLearner*> *weak_learners,
-	      Sample *train_sample, Sample *test_sample) {
+// Points with missing values (".") are skipped. Stores the points in
+// the provided space and the number of observations at each point
+// in counts. Observations at points that are merged by deduplication
+// in the space are added up.
+// Storage of the space is reserved for all the lines of the file upfront
+// and values of each line are parsed into a single reused buffer.
+void ReadTextData(std::string filename, Space *space,
+		  std::vector<int> *counts) {
   std::ifstream file(filename);
   CHECK(file.is_open());
+  int num_lines = std::count(std::istreambuf_iterator<char>(file),
+			     std::istreambuf_iterator<char>(), '\n');
+  file.clear();
+  file.seekg(0);
+  CHECK_EQ(0, space->Reserve(num_lines, 0));
+  counts->reserve(num_lines);
   std::string line;
   std::vector<std::string> elems;
-  Point *point;
-  std::vector<int> counts;
-  int point_count = 0;
+  std::vector<double> values;
   bool missing;
 
   // Read in data from a file
   while (!std::getline(file, line).eof()) {
     elems.clear();
     split(line, ' ', elems);
-    point = new Point(point_count);
+    values.clear();
     missing = false;
     for (unsigned index = 0; index < elems.size() - 1; index++) {
       if (elems[index] == ".") {
 	missing = true;
 	continue;
       }
-      point->AddRawFeature(atof(elems[index].c_str()));
+      values.push_back(atof(elems[index].c_str()));
     }
     if (missing) {
       continue;
     }
-    counts.push_back(atoi((elems.back()).c_str()));
-    space->AddPoint(*point);
-    point_count++;
+    int key = space->AddPoint(space->NumPoints(), values.data(),
+			      values.size(), 1.0);
+    if (key == (int) counts->size()) {
+      counts->push_back(0);
+    }
+    (*counts)[key] += atoi((elems.back()).c_str());
   }
   space->Finalize();
-  
+}
+
+// Reads in data from a file specified by the given file name.
+// The file is either a text file (see ReadTextData) or a binary space
+// file (see Space::WriteBinary) depending on --data_format. Binary files
+// are either memory-mapped or opened as chunked spaces.
+// Stores the points in the provided space and adds appropriate
+// observations to the sample. Sample is split between training and
+// testing according to specified value.
+// Builds raw, product and threshold features, computes their expectations
+// and stores them in feature vector.
+void ReadData(std::string filename, int train_size,
+	      Space *space, std::vector<Feature*> *features,
+	      std::vector<WLearner*> *weak_learners,
+	      Sample *train_sample, Sample *test_sample) {
+  std::vector<int> counts;
+  if (FLAGS_data_format == "binary") {
+    CHECK_EQ(0, space->MapBinary(filename, &counts));
+  } else if (FLAGS_data_format == "chunked") {
+    CHECK_EQ(0, space->OpenChunked(filename, FLAGS_block_size, &counts));
+  } else {
+    if (FLAGS_deduplicate) {
+      CHECK_EQ(0, space->EnableDeduplication());
+    }
+    ReadTextData(filename, space, &counts);
+  }
+  if (!FLAGS_binary_output_path.empty()) {
+    CHECK_EQ(0, space->WriteBinary(FLAGS_binary_output_path, counts));
+  }
+  if (FLAGS_sparse_density > 0) {
+    VLOG(1) << "Number of sparse raw features: "
+	    << space->Sparsify(FLAGS_sparse_density);
+  }
+  if (FLAGS_num_shards > 1) {
+    CHECK_EQ(0, space->Shard(FLAGS_num_shards));
+  }
+  int point_count = space->NumPoints();
+
   // Partition sample points randomly into training and testing
   Sample all_sample;
   for (unsigned index = 0; index < counts.size(); index++) {
@@ -126,6 +225,15 @@ void ReadData(std::string filename, int train_size,
       all_sample.push_back(&(space->GetPoint(index)));
     }
   }
+  if (space->IsChunked()) {
+    // Sample points are evaluated one by one, so their raw features are
+    // kept in memory rather than read from the file value by value.
+    std::vector<int> sample_keys;
+    for (Example example : all_sample) {
+      sample_keys.push_back(example->GetKey());
+    }
+    CHECK_EQ(0, space->KeepRawFeatures(sample_keys));
+  }
 
   std::random_shuffle(all_sample.begin(), all_sample.end());
   for (unsigned index = 0; index < all_sample.size(); index++) {
@@ -136,10 +244,7 @@ void ReadData(std::string filename, int train_size,
     }
   }
 
-  int num_raw_features = 0;
-  if (point_count > 0) {
-    num_raw_features = (space->GetPoint(0)).NumRawFeatures();
-  }
+  int num_raw_features = space->NumRawFeatures();
 
   // Add raw features
   if (FLAGS_raw) {
@@ -155,18 +260,21 @@ void ReadData(std::string filename, int train_size,
     }
   }
 
-  // Add product features
+  // Add product features. Products are symmetric, so only one feature
+  // is added for each unordered pair of raw features.
   if (FLAGS_prod) {
     ProductFeature *prod_feature;
+    int prod_feature_count = 0;
     for (unsigned index_i = 0; index_i < num_raw_features; index_i++) {
-      for (unsigned index_j = 0; index_j < num_raw_features; index_j++) {
+      for (unsigned index_j = index_i; index_j < num_raw_features; index_j++) {
 	prod_feature = new ProductFeature(index_i, index_j);
 	prod_feature->ComputeSampleExpectation(*train_sample);
 	features->push_back(prod_feature);
+	prod_feature_count++;
       }
     }
-    if (num_raw_features > 0) {
-      prod_feature->SetComplexity(std::sqrt(4 * std::log(num_raw_features) /
+    if (prod_feature_count > 0) {
+      prod_feature->SetComplexity(std::sqrt(2 * std::log(prod_feature_count) /
 					    train_size));
     }
   }
@@ -180,57 +288,59 @@ void ReadData(std::string filename, int train_size,
   }
 
   // Add threshold features or tree weak learner
-  std::vector<Point*> all_points;
-  for (unsigned index = 0; index < point_count; index++) {
-    all_points.push_back(&(space->GetPoint(index)));
-  }
-
   if (FLAGS_tr || FLAGS_th) {
 
     // Thresholds are chosen so that resulting bins have
     // (approximately) same number of points.
     // The difficulty is that feature values need not be unique
-    int bin_size = point_count / FLAGS_num_bins;
+    // Points merged by deduplication are counted one by one, so that
+    // thresholds do not depend on deduplication.
+    int bin_size = space->TotalMultiplicity() / FLAGS_num_bins;
     int bin_count;
     double previous_value, value, current_value;
-    Feature* threshold_feature;
+    ThresholdFeature* threshold_feature;
+    std::vector<ThresholdFeature*> threshold_features;
     int threshold_feature_count = 0;
     std::vector<std::vector<double>> thresholds;
+    std::vector<std::pair<double, int> > sorted_values;
     for (unsigned index = 0; index < num_raw_features; index++) {
-      std::sort(all_points.begin(), all_points.end(),
-		PointLessThanOperator(index));
+      SortedRawFeatureValues(space, index, &sorted_values);
       bin_count = 0;
-      current_value = all_points.at(0)->GetRawFeature(index);
+      current_value = sorted_values.at(0).first;
       previous_value = current_value;
       std::vector<double> thresholds_for_this_feature;
       VLOG(1) << "Thresholds for feature #" << index << ":";
-      for (auto point : all_points) {
-	value = point->GetRawFeature(index);
-	// Every time we have observed bin_size elements we put
-	// a threshold. The only exception is when we have not seen
-	// new values since the last threshold.
-	if ((bin_count > bin_size) && (value != previous_value)) {
-	  if (FLAGS_th) {
-	    threshold_feature =
-	      new ThresholdFeature(index, 0.5 * (value + previous_value));
-	    threshold_feature->ComputeSampleExpectation(*train_sample);
-	    features->push_back(threshold_feature);
-	    threshold_feature_count++;
-	  }
-	  if (FLAGS_tr) {
+      for (auto value_multiplicity : sorted_values) {
+	value = value_multiplicity.first;
+	for (int copy = 0; copy < value_multiplicity.second; copy++) {
+	  // Every time we have observed bin_size elements we put
+	  // a threshold. The only exception is when we have not seen
+	  // new values since the last threshold.
+	  if ((bin_count > bin_size) && (value != previous_value)) {
 	    thresholds_for_this_feature.push_back(0.5 *
 						  (value + previous_value));
+	    if (FLAGS_th) {
+	      threshold_feature =
+		new ThresholdFeature(index, 0.5 * (value + previous_value),
+				     thresholds_for_this_feature.size() - 1);
+	      if (!FLAGS_pack_threshold_features) {
+		threshold_feature->ComputeSampleExpectation(*train_sample);
+	      }
+	      features->push_back(threshold_feature);
+	      threshold_features.push_back(threshold_feature);
+	      threshold_feature_count++;
+	    }
+	    VLOG(1) << 0.5 * (value + previous_value);
+	    current_value = value;
+	    previous_value = current_value;
+	    bin_count = 0; // will be reset to one at the end of iteration
 	  }
-	  VLOG(1) << 0.5 * (value + previous_value);
-	  current_value = value;
-	  previous_value = current_value;
-	  bin_count = 0; // will be reset to one at the end of iteration
-	}
-	if (value != current_value) {
-	  previous_value = current_value;
-	  current_value = value;
+	  if (value != current_value) {
+	    previous_value = current_value;
+	    current_value = value;
+	  }
+	  bin_count++;
 	}
-	bin_count++;
       }
       thresholds_for_this_feature.push_back(FLAGS_feature_bound + 1);
       thresholds.push_back(thresholds_for_this_feature);
@@ -246,17 +356,15 @@ void ReadData(std::string filename, int train_size,
       std::vector< std::map<double, double> > values_to_thresholds;
       std::map<double, double> vtot;
       for (unsigned feature = 0; feature < num_raw_features; feature++) {
-	std::sort(all_points.begin(), all_points.end(),
-		  PointLessThanOperator(feature));
+	SortedRawFeatureValues(space, feature, &sorted_values);
 	int next_threshold = 0;
 	//printf("feature=%d: %f ", feature, thresholds[feature][next_threshold]);
-	for (auto point : all_points) {
-	  if (point->GetRawFeature(feature) >
-	      thresholds[feature][next_threshold]) {
+	for (auto value_multiplicity : sorted_values) {
+	  if (value_multiplicity.first > thresholds[feature][next_threshold]) {
 	    next_threshold++;
 	    //printf("%f ", thresholds[feature][next_threshold]);
 	  }
-	  vtot[point->GetRawFeature(feature)] =
+	  vtot[value_multiplicity.first] =
 	    thresholds[feature][next_threshold];
 	}
 	//printf("\n");
@@ -268,10 +376,31 @@ void ReadData(std::string filename, int train_size,
 					       FLAGS_model_parameter_beta,
 					       values_to_thresholds));
     }
+    if (FLAGS_quantize) {
+      // Bin codes are built from the same thresholds (including the last
+      // one used by the tree learner) so that threshold features and
+      // tree learner can use them instead of raw values.
+      for (unsigned index = 0; index < num_raw_features; index++) {
+	CHECK_EQ(0, space->QuantizeRawFeature(index, thresholds[index]));
+	if (FLAGS_drop_raw_columns) {
+	  space->ReleaseRawFeatureColumn(index);
+	}
+      }
+    }
+    if (FLAGS_pack_threshold_features) {
+      // Features are packed once the space is quantized, so that they are
+      // evaluated using bin codes if they are available.
+      PackedSample packed_sample;
+      CHECK_EQ(0, packed_sample.Pack(*train_sample, *space));
+      for (ThresholdFeature *feature : threshold_features) {
+	feature->Pack(*space);
+	CHECK_EQ(0, feature->ComputePackedSampleExpectation(packed_sample));
+      }
+    }
   }
 
   // Log some of the statistics
-  VLOG(1) << "Number of (active) points: " << all_points.size();
+  VLOG(1) << "Number of (active) points: " << point_count;
   VLOG(1) << "Number of raw features: " << num_raw_features;
   VLOG(1) << "Number of all features: " << features->size();
   VLOG(1) << "Number of sample points: " << all_sample.size();
@@ -284,6 +413,7 @@ int main(int argc, char** argv) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
   google::InitGoogleLogging(argv[0]);
   ValidateFlags();
+  CHECK_EQ(0, SetNumThreads(FLAGS_threads));
 
   srand(FLAGS_seed);
 
@@ -305,6 +435,13 @@ int main(int argc, char** argv) {
   					 &features,
 					 weak_learners,
 					 test_sample);
+  if (FLAGS_feature_cache_mb > 0) {
+    model->EnableFeatureCache(size_t(FLAGS_feature_cache_mb) << 20);
+  }
+  if (FLAGS_lazy_gradients) {
+    model->EnableLazyGradients();
+  }
+  CHECK_EQ(0, model->SetFeaturesPerIteration(FLAGS_features_per_iteration));
   model->Fit();
 
   double model_log_loss = model->LogLoss(&test_sample);
@@ -1,6 +1,10 @@
 #include <cmath>
 #include <queue>
+#include <algorithm>
+#include <iterator>
 #include "feature.hpp"
+#include "kernels.hpp"
+#include "pool.hpp"
 #include "tree.hpp"
 
 // Static variables
@@ -8,6 +12,11 @@ double RawFeature::complexity = 0;
 double ProductFeature::complexity = 0;
 double ThresholdFeature::complexity = 0;
 
+// Number of bytes of weights, raw features and values of a tile of points
+// evaluated together by ComputeUnnormalizedPopulationExpectations.
+// This is the size of L2 cache on most of the current hardware.
+static const int gExpectationTileBytes = 256 << 10;
+
 // Returns sample expectation of the given feature.
 double Feature::GetSampleExpectation() {
   return sample_expectation;
@@ -20,14 +29,23 @@ double Feature::GetUnnormalizedPopulationExpectation() {
   return population_expectation;
 }
 
+// Sets un-normalized population expectation of the given feature to
+// the value computed elsewhere (e.g. from values in a FeatureCache).
+void Feature::SetUnnormalizedPopulationExpectation(double value) {
+  population_expectation = value;
+}
+
 // Computes a sample expectation of the given feature
-// and stores it internally.
+// and stores it internally. The feature is evaluated at all the examples
+// of the sample at once (see FeatureMapBatch).
 void Feature::ComputeSampleExpectation(Sample &sample) {
+  std::vector<double> values(sample.size());
+  FeatureMapBatch(sample.data(), sample.size(), values.data());
   double sum = 0.0;
   int count = 0;
-  for (auto e : sample) {
+  for (double value : values) {
     count++;
-    sum += FeatureMap(e);
+    sum += value;
   }
   sample_expectation = sum / count;
 }
@@ -36,12 +54,146 @@ void Feature::ComputeSampleExpectation(Sample &sample) {
 // wrt the weights of each point in the provided space.
 // To get expectation one needs to further divide the result
 // by the sum of weights of all the points in the space.
+// Points are visited block by block (see Space::ForEachShard) and only
+// the raw features this feature depends on are read if they are known.
 void Feature::ComputeUnnormalizedPopulationExpectation(Space &space) {
-  double expectation = 0.0;
-  for (auto &p : space) {
-    expectation += p.GetProbWeight() * FeatureMap(&p);
+  std::vector<int> indices;
+  bool known_indices = (RawFeatureIndices(&indices) == 0);
+  std::vector<double> partials(space.NumShards(), 0.0);
+  space.ForEachShard(known_indices ? &indices : NULL,
+		     [&](SpaceBlock &block, int shard) {
+      std::vector<double> values(block.size);
+      FeatureMapBlock(block, values.data());
+      partials[shard] += WeightedSum(block.weights, values.data(), block.size);
+    });
+  population_expectation =  SumShardPartials(partials);
+}
+
+// Stores count bits of a bit array starting at the given position
+// in values as zeros and ones.
+static void UnpackBits(const std::vector<uint64_t> &bits, int begin,
+		       int count, double *values) {
+  for (int i = 0; i < count; i++) {
+    int key = begin + i;
+    values[i] = (bits[key / 64] >> (key % 64)) & 1;
+  }
+}
+
+// Returns the total weight of points of the space whose bits are set in
+// the given bit array indexed by keys of points. Shards of the space are
+// summed up in parallel (see Space::ForEachShard).
+static double PackedWeightSum(const std::vector<uint64_t> &bits,
+			      Space &space) {
+  std::vector<double> partials(space.NumShards(), 0.0);
+  std::vector<int> indices;
+  space.ForEachShard(&indices, [&](SpaceBlock &block, int shard) {
+      partials[shard] += MaskedWeightSum(block.weights, bits.data(),
+					 block.begin, block.size);
+    });
+  return SumShardPartials(partials);
+}
+
+// Stores numbers of occurrences of points in the given sample as bit
+// planes. Returns 0 on success and -1 if some example of the sample is
+// not a point of the given space.
+int PackedSample::Pack(Sample &sample, Space &space) {
+  std::vector<int> counts(space.NumPoints(), 0);
+  int max_count = 0;
+  for (Example example : sample) {
+    int key = example->GetKey();
+    if (key < 0 || key >= space.NumPoints() ||
+	&space.GetPoint(key) != example) {
+      return -1;
+    }
+    counts[key]++;
+    max_count = std::max(max_count, counts[key]);
+  }
+  this->space = &space;
+  size = sample.size();
+  planes.clear();
+  for (int plane = 0; (max_count >> plane) > 0; plane++) {
+    std::vector<uint64_t> bits((space.NumPoints() + 63) / 64, 0);
+    for (unsigned key = 0; key < counts.size(); key++) {
+      bits[key / 64] |= uint64_t((counts[key] >> plane) & 1) << (key % 64);
+    }
+    planes.push_back(bits);
+  }
+  return 0;
+}
+
+// Returns the number of examples of this sample whose bits are set in
+// the given bit array indexed by keys of points.
+uint64_t PackedSample::CountOnes(const std::vector<uint64_t> &bits) const {
+  uint64_t count = 0;
+  for (unsigned plane = 0; plane < planes.size(); plane++) {
+    size_t words = std::min(bits.size(), planes[plane].size());
+    count += AndPopcount(planes[plane].data(), bits.data(), words) << plane;
+  }
+  return count;
+}
+
+// Returns the sum of partial results of shards (see Space::ForEachShard)
+// added up in the order of shards, so that the result does not depend on
+// the order in which shards are processed.
+double SumShardPartials(const std::vector<double> &partials) {
+  double sum = 0.0;
+  for (double partial : partials) {
+    sum += partial;
+  }
+  return sum;
+}
+
+// Stores in indices the sorted indices of raw features this feature
+// depends on. Returns 0 on success and -1 if these are not known.
+int Feature::RawFeatureIndices(std::vector<int> * /* indices */) {
+  return -1;
+}
+
+// Stores the values of this feature at the points of the given block
+// in values, i.e. values[offset] is the value at the point with key
+// block.begin + offset. Points of the block are evaluated as a batch.
+void Feature::FeatureMapBlock(const SpaceBlock &block, double *values) {
+  std::vector<Example> examples(block.size);
+  for (int offset = 0; offset < block.size; offset++) {
+    examples[offset] = &(block.space->GetPoint(block.begin + offset));
+  }
+  FeatureMapBatch(examples.data(), block.size, values);
+}
+
+// Stores the values of this feature at count given examples in values.
+// Features override this method with a loop that avoids calling
+// the virtual FeatureMap for every example.
+void Feature::FeatureMapBatch(const Example *examples, int count,
+			      double *values) {
+  for (int i = 0; i < count; i++) {
+    values[i] = FeatureMap(examples[i]);
   }
-  population_expectation =  expectation;
+}
+
+// Stores in keys the sorted keys of points in the given space at which
+// this feature may be non-zero. Returns 0 on success and -1 if such keys
+// are not known, in which case feature needs to be evaluated everywhere.
+int Feature::NonZeroKeys(Space & /* space */, std::vector<int> * /* keys */) {
+  return -1;
+}
+
+// Returns true iff values of this feature at all points of the given space
+// are stored as bits (see ThresholdFeature::Pack), so that its population
+// expectation is a masked sum of weights that needs neither raw features
+// nor cached values.
+bool Feature::IsPacked(Space & /* space */) {
+  return false;
+}
+
+// Replaces keys with the keys that are also keys of non-zero values of
+// the specified sparse raw feature.
+static void IntersectNonZeroKeys(Space &space, int index,
+				 std::vector<int> *keys) {
+  std::vector<int> intersection;
+  std::set_intersection(keys->begin(), keys->end(), space.SparseKeys(index),
+			space.SparseKeys(index) + space.NumNonZeros(index),
+			std::back_inserter(intersection));
+  keys->swap(intersection);
 }
 
 // Constructor for a raw feature. Client needs to specify
@@ -57,6 +209,60 @@ double RawFeature::FeatureMap(Point *point) {
   return point->GetRawFeature(index);
 }
 
+// Computes un-normalized population expectation of this raw feature
+// by streaming the corresponding column of the space block by block.
+// Only non-zero values are visited if the raw feature is stored sparsely.
+void RawFeature::ComputeUnnormalizedPopulationExpectation(Space &space) {
+  if (space.IsSparse(index)) {
+    const int *keys = space.SparseKeys(index);
+    const double *values = space.SparseValues(index);
+    Span<double> weights = space.ProbWeights();
+    double expectation = 0.0;
+    for (int i = 0; i < space.NumNonZeros(index); i++) {
+      expectation += weights[keys[i]] * values[i];
+    }
+    population_expectation = expectation;
+    return;
+  }
+  Feature::ComputeUnnormalizedPopulationExpectation(space);
+}
+
+// Stores keys of non-zero values of this raw feature if it is stored
+// sparsely in the given space. Returns 0 on success and -1 otherwise.
+int RawFeature::NonZeroKeys(Space &space, std::vector<int> *keys) {
+  if (!space.IsSparse(index)) {
+    return -1;
+  }
+  keys->assign(space.SparseKeys(index),
+	       space.SparseKeys(index) + space.NumNonZeros(index));
+  return 0;
+}
+
+// Stores the index of this raw feature in indices. Returns 0.
+int RawFeature::RawFeatureIndices(std::vector<int> *indices) {
+  indices->assign(1, index);
+  return 0;
+}
+
+// Stores the values of this raw feature at count given examples in values.
+void RawFeature::FeatureMapBatch(const Example *examples, int count,
+				 double *values) {
+  for (int i = 0; i < count; i++) {
+    values[i] = examples[i]->GetRawFeature(index);
+  }
+}
+
+// Stores the values of this raw feature at the points of the given block
+// in values. Values are copied from the block if it provides them.
+void RawFeature::FeatureMapBlock(const SpaceBlock &block, double *values) {
+  const double *column = block.RawFeatureColumn(index);
+  if (column == NULL) {
+    Feature::FeatureMapBlock(block, values);
+    return;
+  }
+  std::copy(column, column + block.size, values);
+}
+
 // Returns complexity of the class of raw features.
 double RawFeature::Complexity() {
   return complexity;
@@ -83,6 +289,98 @@ double ProductFeature::FeatureMap(Point *point) {
 	  point->GetRawFeature(second_index));
 }
 
+// Computes un-normalized population expectation of this product feature
+// by streaming the two corresponding columns of the space block by block.
+// If one of the raw features is stored sparsely, only its non-zeros are
+// visited.
+void ProductFeature::ComputeUnnormalizedPopulationExpectation(Space &space) {
+  std::vector<int> keys;
+  if (NonZeroKeys(space, &keys) == 0) {
+    std::vector<double> first_values;
+    std::vector<double> second_values;
+    space.GatherRawFeature(first_index, keys, &first_values);
+    space.GatherRawFeature(second_index, keys, &second_values);
+    Span<double> weights = space.ProbWeights();
+    double expectation = 0.0;
+    for (unsigned i = 0; i < keys.size(); i++) {
+      expectation += weights[keys[i]] * first_values[i] * second_values[i];
+    }
+    population_expectation = expectation;
+    return;
+  }
+  if (!space.IsDense(first_index) || !space.IsDense(second_index)) {
+    Feature::ComputeUnnormalizedPopulationExpectation(space);
+    return;
+  }
+  std::vector<int> indices;
+  RawFeatureIndices(&indices);
+  std::vector<double> partials(space.NumShards(), 0.0);
+  space.ForEachShard(&indices, [&](SpaceBlock &block, int shard) {
+      partials[shard] += WeightedProductSum(block.weights,
+					    block.columns[first_index],
+					    block.columns[second_index],
+					    block.size);
+    });
+  population_expectation = SumShardPartials(partials);
+}
+
+// Stores keys of points at which this product feature may be non-zero if
+// at least one of its raw features is stored sparsely in the given space.
+// Returns 0 on success and -1 otherwise.
+int ProductFeature::NonZeroKeys(Space &space, std::vector<int> *keys) {
+  if (space.IsSparse(first_index)) {
+    keys->assign(space.SparseKeys(first_index), space.SparseKeys(first_index)
+		 + space.NumNonZeros(first_index));
+    if (space.IsSparse(second_index) && second_index != first_index) {
+      IntersectNonZeroKeys(space, second_index, keys);
+    }
+    return 0;
+  }
+  if (space.IsSparse(second_index)) {
+    keys->assign(space.SparseKeys(second_index),
+		 space.SparseKeys(second_index) +
+		 space.NumNonZeros(second_index));
+    return 0;
+  }
+  return -1;
+}
+
+// Stores the indices of the two raw features of this product feature
+// in indices. Returns 0.
+int ProductFeature::RawFeatureIndices(std::vector<int> *indices) {
+  indices->assign(1, std::min(first_index, second_index));
+  if (second_index != first_index) {
+    indices->push_back(std::max(first_index, second_index));
+  }
+  return 0;
+}
+
+// Stores the values of this product feature at count given examples
+// in values.
+void ProductFeature::FeatureMapBatch(const Example *examples, int count,
+				     double *values) {
+  for (int i = 0; i < count; i++) {
+    values[i] = (examples[i]->GetRawFeature(first_index) *
+		 examples[i]->GetRawFeature(second_index));
+  }
+}
+
+// Stores the values of this product feature at the points of the given
+// block in values. Values of raw features are read from the block if
+// it provides them.
+void ProductFeature::FeatureMapBlock(const SpaceBlock &block,
+				     double *values) {
+  const double *first_column = block.RawFeatureColumn(first_index);
+  const double *second_column = block.RawFeatureColumn(second_index);
+  if (first_column == NULL || second_column == NULL) {
+    Feature::FeatureMapBlock(block, values);
+    return;
+  }
+  for (int offset = 0; offset < block.size; offset++) {
+    values[offset] = first_column[offset] * second_column[offset];
+  }
+}
+
 // Returns complexity of the class of prodcut features.
 double ProductFeature::Complexity() {
   return complexity;
@@ -99,6 +397,20 @@ void ProductFeature::SetComplexity(double value) {
 ThresholdFeature::ThresholdFeature(int i, double theta) {
   index = i;
   threshold = theta;
+  bin = -1;
+  packed_space = NULL;
+  sample_expectation = NAN;
+  population_expectation = NAN;
+}
+
+// Constructor for threshold feature over a quantized raw feature. Client
+// needs to specify index of raw feature, threshold value and the index
+// of this threshold among the thresholds used to quantize the raw feature.
+ThresholdFeature::ThresholdFeature(int i, double theta, int threshold_bin) {
+  index = i;
+  threshold = theta;
+  bin = threshold_bin;
+  packed_space = NULL;
   sample_expectation = NAN;
   population_expectation = NAN;
 }
@@ -108,9 +420,193 @@ ThresholdFeature::ThresholdFeature(int i, double theta) {
 // and the value is 0 otherwise. According to this definition,
 // if raw feature is missing (i.e. is NAN) then the value is also 0.
 double ThresholdFeature::FeatureMap(Point *point) {
+  if (bin >= 0) {
+    int code = point->GetBinCode(index);
+    if (code >= 0) {
+      return ((code > bin) ? 1 : 0);
+    }
+  }
   return ((point->GetRawFeature(index) > threshold) ? 1 : 0);
 }
 
+// Returns the index of the raw feature of this threshold feature.
+int ThresholdFeature::GetIndex() {
+  return index;
+}
+
+// Returns the threshold of this threshold feature.
+double ThresholdFeature::GetThreshold() {
+  return threshold;
+}
+
+// Returns the index of the threshold among quantization thresholds of
+// the raw feature (or -1 if it is not known).
+int ThresholdFeature::GetBin() {
+  return bin;
+}
+
+// Stores the value of this feature at every point of the given space as
+// a single bit. Values at points of this space are then read from these
+// bits (see FeatureMapBlock and ComputePackedSampleExpectation).
+void ThresholdFeature::Pack(Space &space) {
+  packed_space = NULL;
+  std::vector<uint64_t>((space.NumPoints() + 63) / 64, 0).swap(packed_bits);
+  std::vector<int> indices(1, index);
+  space.ForEachBlock(&indices, [&](SpaceBlock &block) {
+      std::vector<double> values(block.size);
+      FeatureMapBlock(block, values.data());
+      for (int offset = 0; offset < block.size; offset++) {
+	int key = block.begin + offset;
+	packed_bits[key / 64] |= uint64_t(values[offset] == 1.0) << (key % 64);
+      }
+    });
+  packed_space = &space;
+}
+
+// Returns true iff this feature is packed on the given space.
+bool ThresholdFeature::IsPacked(Space &space) {
+  return packed_space == &space;
+}
+
+// Computes a sample expectation of this feature from its packed values
+// (see Pack) and stores it internally. Returns 0 on success and -1 if
+// the sample is not packed on the space this feature is packed on.
+int ThresholdFeature::ComputePackedSampleExpectation
+  (const PackedSample &sample) {
+  if (packed_space == NULL || sample.space != packed_space) {
+    return -1;
+  }
+  sample_expectation = double(sample.CountOnes(packed_bits)) / sample.size;
+  return 0;
+}
+
+// Returns the total weight of points whose bin codes exceed given bin.
+template <typename Code>
+static double WeightAboveBin(const Code *codes, Span<double> weights,
+			     int bin) {
+  double sum = 0.0;
+  for (unsigned key = 0; key < weights.size(); key++) {
+    if (codes[key] > bin) {
+      sum += weights[key];
+    }
+  }
+  return sum;
+}
+
+// Stores in values one for each of count bin codes that exceeds given bin
+// and zero for the others.
+template <typename Code>
+static void CompareBinCodes(const Code *codes, int count, int bin,
+			    double *values) {
+  for (int i = 0; i < count; i++) {
+    values[i] = ((codes[i] > bin) ? 1 : 0);
+  }
+}
+
+// Computes un-normalized population expectation of this threshold feature
+// by streaming the corresponding column of the space. If the raw feature
+// is stored sparsely and zero is not above threshold, only non-zeros are
+// visited. Otherwise weights of points whose bits are set are added up
+// if the feature is packed on this space, column of bin codes is used
+// instead of raw values if it is available or raw values are streamed
+// block by block.
+void ThresholdFeature::ComputeUnnormalizedPopulationExpectation(Space &space) {
+  std::vector<int> keys;
+  if (NonZeroKeys(space, &keys) == 0) {
+    Span<double> weights = space.ProbWeights();
+    double expectation = 0.0;
+    for (int key : keys) {
+      expectation += weights[key];
+    }
+    population_expectation = expectation;
+    return;
+  }
+  if (IsPacked(space)) {
+    population_expectation = PackedWeightSum(packed_bits, space);
+    return;
+  }
+  if (bin >= 0 && space.IsQuantized(index)) {
+    if (space.BinCodes8(index) != NULL) {
+      population_expectation =
+	WeightAboveBin(space.BinCodes8(index), space.ProbWeights(), bin);
+    } else {
+      population_expectation =
+	WeightAboveBin(space.BinCodes16(index), space.ProbWeights(), bin);
+    }
+    return;
+  }
+  Feature::ComputeUnnormalizedPopulationExpectation(space);
+}
+
+// Stores keys of points at which this threshold feature is one if its raw
+// feature is stored sparsely in the given space and zero is not above
+// threshold. Returns 0 on success and -1 otherwise.
+int ThresholdFeature::NonZeroKeys(Space &space, std::vector<int> *keys) {
+  if (!space.IsSparse(index) || 0.0 > threshold) {
+    return -1;
+  }
+  const int *sparse_keys = space.SparseKeys(index);
+  const double *values = space.SparseValues(index);
+  keys->clear();
+  for (int i = 0; i < space.NumNonZeros(index); i++) {
+    if (values[i] > threshold) {
+      keys->push_back(sparse_keys[i]);
+    }
+  }
+  return 0;
+}
+
+// Stores the index of the raw feature of this threshold feature
+// in indices. Returns 0.
+int ThresholdFeature::RawFeatureIndices(std::vector<int> *indices) {
+  indices->assign(1, index);
+  return 0;
+}
+
+// Stores the values of this threshold feature at count given examples
+// in values. Bin codes are used where they are available.
+void ThresholdFeature::FeatureMapBatch(const Example *examples, int count,
+				       double *values) {
+  for (int i = 0; i < count; i++) {
+    int code = (bin >= 0 ? examples[i]->GetBinCode(index) : -1);
+    if (code >= 0) {
+      values[i] = ((code > bin) ? 1 : 0);
+    } else {
+      values[i] = ((examples[i]->GetRawFeature(index) > threshold) ? 1 : 0);
+    }
+  }
+}
+
+// Stores the values of this threshold feature at the points of the given
+// block in values. Packed values are used if the feature is packed on
+// the space of the block (see Pack), bin codes are used if the raw
+// feature is quantized and raw values are read from the block otherwise.
+void ThresholdFeature::FeatureMapBlock(const SpaceBlock &block,
+				       double *values) {
+  if (packed_space != NULL && block.space == packed_space) {
+    UnpackBits(packed_bits, block.begin, block.size, values);
+    return;
+  }
+  if (bin >= 0 && block.space->IsQuantized(index)) {
+    if (block.space->BinCodes8(index) != NULL) {
+      CompareBinCodes(block.space->BinCodes8(index) + block.begin,
+		      block.size, bin, values);
+    } else {
+      CompareBinCodes(block.space->BinCodes16(index) + block.begin,
+		      block.size, bin, values);
+    }
+    return;
+  }
+  const double *column = block.RawFeatureColumn(index);
+  if (column == NULL) {
+    Feature::FeatureMapBlock(block, values);
+    return;
+  }
+  for (int offset = 0; offset < block.size; offset++) {
+    values[offset] = ((column[offset] > threshold) ? 1 : 0);
+  }
+}
+
 // Returns complexity of the class of threshold features.
 double ThresholdFeature::Complexity() {
   return complexity;
@@ -126,6 +622,8 @@ void ThresholdFeature::SetComplexity(double value) {
 // the tree that defines this feature.
 TreeFeature::TreeFeature(Node *node) {
   root = node;
+  flat_tree = FlatTree(node);
+  leaf_space = NULL;
   sample_expectation = NAN;
   population_expectation = NAN;
 }
@@ -151,11 +649,113 @@ TreeFeature::~TreeFeature() {
 // Returns the value of the tree feature map at the specified point.
 // The value is defined by the underlying tree itself.
 double TreeFeature::FeatureMap(Point *point) {
-  Node *node = root;
-  while (!(node->IsLeaf())) {
-    node = node->Child(point);
+  return flat_tree.Evaluate(point);
+}
+
+// Stores the sorted indices of raw features used by the internal nodes
+// of the tree in indices. Returns 0.
+int TreeFeature::RawFeatureIndices(std::vector<int> *indices) {
+  indices->clear();
+  std::queue<Node*> q;
+  q.push(root);
+  while (!q.empty()) {
+    Node *node = q.front();
+    q.pop();
+    if (!node->IsLeaf()) {
+      indices->push_back(node->GetFeature());
+      q.push(node->GetLeftChild());
+      q.push(node->GetRightChild());
+    }
+  }
+  std::sort(indices->begin(), indices->end());
+  indices->erase(std::unique(indices->begin(), indices->end()),
+		 indices->end());
+  return 0;
+}
+
+// Stores the values of the tree feature map at count given examples
+// in values.
+void TreeFeature::FeatureMapBatch(const Example *examples, int count,
+				  double *values) {
+  flat_tree.EvaluateBatch(examples, count, values);
+}
+
+// Adds count weights to the total weights of their bins.
+template <typename Code>
+static void AddBinWeights(const Code *codes, const double *weights, int count,
+			  double *bin_weights) {
+  for (int i = 0; i < count; i++) {
+    bin_weights[codes[i]] += weights[i];
+  }
+}
+
+// Releases points and samples stored in the leaves of the tree. If values
+// of all leaves are 0 or 1, as they are in trees trained by TreeLearner,
+// the value of the feature at every point of the given space is stored as
+// a bit instead. Leaves need to contain all the points of the space, as
+// they do at the end of training (see TreeLearner::Train). Expectations of
+// the feature need to be computed before (see ComputeTreeExpectations).
+void TreeFeature::Compact(Space &space) {
+  std::vector<Node*> leaves;
+  std::queue<Node*> q;
+  q.push(root);
+  while (!q.empty()) {
+    Node *node = q.front();
+    q.pop();
+    if (node->IsLeaf()) {
+      leaves.push_back(node);
+    } else {
+      q.push(node->GetLeftChild());
+      q.push(node->GetRightChild());
+    }
+  }
+  bool binary = true;
+  for (Node *leaf : leaves) {
+    binary = binary && (leaf->GetValue() == 0.0 || leaf->GetValue() == 1.0);
+  }
+  leaf_space = (binary ? &space : NULL);
+  leaf_bits.assign(binary ? (space.NumPoints() + 63) / 64 : 0, 0);
+  for (Node *leaf : leaves) {
+    if (binary && leaf->GetValue() == 1.0) {
+      for (auto it = leaf->PointsBegin(); it != leaf->PointsEnd(); it++) {
+	int key = (*it)->GetKey();
+	leaf_bits[key / 64] |= uint64_t(1) << (key % 64);
+      }
+    }
+    leaf->ClearPoints();
+    leaf->ClearSamples();
+  }
+}
+
+// Returns true iff this tree feature has bits of the values of its leaves
+// at points of the given space (see Compact).
+bool TreeFeature::IsPacked(Space &space) {
+  return leaf_space == &space;
+}
+
+// Computes un-normalized population expectation of this tree feature.
+// On the space with bits of the values of the feature (see Compact)
+// the weights of points with set bits are added up (with shards of
+// a sharded space processed in parallel). The tree is evaluated at every
+// point otherwise.
+void TreeFeature::ComputeUnnormalizedPopulationExpectation(Space &space) {
+  if (leaf_space != &space) {
+    Feature::ComputeUnnormalizedPopulationExpectation(space);
+    return;
+  }
+  population_expectation = PackedWeightSum(leaf_bits, space);
+}
+
+// Stores the values of the tree feature map at the points of the given
+// block in values. Values are unpacked from bits if points of the block
+// have them (see Compact) and raw feature values are read from the block
+// otherwise.
+void TreeFeature::FeatureMapBlock(const SpaceBlock &block, double *values) {
+  if (block.space == leaf_space) {
+    UnpackBits(leaf_bits, block.begin, block.size, values);
+  } else {
+    flat_tree.EvaluateBlock(block, values);
   }
-  return node->GetValue();
 }
 
 // Returns complexity of the tree feature.
@@ -216,20 +816,177 @@ int TreeFeature::TreeSize() {
 // Constructor for monomial feature. Client needs to specify
 // the powers for each raw feature.
 MonomialFeature::MonomialFeature(std::vector<int> &pwrs) {
-  powers = pwrs;
+  for (unsigned index = 0; index < pwrs.size(); index++) {
+    if (pwrs[index] != 0) {
+      factors.push_back(std::make_pair(int(index), pwrs[index]));
+    }
+  }
   sample_expectation = NAN;
   population_expectation = NAN;
 }
 
+// Returns value raised to the given integer power computed by repeated
+// squaring (which takes fewer multiplications than the power).
+static inline double IntegerPower(double value, int power) {
+  if (power < 0) {
+    return 1.0 / IntegerPower(value, -power);
+  }
+  double result = 1.0;
+  while (power > 0) {
+    if (power & 1) {
+      result *= value;
+    }
+    value *= value;
+    power >>= 1;
+  }
+  return result;
+}
+
+// Multiplies count values by count raw values raised to the given power.
+// Small powers that are the most common are multiplied out directly.
+static void MultiplyByPower(const double *raw_values, int power, int count,
+			    double *values) {
+  switch (power) {
+  case 1:
+    for (int i = 0; i < count; i++) {
+      values[i] *= raw_values[i];
+    }
+    break;
+  case 2:
+    for (int i = 0; i < count; i++) {
+      values[i] *= raw_values[i] * raw_values[i];
+    }
+    break;
+  default:
+    for (int i = 0; i < count; i++) {
+      values[i] *= IntegerPower(raw_values[i], power);
+    }
+  }
+}
+
 // Returns the value of the monomial feature map at the specified point.
 double MonomialFeature::FeatureMap(Point *point) {
   double result = 1.0;
-  for (unsigned index = 0; index < powers.size(); index++) {
-    result *= std::pow(point->GetRawFeature(index), powers[index]);
+  for (auto &factor : factors) {
+    result *= IntegerPower(point->GetRawFeature(factor.first), factor.second);
   }
   return result;
 }
 
+// Computes un-normalized population expectation of this monomial feature.
+// Columns of raw features with non-zero powers are streamed one at a time
+// and multiplied into a buffer of per-point values (one block of points
+// at a time for chunked spaces). If some of these raw
+// features are stored sparsely, only points at which all of them are
+// non-zero are visited.
+void MonomialFeature::ComputeUnnormalizedPopulationExpectation(Space &space) {
+  std::vector<int> keys;
+  if (NonZeroKeys(space, &keys) == 0) {
+    Span<double> weights = space.ProbWeights();
+    std::vector<double> values(keys.size());
+    for (unsigned i = 0; i < keys.size(); i++) {
+      values[i] = weights[keys[i]];
+    }
+    std::vector<double> raw_values;
+    for (auto &factor : factors) {
+      space.GatherRawFeature(factor.first, keys, &raw_values);
+      MultiplyByPower(raw_values.data(), factor.second, keys.size(),
+		      values.data());
+    }
+    double expectation = 0.0;
+    for (double value : values) {
+      expectation += value;
+    }
+    population_expectation = expectation;
+    return;
+  }
+  if (!factors.empty() &&
+      factors.back().first >= space.NumRawFeatures()) {
+    Feature::ComputeUnnormalizedPopulationExpectation(space);
+    return;
+  }
+  std::vector<int> indices;
+  RawFeatureIndices(&indices);
+  for (int index : indices) {
+    if (!space.IsDense(index)) {
+      Feature::ComputeUnnormalizedPopulationExpectation(space);
+      return;
+    }
+  }
+  std::vector<double> partials(space.NumShards(), 0.0);
+  space.ForEachShard(&indices, [&](SpaceBlock &block, int shard) {
+      std::vector<double> values(block.weights, block.weights + block.size);
+      for (auto &factor : factors) {
+	MultiplyByPower(block.columns[factor.first], factor.second,
+			block.size, values.data());
+      }
+      partials[shard] += KernelSum(values.data(), block.size);
+    });
+  population_expectation = SumShardPartials(partials);
+}
+
+// Stores keys of points at which this monomial feature may be non-zero
+// if some raw feature with positive power is stored sparsely in the given
+// space. Returns 0 on success and -1 otherwise.
+int MonomialFeature::NonZeroKeys(Space &space, std::vector<int> *keys) {
+  bool found = false;
+  for (auto &factor : factors) {
+    int index = factor.first;
+    if (factor.second <= 0 || !space.IsSparse(index)) {
+      continue;
+    }
+    if (!found) {
+      keys->assign(space.SparseKeys(index),
+		   space.SparseKeys(index) + space.NumNonZeros(index));
+      found = true;
+    } else {
+      IntersectNonZeroKeys(space, index, keys);
+    }
+  }
+  return (found ? 0 : -1);
+}
+
+// Stores the indices of raw features with non-zero powers in indices.
+// Returns 0.
+int MonomialFeature::RawFeatureIndices(std::vector<int> *indices) {
+  indices->clear();
+  for (auto &factor : factors) {
+    indices->push_back(factor.first);
+  }
+  return 0;
+}
+
+// Stores the values of this monomial feature at count given examples
+// in values.
+void MonomialFeature::FeatureMapBatch(const Example *examples, int count,
+				      double *values) {
+  for (int i = 0; i < count; i++) {
+    double result = 1.0;
+    for (auto &factor : factors) {
+      result *= IntegerPower(examples[i]->GetRawFeature(factor.first),
+			     factor.second);
+    }
+    values[i] = result;
+  }
+}
+
+// Stores the values of this monomial feature at the points of the given
+// block in values. Raw features with zero power are skipped.
+void MonomialFeature::FeatureMapBlock(const SpaceBlock &block,
+				      double *values) {
+  for (auto &factor : factors) {
+    if (block.RawFeatureColumn(factor.first) == NULL) {
+      Feature::FeatureMapBlock(block, values);
+      return;
+    }
+  }
+  std::fill(values, values + block.size, 1.0);
+  for (auto &factor : factors) {
+    MultiplyByPower(block.columns[factor.first], factor.second, block.size,
+		    values);
+  }
+}
+
 // Returns complexity of the monomial feature.
 double MonomialFeature::Complexity() {
   return complexity;
@@ -250,8 +1007,569 @@ void MonomialFeature::MonomialExpectations(double population, double sample) {
 // Returns the power of this monomial feature.
 int MonomialFeature::GetPower() {
   int sum = 0;
-  for (int p : powers) {
-    sum += p;
+  for (auto &factor : factors) {
+    sum += factor.second;
   }
   return sum;
 }
+
+// Returns indices and powers of raw features with non-zero powers in
+// this monomial in the order of indices.
+const std::vector<std::pair<int, int> > &MonomialFeature::Factors() {
+  return factors;
+}
+
+// Constructor for an evaluator of the given monomials. Monomials are
+// sorted by their factors, so that monomials sharing a prefix of factors
+// are next to each other and the trie is built in depth-first order.
+MonomialEvaluator::MonomialEvaluator
+  (const std::vector<MonomialFeature*> &features) {
+  monomials = features;
+  max_depth = 0;
+  std::vector<int> order(monomials.size());
+  for (unsigned i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](int first, int second) {
+      return monomials[first]->Factors() < monomials[second]->Factors();
+    });
+  std::vector<int> path; // trie nodes from the root to the last node
+  for (int i : order) {
+    const std::vector<std::pair<int, int> > &factors =
+      monomials[i]->Factors();
+    if (factors.empty()) {
+      constant_monomials.push_back(i);
+      continue;
+    }
+    unsigned shared = 0;
+    while (shared < path.size() && shared < factors.size() &&
+	   nodes[path[shared]].index == factors[shared].first &&
+	   nodes[path[shared]].power == factors[shared].second) {
+      shared++;
+    }
+    path.resize(shared);
+    for (unsigned depth = shared; depth < factors.size(); depth++) {
+      TrieNode node;
+      node.index = factors[depth].first;
+      node.power = factors[depth].second;
+      node.depth = depth + 1;
+      path.push_back(nodes.size());
+      nodes.push_back(node);
+    }
+    nodes[path.back()].monomials.push_back(i);
+    max_depth = std::max(max_depth, int(factors.size()));
+  }
+}
+
+// Stores the values of all monomials at the points of the given block
+// in values: values[i * block.size + offset] is the value of the i-th
+// monomial at the point with key block.begin + offset. Products of
+// factors are kept for each depth of the trie, so the product at a node
+// is the product at its parent times one factor. Monomials are evaluated
+// one by one if the block does not provide some raw feature.
+void MonomialEvaluator::EvaluateBlock(const SpaceBlock &block,
+				      double *values) {
+  for (TrieNode &node : nodes) {
+    if (block.RawFeatureColumn(node.index) == NULL) {
+      for (unsigned i = 0; i < monomials.size(); i++) {
+	monomials[i]->FeatureMapBlock(block, values + i * block.size);
+      }
+      return;
+    }
+  }
+  std::vector<std::vector<double> >
+    products(max_depth + 1, std::vector<double>(block.size, 1.0));
+  for (int i : constant_monomials) {
+    std::copy(products[0].begin(), products[0].end(),
+	      values + i * block.size);
+  }
+  for (TrieNode &node : nodes) {
+    std::vector<double> &product = products[node.depth];
+    product = products[node.depth - 1];
+    MultiplyByPower(block.columns[node.index], node.power, block.size,
+		    product.data());
+    for (int i : node.monomials) {
+      std::copy(product.begin(), product.end(), values + i * block.size);
+    }
+  }
+}
+
+// Returns the number of distinct products of factors computed for each
+// point (the number of nodes of the trie).
+int MonomialEvaluator::NumProducts() {
+  return nodes.size();
+}
+
+// Constructor for an evaluator of the given product features.
+ProductEvaluator::ProductEvaluator
+  (const std::vector<ProductFeature*> &products) {
+  std::map<std::pair<int, int>, std::vector<int> > pairs;
+  for (unsigned i = 0; i < products.size(); i++) {
+    std::vector<int> indices;
+    products[i]->RawFeatureIndices(&indices);
+    pairs[std::make_pair(indices.front(), indices.back())].push_back(i);
+  }
+  for (auto &pair : pairs) {
+    if (rows.empty() || rows.back().first != pair.first.first) {
+      rows.push_back(Row());
+      rows.back().first = pair.first.first;
+    }
+    rows.back().seconds.push_back(pair.first.second);
+    rows.back().products.push_back(pair.second);
+  }
+}
+
+// Adds weighted sums of the products of the points of the given block to
+// sums, i.e. sums[i] is increased by the sum of values of the i-th product
+// at these points multiplied by their weights. Returns 0 on success and
+// -1 (leaving sums unchanged) if the block does not provide some raw
+// feature.
+int ProductEvaluator::AddWeightedSums(const SpaceBlock &block,
+				      double *sums) {
+  for (Row &row : rows) {
+    if (block.RawFeatureColumn(row.first) == NULL) {
+      return -1;
+    }
+    for (int second : row.seconds) {
+      if (block.RawFeatureColumn(second) == NULL) {
+	return -1;
+      }
+    }
+  }
+  std::vector<double> weighted_values(block.size);
+  for (Row &row : rows) {
+    const double *first_values = block.columns[row.first];
+    for (int offset = 0; offset < block.size; offset++) {
+      weighted_values[offset] = block.weights[offset] * first_values[offset];
+    }
+    for (unsigned pair = 0; pair < row.seconds.size(); pair++) {
+      double sum = WeightedSum(weighted_values.data(),
+			       block.columns[row.seconds[pair]], block.size);
+      for (int i : row.products[pair]) {
+	sums[i] += sum;
+      }
+    }
+  }
+  return 0;
+}
+
+// Returns the number of distinct pairs of raw features of the products.
+int ProductEvaluator::NumPairs() {
+  int count = 0;
+  for (Row &row : rows) {
+    count += row.seconds.size();
+  }
+  return count;
+}
+
+// Returns the number of bytes used by values of this column.
+size_t FeatureColumn::Bytes() const {
+  return (bits.size() * sizeof(uint64_t) + floats.size() * sizeof(float) +
+	  doubles.size() * sizeof(double));
+}
+
+// Returns the sum of count values at points with keys starting from begin
+// multiplied by the corresponding weights.
+double FeatureColumn::WeightedSum(const double *weights, int begin,
+				  int count) const {
+  if (encoding == kBits) {
+    return MaskedWeightSum(weights, bits.data(), begin, count);
+  } else if (encoding == kFloats) {
+    return ::WeightedSum(weights, floats.data() + begin, count);
+  }
+  return ::WeightedSum(weights, doubles.data() + begin, count);
+}
+
+// Constructor for a feature cache that keeps at most budget_bytes of
+// feature values.
+FeatureCache::FeatureCache(size_t budget_bytes) {
+  budget = budget_bytes;
+  used = 0;
+}
+
+// Returns cached values of the given feature (or NULL if they are not
+// cached) and marks them as most recently used.
+const FeatureColumn *FeatureCache::Find(Feature *feature) {
+  std::map<Feature*, Entry>::iterator it = entries.find(feature);
+  if (it == entries.end()) {
+    return NULL;
+  }
+  recently_used.splice(recently_used.begin(), recently_used,
+		       it->second.position);
+  return &(it->second.column);
+}
+
+// Evaluates the given feature at all points of the space, stores its
+// values in the cache evicting least recently used columns if needed and
+// returns them. Returns NULL if values of the feature do not fit in the
+// budget of the cache.
+const FeatureColumn *FeatureCache::Insert(Feature *feature, Space &space) {
+  const FeatureColumn *cached = Find(feature);
+  if (cached != NULL) {
+    return cached;
+  }
+  std::vector<int> indices;
+  bool known_indices = (feature->RawFeatureIndices(&indices) == 0);
+  std::vector<double> values(space.NumPoints());
+  space.ForEachBlock(known_indices ? &indices : NULL, [&](SpaceBlock &block) {
+      feature->FeatureMapBlock(block, values.data() + block.begin);
+    });
+  bool binary = true;
+  bool exact_floats = true;
+  for (double value : values) {
+    binary = binary && (value == 0.0 || value == 1.0);
+    exact_floats = exact_floats && (double(float(value)) == value);
+  }
+  FeatureColumn column;
+  if (binary) {
+    column.encoding = FeatureColumn::kBits;
+    column.bits.assign((values.size() + 63) / 64, 0);
+    for (unsigned key = 0; key < values.size(); key++) {
+      column.bits[key / 64] |= uint64_t(values[key] == 1.0) << (key % 64);
+    }
+  } else if (exact_floats) {
+    column.encoding = FeatureColumn::kFloats;
+    column.floats.assign(values.begin(), values.end());
+  } else {
+    column.encoding = FeatureColumn::kDoubles;
+    column.doubles.swap(values);
+  }
+  size_t bytes = column.Bytes();
+  if (bytes > budget) {
+    return NULL;
+  }
+  while (used + bytes > budget) {
+    Feature *evicted = recently_used.back();
+    used -= entries[evicted].column.Bytes();
+    entries.erase(evicted);
+    recently_used.pop_back();
+  }
+  recently_used.push_front(feature);
+  Entry &entry = entries[feature];
+  entry.column.encoding = column.encoding;
+  entry.column.bits.swap(column.bits);
+  entry.column.floats.swap(column.floats);
+  entry.column.doubles.swap(column.doubles);
+  entry.position = recently_used.begin();
+  used += bytes;
+  return &(entry.column);
+}
+
+// Returns the sum of cached values of a feature weighted by the current
+// weights of points in the space, i.e. un-normalized population
+// expectation of the feature. Shards of the space are summed up in
+// parallel (see Space::ForEachShard).
+double FeatureCache::WeightedSum(const FeatureColumn &column, Space &space) {
+  std::vector<double> partials(space.NumShards(), 0.0);
+  std::vector<int> indices;
+  space.ForEachShard(&indices, [&](SpaceBlock &block, int shard) {
+      partials[shard] += column.WeightedSum(block.weights, block.begin,
+					    block.size);
+    });
+  return SumShardPartials(partials);
+}
+
+// Returns the number of bytes used by cached values.
+size_t FeatureCache::UsedBytes() {
+  return used;
+}
+
+// Returns the number of features whose values are cached.
+int FeatureCache::NumColumns() {
+  return entries.size();
+}
+
+// Returns true iff the given feature can be evaluated tile by tile from
+// the raw features it depends on, which are stored in indices. These need
+// dense values, except that tree and threshold features, which compare raw
+// values against thresholds, read bin codes of quantized raw features
+// instead (see Space::GetBinCode), so released values are not needed.
+static bool HasTileRawFeatures(Feature *feature, Space &space,
+			       std::vector<int> *indices) {
+  if (feature->RawFeatureIndices(indices) != 0) {
+    return false;
+  }
+  bool reads_bin_codes = (dynamic_cast<TreeFeature*>(feature) != NULL ||
+			  dynamic_cast<ThresholdFeature*>(feature) != NULL);
+  for (int index : *indices) {
+    if (!space.IsDense(index) &&
+	!(reads_bin_codes && space.IsQuantized(index))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Computes un-normalized population expectations of features with ids
+// in fused (see ComputeUnnormalizedPopulationExpectations) together in
+// a single pass over the space, in which points are split into tiles of
+// the given size.
+static void ComputeFusedExpectations
+  (const std::vector<Feature*> &features,
+   const std::vector<const FeatureColumn*> &columns,
+   const std::vector<int> &fused, int tile_size, Space &space) {
+  std::vector<int> indices;
+  std::vector<MonomialFeature*> monomials;
+  std::vector<int> monomial_ids(features.size(), -1);
+  std::vector<ProductFeature*> products;
+  std::vector<int> product_ids(features.size(), -1);
+  for (int i : fused) {
+    std::vector<int> feature_indices;
+    if (columns[i] != NULL) {
+      continue;
+    }
+    features[i]->RawFeatureIndices(&feature_indices);
+    indices.insert(indices.end(), feature_indices.begin(),
+		   feature_indices.end());
+    MonomialFeature *monomial = dynamic_cast<MonomialFeature*>(features[i]);
+    if (monomial != NULL) {
+      monomial_ids[i] = monomials.size();
+      monomials.push_back(monomial);
+    }
+    ProductFeature *product = dynamic_cast<ProductFeature*>(features[i]);
+    if (product != NULL) {
+      product_ids[i] = products.size();
+      products.push_back(product);
+    }
+  }
+  MonomialEvaluator evaluator(monomials);
+  ProductEvaluator product_evaluator(products);
+  std::sort(indices.begin(), indices.end());
+  indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+  std::vector<std::vector<double> >
+    partials(space.NumShards(), std::vector<double>(fused.size(), 0.0));
+  space.ForEachShard(&indices, [&](SpaceBlock &block, int shard) {
+      std::vector<double> values(tile_size);
+      std::vector<double> monomial_values(tile_size * monomials.size());
+      std::vector<double> product_sums(products.size());
+      std::vector<double> &expectations = partials[shard];
+      SpaceBlock tile = block;
+      for (int start = 0; start < block.size; start += tile_size) {
+	tile.begin = block.begin + start;
+	tile.size = std::min(tile_size, block.size - start);
+	tile.weights = block.weights + start;
+	for (int index : indices) {
+	  tile.columns[index] = (block.columns[index] != NULL ?
+				 block.columns[index] + start : NULL);
+	}
+	if (!monomials.empty()) {
+	  evaluator.EvaluateBlock(tile, monomial_values.data());
+	}
+	std::fill(product_sums.begin(), product_sums.end(), 0.0);
+	product_evaluator.AddWeightedSums(tile, product_sums.data());
+	for (unsigned j = 0; j < fused.size(); j++) {
+	  const FeatureColumn *column = columns[fused[j]];
+	  if (column != NULL) {
+	    expectations[j] += column->WeightedSum(tile.weights, tile.begin,
+						   tile.size);
+	    continue;
+	  }
+	  if (product_ids[fused[j]] >= 0) {
+	    expectations[j] += product_sums[product_ids[fused[j]]];
+	    continue;
+	  }
+	  int monomial_id = monomial_ids[fused[j]];
+	  if (monomial_id >= 0) {
+	    expectations[j] +=
+	      WeightedSum(tile.weights,
+			  monomial_values.data() + monomial_id * tile.size,
+			  tile.size);
+	    continue;
+	  }
+	  features[fused[j]]->FeatureMapBlock(tile, values.data());
+	  expectations[j] += WeightedSum(tile.weights, values.data(),
+					 tile.size);
+	}
+      }
+    });
+  for (unsigned j = 0; j < fused.size(); j++) {
+    std::vector<double> feature_partials;
+    for (auto &expectations : partials) {
+      feature_partials.push_back(expectations[j]);
+    }
+    features[fused[j]]->SetUnnormalizedPopulationExpectation
+      (SumShardPartials(feature_partials));
+  }
+}
+
+// Computes un-normalized population expectations of the given features.
+// Features with cached values (columns[i] is not NULL) and features
+// that only depend on dense (or for trees and thresholds, quantized)
+// raw features are evaluated together in a single pass over the space:
+// points of each block are split into tiles small enough for their
+// weights and raw features to stay in cache, and
+// all of these features are evaluated and summed up tile by tile. Each
+// raw feature and weight is thus read from memory once rather than once
+// per feature. Monomials among these features are evaluated together
+// by a MonomialEvaluator, so that products of factors they have in common
+// are computed once, and products of pairs of raw features are evaluated
+// together by a ProductEvaluator, so that each pair is computed once
+// whatever the order of its raw features. Remaining features are
+// evaluated one by one (see
+// Feature::ComputeUnnormalizedPopulationExpectation), except for threshold
+// features of the same raw feature, which are evaluated together (see
+// ComputeThresholdExpectations).
+// All of these computations run in parallel (see ParallelFor) and with
+// several threads the fused features are split into as many passes as
+// there are threads (one pass unless the space is chunked, so that its
+// file is read once). Tiles are the same whatever the number of threads,
+// so expectations do not depend on it.
+void ComputeUnnormalizedPopulationExpectations
+  (const std::vector<Feature*> &features,
+   const std::vector<const FeatureColumn*> &columns, Space &space) {
+  std::map<int, std::vector<ThresholdFeature*> > threshold_groups;
+  std::vector<int> individual;
+  std::vector<int> fused;
+  std::vector<int> indices;
+  int num_monomials = 0;
+  for (unsigned i = 0; i < features.size(); i++) {
+    ThresholdFeature *threshold = dynamic_cast<ThresholdFeature*>(features[i]);
+    if (columns[i] == NULL && threshold != NULL &&
+	!threshold->IsPacked(space) && !space.IsSparse(threshold->GetIndex())) {
+      threshold_groups[threshold->GetIndex()].push_back(threshold);
+      continue;
+    }
+    std::vector<int> feature_indices;
+    if (columns[i] == NULL && (features[i]->IsPacked(space) ||
+			       !HasTileRawFeatures(features[i], space,
+						   &feature_indices))) {
+      individual.push_back(i);
+      continue;
+    }
+    fused.push_back(i);
+    indices.insert(indices.end(), feature_indices.begin(),
+		   feature_indices.end());
+    if (columns[i] == NULL &&
+	dynamic_cast<MonomialFeature*>(features[i]) != NULL) {
+      num_monomials++;
+    }
+  }
+  std::vector<std::vector<ThresholdFeature*> > groups;
+  for (auto &group : threshold_groups) {
+    groups.push_back(group.second);
+  }
+  std::sort(indices.begin(), indices.end());
+  indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+  // Tiles are a multiple of 64 points so that they start at a word of
+  // bit columns.
+  int tile_size = gExpectationTileBytes /
+    (sizeof(double) * (indices.size() + num_monomials + 2));
+  tile_size = std::max(64, tile_size / 64 * 64);
+  int num_passes = std::min<int>(fused.size(),
+				 space.IsChunked() ? 1 : GetNumThreads());
+  std::vector<std::vector<int> > passes(num_passes);
+  for (unsigned j = 0; j < fused.size(); j++) {
+    passes[j % num_passes].push_back(fused[j]);
+  }
+  ParallelFor(individual.size() + groups.size() + passes.size(),
+	      [&](int task) {
+      if (task < (int) individual.size()) {
+	features[individual[task]]->
+	  ComputeUnnormalizedPopulationExpectation(space);
+	return;
+      }
+      task -= individual.size();
+      if (task < (int) groups.size()) {
+	std::vector<ThresholdFeature*> &group = groups[task];
+	if (group.size() < 2 ||
+	    ComputeThresholdExpectations(group, space) != 0) {
+	  for (ThresholdFeature *feature : group) {
+	    feature->ComputeUnnormalizedPopulationExpectation(space);
+	  }
+	}
+	return;
+      }
+      task -= groups.size();
+      ComputeFusedExpectations(features, columns, passes[task], tile_size,
+			       space);
+    });
+}
+
+// Computes un-normalized population expectations of threshold features
+// of the same raw feature in a single pass over the space. Thresholds of
+// these features split values of the raw feature into bins (bin codes
+// of the space are used if the raw feature is quantized and all the
+// features know their bins), weights of points are added up for each
+// bin and the expectation of a feature is the total weight of the bins
+// above its threshold. Shards of the space are processed in parallel.
+// Returns 0 on success and -1 if the features do not share their raw
+// feature or values of the raw feature are not available in the space.
+int ComputeThresholdExpectations
+  (const std::vector<ThresholdFeature*> &features, Space &space) {
+  if (features.empty()) {
+    return 0;
+  }
+  int index = features[0]->GetIndex();
+  bool use_codes = space.IsQuantized(index);
+  for (ThresholdFeature *feature : features) {
+    if (feature->GetIndex() != index) {
+      return -1;
+    }
+    use_codes = use_codes && feature->GetBin() >= 0;
+  }
+  if (!use_codes && !space.IsDense(index)) {
+    return -1;
+  }
+  // Bin of a value is the number of thresholds below it and bin of
+  // a feature is the index of its threshold, so that the feature is one
+  // exactly at values in bins above its bin.
+  std::vector<double> thresholds;
+  std::vector<int> bins;
+  if (use_codes) {
+    thresholds = space.BinThresholds(index);
+    for (ThresholdFeature *feature : features) {
+      bins.push_back(feature->GetBin());
+    }
+  } else {
+    for (ThresholdFeature *feature : features) {
+      thresholds.push_back(feature->GetThreshold());
+    }
+    std::sort(thresholds.begin(), thresholds.end());
+    thresholds.erase(std::unique(thresholds.begin(), thresholds.end()),
+		     thresholds.end());
+    for (ThresholdFeature *feature : features) {
+      bins.push_back(std::lower_bound(thresholds.begin(), thresholds.end(),
+				      feature->GetThreshold()) -
+		     thresholds.begin());
+    }
+  }
+  int num_bins = thresholds.size() + 1;
+  std::vector<std::vector<double> >
+    bin_weights(space.NumShards(), std::vector<double>(num_bins, 0.0));
+  std::vector<int> indices;
+  if (!use_codes) {
+    indices.push_back(index);
+  }
+  space.ForEachShard(&indices, [&](SpaceBlock &block, int shard) {
+      double *weights = bin_weights[shard].data();
+      if (!use_codes) {
+	const double *column = block.columns[index];
+	for (int offset = 0; offset < block.size; offset++) {
+	  int value_bin = std::lower_bound(thresholds.begin(),
+					   thresholds.end(), column[offset]) -
+	    thresholds.begin();
+	  weights[value_bin] += block.weights[offset];
+	}
+      } else if (space.BinCodes8(index) != NULL) {
+	AddBinWeights(space.BinCodes8(index) + block.begin, block.weights,
+		       block.size, weights);
+      } else {
+	AddBinWeights(space.BinCodes16(index) + block.begin, block.weights,
+		       block.size, weights);
+      }
+    });
+  // weight_above[bin] is the total weight of the bins above bin.
+  std::vector<double> weight_above(num_bins, 0.0);
+  for (int bin = num_bins - 2; bin >= 0; bin--) {
+    std::vector<double> partials;
+    for (auto &weights : bin_weights) {
+      partials.push_back(weights[bin + 1]);
+    }
+    weight_above[bin] = weight_above[bin + 1] + SumShardPartials(partials);
+  }
+  for (unsigned i = 0; i < features.size(); i++) {
+    features[i]->SetUnnormalizedPopulationExpectation
+      (bins[i] < num_bins ? weight_above[bins[i]] : 0.0);
+  }
+  return 0;
+}
@@ -1,18 +1,49 @@
 #include <string>
+#include <list>
+#include <map>
 #include "space.hpp"
 #include "tree.hpp"
 
 #ifndef FEATURE_HPP
 #define FEATURE_HPP
 
+double SumShardPartials(const std::vector<double> &partials);
+
+// Numbers of occurrences of points of a space in a sample stored as bit
+// planes: the bit of the point with key k in planes[p] is bit p of the
+// number of occurrences of this point in the sample. The number of
+// examples of the sample at which a 0/1 feature stored as a bit array
+// indexed by keys is one is then a sum of popcounts (see CountOnes).
+// Sample usage:
+//   PackedSample packed_sample;
+//   packed_sample.Pack(sample, space);
+//   threshold_feature->Pack(space);
+//   threshold_feature->ComputePackedSampleExpectation(packed_sample);
+struct PackedSample {
+  Space *space; // space of the points of the sample (or NULL)
+  int size; // number of examples in the sample
+  std::vector<std::vector<uint64_t> > planes;
+  PackedSample() : space(NULL), size(0) {}
+  int Pack(Sample &sample, Space &space);
+  uint64_t CountOnes(const std::vector<uint64_t> &bits) const;
+};
+
 // This is an abstract class that represents a generic feature
 // (a map from an input space to real numbers).
 class Feature{
 public:
+  virtual ~Feature() {}
   double GetSampleExpectation();
   double GetUnnormalizedPopulationExpectation();
+  void SetUnnormalizedPopulationExpectation(double value);
   void ComputeSampleExpectation(Sample &sample);
-  void ComputeUnnormalizedPopulationExpectation(Space &space);
+  virtual void ComputeUnnormalizedPopulationExpectation(Space &space);
+  virtual int NonZeroKeys(Space &space, std::vector<int> *keys);
+  virtual bool IsPacked(Space &space);
+  virtual int RawFeatureIndices(std::vector<int> *indices);
+  virtual void FeatureMapBlock(const SpaceBlock &block, double *values);
+  virtual void FeatureMapBatch(const Example *examples, int count,
+			       double *values);
   virtual void SetComplexity(double value) = 0;
   virtual double Complexity() = 0;
   virtual double FeatureMap(Point *point) = 0;
@@ -28,6 +59,12 @@ class RawFeature: public Feature{
 public:
   RawFeature(int i);
   double FeatureMap(Point* point); // override
+  void ComputeUnnormalizedPopulationExpectation(Space &space); // override
+  int NonZeroKeys(Space &space, std::vector<int> *keys); // override
+  int RawFeatureIndices(std::vector<int> *indices); // override
+  void FeatureMapBlock(const SpaceBlock &block, double *values); // override
+  void FeatureMapBatch(const Example *examples, int count,
+		       double *values); // override
   double Complexity(); // override
   void SetComplexity(double value); // override
 private:
@@ -42,6 +79,12 @@ class ProductFeature: public Feature{
 public:
   ProductFeature(int i, int j);
   double FeatureMap(Point* point); // override
+  void ComputeUnnormalizedPopulationExpectation(Space &space); // override
+  int NonZeroKeys(Space &space, std::vector<int> *keys); // override
+  int RawFeatureIndices(std::vector<int> *indices); // override
+  void FeatureMapBlock(const SpaceBlock &block, double *values); // override
+  void FeatureMapBatch(const Example *examples, int count,
+		       double *values); // override
   double Complexity(); // override
   void SetComplexity(double value); // override
 private:
@@ -54,34 +97,73 @@ private:
 // from input space to real numbers that is equal to 1 if specified
 // raw feature above given threshold and 0 otherwise. According
 // to this definition, if raw feature is missing (i.e. is NAN)
-// then the value is also 0.
+// then the value is also 0. If raw feature is quantized, the feature
+// can be constructed with the bin of its threshold (see
+// Space::QuantizeRawFeature) and is then evaluated using bin codes.
+// The feature can also be packed (see Pack): its values at all points
+// of a space are stored as one bit per point, so that its population
+// expectation on this space is a masked sum of weights and its sample
+// expectation is a popcount (see ComputePackedSampleExpectation).
 class ThresholdFeature: public Feature{
 public:
   ThresholdFeature(int i, double theta); 
+  ThresholdFeature(int i, double theta, int bin);
+  int GetIndex();
+  double GetThreshold();
+  int GetBin();
+  void Pack(Space &space);
+  int ComputePackedSampleExpectation(const PackedSample &sample);
   double FeatureMap(Point* point); // override
+  void ComputeUnnormalizedPopulationExpectation(Space &space); // override
+  int NonZeroKeys(Space &space, std::vector<int> *keys); // override
+  bool IsPacked(Space &space); // override
+  int RawFeatureIndices(std::vector<int> *indices); // override
+  void FeatureMapBlock(const SpaceBlock &block, double *values); // override
+  void FeatureMapBatch(const Example *examples, int count,
+		       double *values); // override
   double Complexity(); // override
   void SetComplexity(double value); // override
 private:
   int index;  // index of the raw feature in the feature vector
   double threshold;
+  int bin; // index of threshold among quantization thresholds (or -1)
+  Space *packed_space; // space whose points have packed values (or NULL)
+  std::vector<uint64_t> packed_bits; // bit of each point of packed_space
   static double complexity; // complexity of this feature class
 };
 
 // This class represents a tree feature, that is a map from input space
 // to real numbers. Each tree feature corresponds to a particular partition
 // of space and the value of the feature map on each partition is
-// the value at the corresponding leaf of the tree.
+// the value at the corresponding leaf of the tree. The tree is compiled
+// into a FlatTree when the feature is constructed and it is evaluated
+// using the compiled copy, so the tree must not change afterwards.
+// Once trained, the feature can be compacted (see Compact): points and
+// samples stored in leaves are released and, since values of all leaves
+// of a trained tree are 0 or 1, the value at each point of the training
+// space is kept as a single bit instead (as for a packed ThresholdFeature),
+// so that the feature is evaluated on that space without the tree.
 class TreeFeature: public Feature{
 public:
   TreeFeature(Node* node);
   ~TreeFeature();
+  void Compact(Space &space);
   double FeatureMap(Point* point); // override
+  void ComputeUnnormalizedPopulationExpectation(Space &space); // override
+  bool IsPacked(Space &space); // override
+  int RawFeatureIndices(std::vector<int> *indices); // override
+  void FeatureMapBlock(const SpaceBlock &block, double *values); // override
+  void FeatureMapBatch(const Example *examples, int count,
+		       double *values); // override
   double Complexity(); // override
   void SetComplexity(double value); // override
   void ComputeTreeExpectations();
   int TreeSize();
 private:
   Node* root; // tree that defines this feature
+  FlatTree flat_tree; // compiled copy of the tree used for evaluation
+  Space *leaf_space; // space whose points have leaf_bits (or NULL)
+  std::vector<uint64_t> leaf_bits; // value of each point of leaf_space
   double complexity; // complexity of this particular tree feature
 };
 
@@ -89,14 +171,144 @@ class MonomialFeature: public Feature{
 public:
   MonomialFeature(std::vector<int> &powers);
   double FeatureMap(Point* point); // override
+  void ComputeUnnormalizedPopulationExpectation(Space &space); // override
+  int NonZeroKeys(Space &space, std::vector<int> *keys); // override
+  int RawFeatureIndices(std::vector<int> *indices); // override
+  void FeatureMapBlock(const SpaceBlock &block, double *values); // override
+  void FeatureMapBatch(const Example *examples, int count,
+		       double *values); // override
   double Complexity(); // override
   void SetComplexity(double value); // override
   void MonomialExpectations(double population_expectation,
 			    double sample_expectation);
   int GetPower();
+  const std::vector<std::pair<int, int> > &Factors();
 private:
-  std::vector<int> powers; // powers for each raw feature
+  // Index and power of each raw feature with non-zero power in the order
+  // of indices. Values of powers are computed by multiplication.
+  std::vector<std::pair<int, int> > factors;
   double complexity; // complexity of this monomial feature
 };
 
+// This class evaluates several monomial features at once. Factors of
+// the monomials (see MonomialFeature::Factors) are stored in a trie, so
+// that a product of factors that several monomials start with is only
+// computed once per point. Only prefixes of equal factors (raw feature
+// and power) are shared, e.g. x0 * x2 and x0 * x2^2 share x0 but x2^2
+// is not computed from x2.
+// Sample usage:
+//   MonomialEvaluator evaluator(monomials);
+//   evaluator.EvaluateBlock(block, values);
+//   // values[i * block.size + offset] is the value of monomials[i]
+class MonomialEvaluator {
+public:
+  MonomialEvaluator(const std::vector<MonomialFeature*> &monomials);
+  void EvaluateBlock(const SpaceBlock &block, double *values);
+  int NumProducts();
+private:
+  // A node of the trie stands for the product of factors on the path to
+  // it from the root. Nodes are stored in depth-first order.
+  struct TrieNode {
+    int index; // index of the raw feature of the last factor
+    int power; // power of the last factor
+    int depth; // number of factors
+    std::vector<int> monomials; // monomials equal to this product
+  };
+  std::vector<MonomialFeature*> monomials;
+  std::vector<int> constant_monomials; // monomials without factors
+  std::vector<TrieNode> nodes;
+  int max_depth;
+};
+
+// This class adds up weighted products of pairs of raw features of a set
+// of product features block by block, i.e. it computes the entries of
+// the weighted Gram matrix X^T diag(w) X of raw features X and weights w
+// of points for the pairs of these product features. Only the upper
+// triangle is computed: product features of the same pair of raw
+// features in either order share one sum. Products of weights and
+// the first raw feature of a pair are computed once per block for all
+// pairs with the same first raw feature.
+// Sample usage:
+//   ProductEvaluator evaluator(products);
+//   std::vector<double> sums(products.size(), 0.0);
+//   space.ForEachBlock(&indices, [&](SpaceBlock &block) {
+//       evaluator.AddWeightedSums(block, sums.data());
+//     });
+class ProductEvaluator {
+public:
+  ProductEvaluator(const std::vector<ProductFeature*> &products);
+  int AddWeightedSums(const SpaceBlock &block, double *sums);
+  int NumPairs();
+private:
+  // Pairs of raw features with the same first raw feature.
+  struct Row {
+    int first; // index of the first raw feature
+    std::vector<int> seconds; // second raw features (not below the first)
+    std::vector<std::vector<int> > products; // products of each pair
+  };
+  std::vector<Row> rows;
+};
+
+// Values of a feature at all points of a space indexed by keys of points.
+// Values are stored in the most compact lossless encoding: one bit per
+// point if all values are 0 or 1, floats if all values are exactly
+// representable as floats and doubles otherwise.
+struct FeatureColumn {
+  enum Encoding { kBits, kFloats, kDoubles };
+  Encoding encoding;
+  std::vector<uint64_t> bits;
+  std::vector<float> floats;
+  std::vector<double> doubles;
+  // Returns the value at the point with the given key.
+  double Value(int key) const {
+    switch (encoding) {
+    case kBits:
+      return (bits[key / 64] >> (key % 64)) & 1;
+    case kFloats:
+      return floats[key];
+    default:
+      return doubles[key];
+    }
+  }
+  size_t Bytes() const;
+  double WeightedSum(const double *weights, int begin, int count) const;
+};
+
+// This class caches values of features at all points of a space, so that
+// population expectations of features are plain weighted sums of cached
+// values and do not require evaluating features again once weights of
+// points change. Total size of cached columns is kept within a given
+// budget by evicting least recently used columns. The cache must only be
+// used with a single space and features must not be deleted while they
+// are cached.
+// Sample usage:
+//   FeatureCache cache(budget_bytes);
+//   const FeatureColumn *column = cache.Find(feature);
+//   if (column == NULL) column = cache.Insert(feature, space);
+//   double expectation = cache.WeightedSum(*column, space);
+class FeatureCache {
+public:
+  FeatureCache(size_t budget_bytes);
+  const FeatureColumn *Find(Feature *feature);
+  const FeatureColumn *Insert(Feature *feature, Space &space);
+  double WeightedSum(const FeatureColumn &column, Space &space);
+  size_t UsedBytes();
+  int NumColumns();
+private:
+  size_t budget;
+  size_t used;
+  std::list<Feature*> recently_used; // most recently used feature first
+  struct Entry {
+    FeatureColumn column;
+    std::list<Feature*>::iterator position; // position in recently_used
+  };
+  std::map<Feature*, Entry> entries;
+};
+
+void ComputeUnnormalizedPopulationExpectations
+  (const std::vector<Feature*> &features,
+   const std::vector<const FeatureColumn*> &columns, Space &space);
+int ComputeThresholdExpectations
+  (const std::vector<ThresholdFeature*> &features, Space &space);
+
 #endif
@@ -1,4 +1,5 @@
 #include <cmath>
+#include <cstdio>
 #include "gtest/gtest.h"
 #include "space.hpp"
 #include "constants.hpp"
@@ -365,6 +366,42 @@ TEST(FeatureTest, TestGetComputePopulationExpectationOfThresholdFeature) {
 	      gTolerance);
 }
 
+// Tests computing expectations of a threshold feature over
+// a quantized raw feature.
+TEST(FeatureTest, TestPopulationExpectationOfQuantizedThresholdFeature) {
+  ThresholdFeature *feature = new ThresholdFeature(0, 1.1, 1);
+  Point *point = new Point(1);
+  Point *point2 = new Point(2);
+  Point *point3 = new Point(3);
+  Space *space = new Space();
+  point->AddRawFeature(-1);
+  point2->AddRawFeature(1.5);
+  point3->AddRawFeature(4);
+  point->SetProbWeight(2);
+  point2->SetProbWeight(3);
+  point3->SetProbWeight(5);
+  space->AddPoint(*point);
+  space->AddPoint(*point2);
+  space->AddPoint(*point3);
+  space->Finalize();
+  std::vector<double> thresholds;
+  thresholds.push_back(0.0);
+  thresholds.push_back(1.1);
+  thresholds.push_back(2.0);
+  space->QuantizeRawFeature(0, thresholds);
+  space->ReleaseRawFeatureColumn(0);
+  feature->ComputeUnnormalizedPopulationExpectation(*space);
+  EXPECT_NEAR(8.0, feature->GetUnnormalizedPopulationExpectation(),
+	      gTolerance);
+  Sample sample;
+  sample.push_back(&(space->GetPoint(0)));
+  sample.push_back(&(space->GetPoint(1)));
+  sample.push_back(point);
+  sample.push_back(point3);
+  feature->ComputeSampleExpectation(sample);
+  EXPECT_NEAR(0.5, feature->GetSampleExpectation(), gTolerance);
+}
+
 // Tests computing unnormalized population expectation of a tree feature
 TEST(FeatureTest, TestComputeGetPopulationExpectationOfTreeFeature) {
   Node *root = new Node();
@@ -454,6 +491,371 @@ TEST(FeatureTest, TestComputeGetPopulationExpectationOfMonomialFeature) {
 }
 
 
+// Tests computing population expectations of features over a space
+// where raw features are stored sparsely.
+TEST(FeatureTest, TestComputePopulationExpectationOnSparseSpace) {
+  double values[4][2] = {{0.0, 3.0}, {2.0, 0.0}, {0.0, 0.5}, {-0.5, 1.0}};
+  Space *space = new Space();
+  for (int key = 0; key < 4; key++) {
+    Point *point = new Point(key);
+    point->AddRawFeature(values[key][0]);
+    point->AddRawFeature(values[key][1]);
+    point->SetProbWeight(key + 1);
+    space->AddPoint(*point);
+  }
+  space->Finalize();
+  space->SparsifyRawFeature(0);
+  space->SparsifyRawFeature(1);
+  std::vector<int> keys;
+
+  RawFeature *raw_feature = new RawFeature(0);
+  raw_feature->ComputeUnnormalizedPopulationExpectation(*space);
+  EXPECT_NEAR(2.0, raw_feature->GetUnnormalizedPopulationExpectation(),
+	      gTolerance);
+  EXPECT_EQ(0, raw_feature->NonZeroKeys(*space, &keys));
+  EXPECT_EQ(2, keys.size());
+  raw_feature = new RawFeature(1);
+  raw_feature->ComputeUnnormalizedPopulationExpectation(*space);
+  EXPECT_NEAR(8.5, raw_feature->GetUnnormalizedPopulationExpectation(),
+	      gTolerance);
+
+  ProductFeature *product_feature = new ProductFeature(0, 1);
+  product_feature->ComputeUnnormalizedPopulationExpectation(*space);
+  EXPECT_NEAR(-2.0, product_feature->GetUnnormalizedPopulationExpectation(),
+	      gTolerance);
+  EXPECT_EQ(0, product_feature->NonZeroKeys(*space, &keys));
+  EXPECT_EQ(1, keys.size());
+  EXPECT_EQ(3, keys[0]);
+  product_feature = new ProductFeature(0, 0);
+  product_feature->ComputeUnnormalizedPopulationExpectation(*space);
+  EXPECT_NEAR(9.0, product_feature->GetUnnormalizedPopulationExpectation(),
+	      gTolerance);
+
+  ThresholdFeature *threshold_feature = new ThresholdFeature(0, 1.0);
+  threshold_feature->ComputeUnnormalizedPopulationExpectation(*space);
+  EXPECT_NEAR(2.0, threshold_feature->GetUnnormalizedPopulationExpectation(),
+	      gTolerance);
+  EXPECT_EQ(0, threshold_feature->NonZeroKeys(*space, &keys));
+  EXPECT_EQ(1, keys.size());
+  threshold_feature = new ThresholdFeature(0, -1.0);
+  EXPECT_EQ(-1, threshold_feature->NonZeroKeys(*space, &keys));
+  threshold_feature->ComputeUnnormalizedPopulationExpectation(*space);
+  EXPECT_NEAR(10.0, threshold_feature->GetUnnormalizedPopulationExpectation(),
+	      gTolerance);
+
+  int mon[2] = {1, 2};
+  std::vector<int> monomial(mon, mon + 2);
+  MonomialFeature *monomial_feature = new MonomialFeature(monomial);
+  monomial_feature->ComputeUnnormalizedPopulationExpectation(*space);
+  EXPECT_NEAR(-2.0, monomial_feature->GetUnnormalizedPopulationExpectation(),
+	      gTolerance);
+  EXPECT_EQ(0, monomial_feature->NonZeroKeys(*space, &keys));
+  EXPECT_EQ(1, keys.size());
+}
+
+// Tests that evaluating features at a batch of examples gives the same
+// values as evaluating them one example at a time.
+TEST(FeatureTest, TestFeatureMapBatch) {
+  double values[3][2] = {{0.5, -2.0}, {1.5, 3.0}, {-1.0, 0.25}};
+  Space *space = new Space();
+  Sample sample;
+  for (int key = 0; key < 3; key++) {
+    space->AddPoint(key, values[key], 2, 1.0);
+  }
+  space->Finalize();
+  for (int key = 0; key < 3; key++) {
+    sample.push_back(&(space->GetPoint(key)));
+  }
+  Node *root = new Node();
+  root->SetFeature(0);
+  root->SetThreshold(0.0);
+  root->SetLeftChild(new Node());
+  root->SetRightChild(new Node());
+  root->GetRightChild()->SetValue(1.0);
+  int mon[2] = {2, 1};
+  std::vector<int> monomial(mon, mon + 2);
+  Feature *features[5] = {new RawFeature(1), new ProductFeature(0, 1),
+			  new ThresholdFeature(1, 0.1), new TreeFeature(root),
+			  new MonomialFeature(monomial)};
+  for (auto feature : features) {
+    double batch_values[3];
+    feature->FeatureMapBatch(sample.data(), 3, batch_values);
+    for (int key = 0; key < 3; key++) {
+      EXPECT_NEAR(feature->FeatureMap(sample[key]), batch_values[key],
+		  gTolerance);
+    }
+  }
+  double product_values[3];
+  features[1]->FeatureMapBatch(sample.data(), 3, product_values);
+  EXPECT_NEAR(4.5, product_values[1], gTolerance);
+}
+
+// Tests caching values of features in compact encodings and evicting
+// least recently used columns once the budget is exceeded.
+TEST(FeatureTest, TestFeatureCache) {
+  Space *space = new Space();
+  for (int key = 0; key < 100; key++) {
+    double values[2] = {key * 0.5, key * 0.1};
+    space->AddPoint(key, values, 2, key % 2 + 1.0);
+  }
+  space->Finalize();
+  Feature *threshold_feature = new ThresholdFeature(0, 10.0);
+  Feature *float_feature = new RawFeature(0);
+  Feature *double_feature = new RawFeature(1);
+  FeatureCache cache(100 * sizeof(double) + 100 * sizeof(float));
+  EXPECT_TRUE(cache.Find(threshold_feature) == NULL);
+  const FeatureColumn *column = cache.Insert(threshold_feature, *space);
+  EXPECT_EQ(FeatureColumn::kBits, column->encoding);
+  EXPECT_EQ(2 * sizeof(uint64_t), column->Bytes());
+  EXPECT_NEAR(0.0, column->Value(20), gTolerance);
+  EXPECT_NEAR(1.0, column->Value(21), gTolerance);
+  threshold_feature->ComputeUnnormalizedPopulationExpectation(*space);
+  EXPECT_NEAR(threshold_feature->GetUnnormalizedPopulationExpectation(),
+	      cache.WeightedSum(*column, *space), gTolerance);
+  column = cache.Insert(float_feature, *space);
+  EXPECT_EQ(FeatureColumn::kFloats, column->encoding);
+  EXPECT_NEAR(49.5, column->Value(99), gTolerance);
+  EXPECT_EQ(cache.Find(threshold_feature), cache.Insert(threshold_feature,
+							*space));
+  column = cache.Insert(double_feature, *space);
+  EXPECT_EQ(FeatureColumn::kDoubles, column->encoding);
+  EXPECT_NEAR(9.9, column->Value(99), gTolerance);
+  double_feature->ComputeUnnormalizedPopulationExpectation(*space);
+  EXPECT_NEAR(double_feature->GetUnnormalizedPopulationExpectation(),
+	      cache.WeightedSum(*column, *space), gTolerance);
+  EXPECT_EQ(2, cache.NumColumns());
+  EXPECT_TRUE(cache.Find(float_feature) == NULL);
+  EXPECT_TRUE(cache.Find(threshold_feature) != NULL);
+  EXPECT_EQ(2 * sizeof(uint64_t) + 100 * sizeof(double), cache.UsedBytes());
+  FeatureCache small_cache(8);
+  EXPECT_TRUE(small_cache.Insert(double_feature, *space) == NULL);
+  EXPECT_EQ(0, small_cache.NumColumns());
+}
+
+// Tests computing population expectations of several features in a single
+// pass over a space that is split into several tiles.
+TEST(FeatureTest, TestComputeUnnormalizedPopulationExpectations) {
+  Space *space = new Space();
+  for (int key = 0; key < 20000; key++) {
+    double values[3] = {(key % 7) * 0.5, (key % 11) * 0.1, (key % 5) - 2.0};
+    space->AddPoint(key, values, 3, key % 3 + 1.0);
+  }
+  space->Finalize();
+  int mon[3] = {1, 0, 2};
+  std::vector<int> monomial(mon, mon + 3);
+  Node *root = new Node();
+  root->SetFeature(2);
+  root->SetThreshold(0.5);
+  root->SetLeftChild(new Node());
+  root->SetRightChild(new Node());
+  root->GetLeftChild()->SetValue(1.0);
+  std::vector<Feature*> features = {
+    new RawFeature(0), new ProductFeature(0, 1), new ThresholdFeature(1, 0.5),
+    new MonomialFeature(monomial), new TreeFeature(root)
+  };
+  FeatureCache cache(1 << 20);
+  std::vector<const FeatureColumn*> columns(features.size(), NULL);
+  columns[4] = cache.Insert(features[4], *space);
+  std::vector<double> expectations;
+  for (Feature *feature : features) {
+    feature->ComputeUnnormalizedPopulationExpectation(*space);
+    expectations.push_back(feature->GetUnnormalizedPopulationExpectation());
+    feature->SetUnnormalizedPopulationExpectation(NAN);
+  }
+  ComputeUnnormalizedPopulationExpectations(features, columns, *space);
+  for (unsigned i = 0; i < features.size(); i++) {
+    EXPECT_NEAR(expectations[i],
+		features[i]->GetUnnormalizedPopulationExpectation(), 1e-6);
+  }
+  delete space;
+}
+
+// Tests that features of quantized raw features are evaluated in a single
+// pass over the space as well, also once raw values are released, and that
+// their expectations agree with expectations computed one by one.
+TEST(FeatureTest, TestComputeUnnormalizedPopulationExpectationsQuantized) {
+  Space *space = new Space();
+  for (int key = 0; key < 20000; key++) {
+    double values[3] = {(key % 7) * 0.5, (key % 11) * 0.1, (key % 5) - 2.0};
+    space->AddPoint(key, values, 3, key % 3 + 1.0);
+  }
+  space->Finalize();
+  std::vector<double> thresholds = {-1.5, -0.5, 0.5, 1.5};
+  EXPECT_EQ(0, space->QuantizeRawFeature(1, thresholds));
+  EXPECT_EQ(0, space->QuantizeRawFeature(2, thresholds));
+  space->ReleaseRawFeatureColumn(2);
+  Node *root = new Node();
+  root->SetFeature(2);
+  root->SetThreshold(0.5);
+  root->SetBin(space->FindBin(2, 0.5));
+  root->SetLeftChild(new Node());
+  root->SetRightChild(new Node());
+  root->GetLeftChild()->SetValue(1.0);
+  std::vector<Feature*> features = {
+    new RawFeature(1), new ProductFeature(0, 1), new TreeFeature(root),
+    new ThresholdFeature(2, 0.5, space->FindBin(2, 0.5))
+  };
+  std::vector<const FeatureColumn*> columns(features.size(), NULL);
+  std::vector<double> expectations;
+  for (Feature *feature : features) {
+    feature->ComputeUnnormalizedPopulationExpectation(*space);
+    expectations.push_back(feature->GetUnnormalizedPopulationExpectation());
+    feature->SetUnnormalizedPopulationExpectation(NAN);
+  }
+  EXPECT_NEAR(24000.0, expectations[2], 1e-6);
+  ComputeUnnormalizedPopulationExpectations(features, columns, *space);
+  for (unsigned i = 0; i < features.size(); i++) {
+    EXPECT_NEAR(expectations[i],
+		features[i]->GetUnnormalizedPopulationExpectation(), 1e-6);
+  }
+  delete space;
+}
+
+// Tests that monomials evaluated together share products of common
+// factors and agree with monomials evaluated one by one.
+TEST(FeatureTest, TestMonomialEvaluator) {
+  Space *space = new Space();
+  for (int key = 0; key < 100; key++) {
+    double values[3] = {(key % 7) * 0.5 - 1.0, (key % 11) * 0.1,
+			(key % 5) - 2.5};
+    space->AddPoint(key, values, 3, 1.0);
+  }
+  space->Finalize();
+  int mons[5][3] = {{1, 0, 2}, {1, 0, 0}, {0, 0, 0}, {1, 0, 1}, {0, 3, -1}};
+  std::vector<MonomialFeature*> monomials;
+  for (int i = 0; i < 5; i++) {
+    std::vector<int> powers(mons[i], mons[i] + 3);
+    monomials.push_back(new MonomialFeature(powers));
+  }
+  MonomialEvaluator evaluator(monomials);
+  // x0, x0 * x2, x0 * x2^2, x1^3 and x1^3 / x2.
+  EXPECT_EQ(5, evaluator.NumProducts());
+  std::vector<int> indices = {0, 1, 2};
+  space->ForEachBlock(&indices, [&](SpaceBlock &block) {
+      std::vector<double> values(monomials.size() * block.size);
+      evaluator.EvaluateBlock(block, values.data());
+      for (unsigned i = 0; i < monomials.size(); i++) {
+	for (int offset = 0; offset < block.size; offset++) {
+	  Point &point = space->GetPoint(block.begin + offset);
+	  double expected = 1.0;
+	  for (int index = 0; index < 3; index++) {
+	    expected *= std::pow(point.GetRawFeature(index), mons[i][index]);
+	  }
+	  EXPECT_NEAR(expected, values[i * block.size + offset], gTolerance);
+	  EXPECT_NEAR(expected, monomials[i]->FeatureMap(&point), gTolerance);
+	}
+      }
+    });
+  delete space;
+}
+
+// Tests that a compacted tree feature releases points stored in its
+// leaves and that a tree with a leaf value other than 0 or 1 is not packed
+// and still evaluated from raw features.
+TEST(FeatureTest, TestCompactTreeFeature) {
+  Space *space = new Space();
+  for (int key = 0; key < 1000; key++) {
+    double values[2] = {(key % 10) * 0.1, (key % 7) * 0.1};
+    space->AddPoint(key, values, 2, key % 3 + 1.0);
+  }
+  space->Finalize();
+  Node *root = new Node();
+  root->SetFeature(0);
+  root->SetThreshold(0.5);
+  root->SetLeftChild(new Node());
+  root->SetRightChild(new Node());
+  root->GetLeftChild()->SetValue(1.0);
+  Node *right_child = root->GetRightChild();
+  right_child->SetFeature(1);
+  right_child->SetThreshold(0.3);
+  right_child->SetLeftChild(new Node());
+  right_child->SetRightChild(new Node());
+  right_child->GetLeftChild()->SetValue(0.5);
+  for (auto &point : *space) {
+    Node *node = root;
+    while (!node->IsLeaf()) {
+      node = node->Child(&point);
+    }
+    node->AddPoint(&point);
+  }
+  TreeFeature *feature = new TreeFeature(root);
+  feature->ComputeUnnormalizedPopulationExpectation(*space);
+  double expectation = feature->GetUnnormalizedPopulationExpectation();
+  std::vector<double> values(space->NumPoints());
+  space->ForEachBlock(NULL, [&](SpaceBlock &block) {
+      feature->FeatureMapBlock(block, values.data() + block.begin);
+    });
+  feature->Compact(*space);
+  EXPECT_TRUE(root->GetLeftChild()->PointsBegin() ==
+	      root->GetLeftChild()->PointsEnd());
+  EXPECT_EQ(0, right_child->GetLeftChild()->GetSampleCount());
+  EXPECT_FALSE(feature->IsPacked(*space));
+  feature->ComputeUnnormalizedPopulationExpectation(*space);
+  EXPECT_NEAR(expectation, feature->GetUnnormalizedPopulationExpectation(),
+	      gTolerance);
+  std::vector<double> compact_values(space->NumPoints());
+  std::vector<int> indices;
+  space->ForEachBlock(&indices, [&](SpaceBlock &block) {
+      feature->FeatureMapBlock(block, compact_values.data() + block.begin);
+    });
+  EXPECT_TRUE(values == compact_values);
+  EXPECT_NEAR(0.5, feature->FeatureMap(&(space->GetPoint(7))), gTolerance);
+  delete feature;
+  delete space;
+}
+
+// Tests computing population expectations of features on a chunked space
+// that provides raw feature values in several blocks.
+TEST(FeatureTest, TestComputePopulationExpectationOnChunkedSpace) {
+  double values[4][2] = {{0.0, 3.0}, {2.0, 0.0}, {0.0, 0.5}, {-0.5, 1.0}};
+  Space *space = new Space();
+  for (int key = 0; key < 4; key++) {
+    space->AddPoint(key, values[key], 2, 1.0);
+  }
+  space->Finalize();
+  std::string filename = "feature_test.bin";
+  EXPECT_EQ(0, space->WriteBinary(filename, std::vector<int>(4, 1)));
+  delete space;
+  space = new Space();
+  std::vector<int> counts;
+  EXPECT_EQ(0, space->OpenChunked(filename, 3, &counts));
+  for (int key = 0; key < 4; key++) {
+    space->SetProbWeight(key, key + 1);
+  }
+
+  RawFeature *raw_feature = new RawFeature(1);
+  raw_feature->ComputeUnnormalizedPopulationExpectation(*space);
+  EXPECT_NEAR(8.5, raw_feature->GetUnnormalizedPopulationExpectation(),
+	      gTolerance);
+  ProductFeature *product_feature = new ProductFeature(0, 1);
+  product_feature->ComputeUnnormalizedPopulationExpectation(*space);
+  EXPECT_NEAR(-2.0, product_feature->GetUnnormalizedPopulationExpectation(),
+	      gTolerance);
+  ThresholdFeature *threshold_feature = new ThresholdFeature(0, 1.0);
+  threshold_feature->ComputeUnnormalizedPopulationExpectation(*space);
+  EXPECT_NEAR(2.0, threshold_feature->GetUnnormalizedPopulationExpectation(),
+	      gTolerance);
+  int mon[2] = {1, 2};
+  std::vector<int> monomial(mon, mon + 2);
+  MonomialFeature *monomial_feature = new MonomialFeature(monomial);
+  monomial_feature->ComputeUnnormalizedPopulationExpectation(*space);
+  EXPECT_NEAR(-2.0, monomial_feature->GetUnnormalizedPopulationExpectation(),
+	      gTolerance);
+
+  Node *root = new Node();
+  root->SetFeature(1);
+  root->SetThreshold(0.75);
+  root->SetLeftChild(new Node());
+  root->SetRightChild(new Node());
+  root->GetLeftChild()->SetValue(1.0);
+  TreeFeature *tree_feature = new TreeFeature(root);
+  tree_feature->ComputeUnnormalizedPopulationExpectation(*space);
+  EXPECT_NEAR(5.0, tree_feature->GetUnnormalizedPopulationExpectation(),
+	      gTolerance);
+  delete space;
+  std::remove(filename.c_str());
+}
+
 // Tests that computition expectations of the tree feature based on
 // the points and samples stored in the leaf is correct.
 TEST(FeatureTest, TestComputeTreeExpectations) {
@@ -555,3 +957,147 @@ TEST(FeatureTest, TestComplexity) {
   EXPECT_NEAR(7.0, feature7->Complexity(), gTolerance);
   EXPECT_NEAR(8.0, feature8->Complexity(), gTolerance);
 }
+
+// Tests that packed threshold features and compacted trees with 0/1
+// leaves have the same values and expectations as unpacked ones.
+TEST(FeatureTest, TestPackedFeatures) {
+  Space *space = new Space();
+  for (int key = 0; key < 1000; key++) {
+    double values[2] = {(key % 10) * 0.1, (key % 7) * 0.1};
+    space->AddPoint(key, values, 2, key % 3 + 1.0);
+  }
+  space->Finalize();
+  Sample sample;
+  for (int key = 0; key < 1000; key += 3) {
+    for (int copy = 0; copy <= key % 5; copy++) {
+      sample.push_back(&space->GetPoint(key));
+    }
+  }
+  PackedSample packed_sample;
+  EXPECT_EQ(0, packed_sample.Pack(sample, *space));
+  EXPECT_EQ(3, int(packed_sample.planes.size()));
+  Point outside(1);
+  Sample other_sample(1, &outside);
+  EXPECT_EQ(-1, PackedSample().Pack(other_sample, *space));
+
+  ThresholdFeature *feature = new ThresholdFeature(0, 0.45);
+  feature->ComputeSampleExpectation(sample);
+  feature->ComputeUnnormalizedPopulationExpectation(*space);
+  double sample_expectation = feature->GetSampleExpectation();
+  double population_expectation =
+    feature->GetUnnormalizedPopulationExpectation();
+  EXPECT_EQ(-1, feature->ComputePackedSampleExpectation(packed_sample));
+  EXPECT_FALSE(feature->IsPacked(*space));
+  feature->Pack(*space);
+  EXPECT_TRUE(feature->IsPacked(*space));
+  EXPECT_EQ(0, feature->ComputePackedSampleExpectation(packed_sample));
+  EXPECT_EQ(sample_expectation, feature->GetSampleExpectation());
+  feature->ComputeUnnormalizedPopulationExpectation(*space);
+  EXPECT_NEAR(population_expectation,
+	      feature->GetUnnormalizedPopulationExpectation(), gTolerance);
+  std::vector<int> indices;
+  space->ForEachBlock(&indices, [&](SpaceBlock &block) {
+      std::vector<double> values(block.size);
+      feature->FeatureMapBlock(block, values.data());
+      for (int offset = 0; offset < block.size; offset++) {
+	EXPECT_EQ(feature->FeatureMap(&space->GetPoint(block.begin + offset)),
+		  values[offset]);
+      }
+    });
+
+  Node *root = new Node();
+  root->SetFeature(1);
+  root->SetThreshold(0.25);
+  root->SetLeftChild(new Node());
+  root->SetRightChild(new Node());
+  root->GetRightChild()->SetValue(1.0);
+  for (auto &point : *space) {
+    root->Child(&point)->AddPoint(&point);
+  }
+  TreeFeature *tree_feature = new TreeFeature(root);
+  tree_feature->ComputeUnnormalizedPopulationExpectation(*space);
+  population_expectation =
+    tree_feature->GetUnnormalizedPopulationExpectation();
+  tree_feature->Compact(*space);
+  EXPECT_TRUE(tree_feature->IsPacked(*space));
+  tree_feature->ComputeUnnormalizedPopulationExpectation(*space);
+  EXPECT_NEAR(population_expectation,
+	      tree_feature->GetUnnormalizedPopulationExpectation(), gTolerance);
+  delete space;
+}
+
+// Tests that expectations of threshold features of the same raw feature
+// computed together agree with expectations computed one by one.
+TEST(FeatureTest, TestComputeThresholdExpectations) {
+  Space *space = new Space();
+  for (int key = 0; key < 1000; key++) {
+    double values[2] = {(key % 10) * 0.1, (key % 13 == 0) ? NAN : key * 0.01};
+    space->AddPoint(key, values, 2, key % 3 + 1.0);
+  }
+  space->Finalize();
+  std::vector<double> thresholds = {0.25, 0.45, 0.45, -1.0, 2.0};
+  std::vector<double> bin_thresholds = {0.15, 0.35, 0.75};
+  EXPECT_EQ(0, space->QuantizeRawFeature(0, bin_thresholds));
+  std::vector<ThresholdFeature*> features;
+  std::vector<ThresholdFeature*> quantized_features;
+  for (double threshold : thresholds) {
+    features.push_back(new ThresholdFeature(1, threshold));
+  }
+  for (unsigned bin = 0; bin < bin_thresholds.size(); bin++) {
+    quantized_features.push_back(new ThresholdFeature(0, bin_thresholds[bin],
+						      bin));
+  }
+  for (auto group : {features, quantized_features}) {
+    std::vector<double> expectations;
+    for (ThresholdFeature *feature : group) {
+      feature->ComputeUnnormalizedPopulationExpectation(*space);
+      expectations.push_back(feature->GetUnnormalizedPopulationExpectation());
+      feature->SetUnnormalizedPopulationExpectation(NAN);
+    }
+    EXPECT_EQ(0, ComputeThresholdExpectations(group, *space));
+    for (unsigned i = 0; i < group.size(); i++) {
+      EXPECT_NEAR(expectations[i],
+		  group[i]->GetUnnormalizedPopulationExpectation(), 1e-9);
+    }
+  }
+  std::vector<ThresholdFeature*> mixed = {features[0], quantized_features[0]};
+  EXPECT_EQ(-1, ComputeThresholdExpectations(mixed, *space));
+  delete space;
+}
+
+// Tests that products of the same pair of raw features share a weighted
+// sum and that sums agree with weighted sums of values of the products.
+TEST(FeatureTest, TestProductEvaluator) {
+  Space *space = new Space();
+  for (int key = 0; key < 1000; key++) {
+    double values[3] = {(key % 10) * 0.1, (key % 7) - 3.0, (key % 11) * 0.5};
+    space->AddPoint(key, values, 3, key % 3 + 1.0);
+  }
+  space->Finalize();
+  std::vector<ProductFeature*> products = {
+    new ProductFeature(0, 1), new ProductFeature(1, 0),
+    new ProductFeature(2, 2), new ProductFeature(0, 2),
+    new ProductFeature(0, 1)
+  };
+  ProductEvaluator evaluator(products);
+  EXPECT_EQ(3, evaluator.NumPairs());
+  std::vector<double> sums(products.size(), 0.0);
+  std::vector<int> indices = {0, 1, 2};
+  space->ForEachBlock(&indices, [&](SpaceBlock &block) {
+      EXPECT_EQ(0, evaluator.AddWeightedSums(block, sums.data()));
+    });
+  for (unsigned i = 0; i < products.size(); i++) {
+    products[i]->ComputeUnnormalizedPopulationExpectation(*space);
+    EXPECT_NEAR(products[i]->GetUnnormalizedPopulationExpectation(), sums[i],
+		1e-9);
+  }
+  SpaceBlock block;
+  block.space = space;
+  block.begin = 0;
+  block.size = 10;
+  block.columns.assign(1, space->RawFeatureColumn(0));
+  block.weights = space->ProbWeights().data();
+  EXPECT_EQ(-1, evaluator.AddWeightedSums(block, sums.data()));
+  delete space;
+}
+
@@ -0,0 +1,625 @@
+#include <cmath>
+#include <algorithm>
+#include "kernels.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define KERNELS_X86
+#endif
+
+// Coefficients of the polynomial approximating exp on [-ln(2)/2, ln(2)/2]
+// (Taylor series up to the power 13) and the two parts of ln(2) used to
+// reduce arguments to this interval.
+static const double kExpCoefficients[14] = {
+  1.0, 1.0, 1.0 / 2, 1.0 / 6, 1.0 / 24, 1.0 / 120, 1.0 / 720, 1.0 / 5040,
+  1.0 / 40320, 1.0 / 362880, 1.0 / 3628800, 1.0 / 39916800,
+  1.0 / 479001600, 1.0 / 6227020800.0
+};
+static const double kLog2E = 1.4426950408889634;
+static const double kLn2High = 6.93145751953125e-1;
+static const double kLn2Low = 1.42860682030941723212e-6;
+// Arguments below kMinExp are mapped to zero and above kMaxExp
+// to infinity.
+static const double kMinExp = -708.0;
+static const double kMaxExp = 709.78;
+
+// Returns the sum of partial sums stored in lanes, combined pairwise in
+// a fixed order (lanes is overwritten).
+static double CombineLanes(double *lanes) {
+  for (int lane = 0; lane < gKernelLanes / 2; lane++) {
+    lanes[lane] += lanes[lane + gKernelLanes / 2];
+  }
+  lanes[0] += lanes[2];
+  lanes[1] += lanes[3];
+  return lanes[0] + lanes[1];
+}
+
+// Adds term(i) for i in [begin, count) to the partial sum i % gKernelLanes
+// and returns the combined sum of all lanes. Vector kernels process
+// a multiple of gKernelLanes values and leave the rest to this function.
+template <typename Term>
+static double AddTerms(int begin, int count, double *lanes, Term term) {
+  int i = begin;
+  for (; i + gKernelLanes <= count; i += gKernelLanes) {
+    for (int lane = 0; lane < gKernelLanes; lane++) {
+      lanes[lane] += term(i + lane);
+    }
+  }
+  for (; i < count; i++) {
+    lanes[i % gKernelLanes] += term(i);
+  }
+  return CombineLanes(lanes);
+}
+
+// Returns the bit at the given position of a bit array.
+static inline bool BitAt(const uint64_t *bits, size_t position) {
+  return (bits[position / 64] >> (position % 64)) & 1;
+}
+
+// Returns 64 consecutive bits of a bit array starting at the given
+// position. All of these bits need to be inside the array.
+static inline uint64_t WordAt(const uint64_t *bits, size_t position) {
+  int shift = position % 64;
+  const uint64_t *word = bits + position / 64;
+  return (shift == 0 ? word[0] :
+	  (word[0] >> shift) | (word[1] << (64 - shift)));
+}
+
+// Returns exp(x) computed with the same sequence of floating point
+// operations as the vector kernels, so that weights are equal bit for bit
+// whichever instruction set is used. The relative error is within a few
+// units in the last place. Results that would be subnormal are zero.
+double KernelExp(double x) {
+  if (x != x) {
+    return x;
+  }
+  if (x < kMinExp) {
+    return 0.0;
+  }
+  if (x > kMaxExp) {
+    return INFINITY;
+  }
+  // Adding and subtracting 1.5 * 2^52 rounds to the nearest integer.
+  double n = (x * kLog2E + 6755399441055744.0) - 6755399441055744.0;
+  double r = (x - n * kLn2High) - n * kLn2Low;
+  double p = kExpCoefficients[13];
+  for (int k = 12; k >= 0; k--) {
+    p = p * r + kExpCoefficients[k];
+  }
+  union { uint64_t bits; double value; } scale;
+  scale.bits = uint64_t(int64_t(n) + 1022) << 52;
+  return (p * scale.value) * 2.0;
+}
+
+static double ScalarSum(const double *values, int count) {
+  double lanes[gKernelLanes] = {0.0};
+  return AddTerms(0, count, lanes, [&](int i) { return values[i]; });
+}
+
+static double ScalarWeightedSum(const double *weights, const double *values,
+				int count) {
+  double lanes[gKernelLanes] = {0.0};
+  return AddTerms(0, count, lanes,
+		  [&](int i) { return weights[i] * values[i]; });
+}
+
+static double ScalarWeightedFloatSum(const double *weights,
+				     const float *values, int count) {
+  double lanes[gKernelLanes] = {0.0};
+  return AddTerms(0, count, lanes,
+		  [&](int i) { return weights[i] * double(values[i]); });
+}
+
+static double ScalarWeightedProductSum(const double *weights,
+				       const double *first,
+				       const double *second, int count) {
+  double lanes[gKernelLanes] = {0.0};
+  return AddTerms(0, count, lanes, [&](int i) {
+      return (weights[i] * first[i]) * second[i];
+    });
+}
+
+static double ScalarMaskedWeightSum(const double *weights,
+				    const uint64_t *bits, size_t first_bit,
+				    int count) {
+  double lanes[gKernelLanes] = {0.0};
+  return AddTerms(0, count, lanes, [&](int i) {
+      return (BitAt(bits, first_bit + i) ? weights[i] : 0.0);
+    });
+}
+
+// Performs one step of StepExpSum at position i and returns the new weight.
+static inline double StepExp(double step, const double *values, double shift,
+			     double *scores, double *weights, int i,
+			     double *max_score) {
+  double score = scores[i];
+  if (values != NULL) {
+    score += step * values[i];
+  }
+  scores[i] = score;
+  weights[i] = KernelExp(score - shift);
+  *max_score = std::max(*max_score, score);
+  return weights[i];
+}
+
+static double ScalarStepExpSum(double step, const double *values,
+			       double shift, double *scores, double *weights,
+			       int count, double *max_score) {
+  double lanes[gKernelLanes] = {0.0};
+  return AddTerms(0, count, lanes, [&](int i) {
+      return StepExp(step, values, shift, scores, weights, i, max_score);
+    });
+}
+
+static uint64_t ScalarAndPopcount(const uint64_t *first,
+				  const uint64_t *second, size_t words) {
+  uint64_t count = 0;
+  for (size_t i = 0; i < words; i++) {
+    count += __builtin_popcountll(first[i] & second[i]);
+  }
+  return count;
+}
+
+#ifdef KERNELS_X86
+
+// Every CPU with AVX2 also has the popcnt instruction, which is used by
+// both vector instruction sets to count bits.
+__attribute__((target("popcnt")))
+static uint64_t PopcntAndPopcount(const uint64_t *first,
+				  const uint64_t *second, size_t words) {
+  uint64_t count = 0;
+  for (size_t i = 0; i < words; i++) {
+    count += _mm_popcnt_u64(first[i] & second[i]);
+  }
+  return count;
+}
+
+// AVX2 kernels keep lanes 0-3 and 4-7 in two vectors.
+
+__attribute__((target("avx2")))
+static inline void StoreLanes(__m256d low, __m256d high, double *lanes) {
+  _mm256_storeu_pd(lanes, low);
+  _mm256_storeu_pd(lanes + 4, high);
+}
+
+// Returns KernelExp of every element of x.
+__attribute__((target("avx2")))
+static inline __m256d Exp(__m256d x) {
+  __m256d clamped = _mm256_min_pd(_mm256_max_pd(x, _mm256_set1_pd(kMinExp)),
+				  _mm256_set1_pd(kMaxExp));
+  __m256d n = _mm256_round_pd(_mm256_mul_pd(clamped, _mm256_set1_pd(kLog2E)),
+			      _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m256d r = _mm256_sub_pd(
+    _mm256_sub_pd(clamped, _mm256_mul_pd(n, _mm256_set1_pd(kLn2High))),
+    _mm256_mul_pd(n, _mm256_set1_pd(kLn2Low)));
+  __m256d p = _mm256_set1_pd(kExpCoefficients[13]);
+  for (int k = 12; k >= 0; k--) {
+    p = _mm256_add_pd(_mm256_mul_pd(p, r),
+		      _mm256_set1_pd(kExpCoefficients[k]));
+  }
+  // Exponent bits of 2^(n - 1) are the low bits of n + 1022 + 1.5 * 2^52.
+  __m256d biased = _mm256_add_pd(_mm256_add_pd(n, _mm256_set1_pd(1022.0)),
+				 _mm256_set1_pd(6755399441055744.0));
+  __m256d scale = _mm256_castsi256_pd(
+    _mm256_slli_epi64(_mm256_castpd_si256(biased), 52));
+  __m256d result = _mm256_mul_pd(_mm256_mul_pd(p, scale),
+				 _mm256_set1_pd(2.0));
+  result = _mm256_blendv_pd(result, _mm256_setzero_pd(),
+			    _mm256_cmp_pd(x, _mm256_set1_pd(kMinExp),
+					  _CMP_LT_OQ));
+  result = _mm256_blendv_pd(result, _mm256_set1_pd(INFINITY),
+			    _mm256_cmp_pd(x, _mm256_set1_pd(kMaxExp),
+					  _CMP_GT_OQ));
+  return _mm256_blendv_pd(result, x, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+}
+
+__attribute__((target("avx2")))
+static double Avx2Sum(const double *values, int count) {
+  __m256d low = _mm256_setzero_pd();
+  __m256d high = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + gKernelLanes <= count; i += gKernelLanes) {
+    low = _mm256_add_pd(low, _mm256_loadu_pd(values + i));
+    high = _mm256_add_pd(high, _mm256_loadu_pd(values + i + 4));
+  }
+  double lanes[gKernelLanes];
+  StoreLanes(low, high, lanes);
+  return AddTerms(i, count, lanes, [&](int j) { return values[j]; });
+}
+
+__attribute__((target("avx2")))
+static double Avx2WeightedSum(const double *weights, const double *values,
+			      int count) {
+  __m256d low = _mm256_setzero_pd();
+  __m256d high = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + gKernelLanes <= count; i += gKernelLanes) {
+    low = _mm256_add_pd(low, _mm256_mul_pd(_mm256_loadu_pd(weights + i),
+					   _mm256_loadu_pd(values + i)));
+    high = _mm256_add_pd(high,
+			 _mm256_mul_pd(_mm256_loadu_pd(weights + i + 4),
+				       _mm256_loadu_pd(values + i + 4)));
+  }
+  double lanes[gKernelLanes];
+  StoreLanes(low, high, lanes);
+  return AddTerms(i, count, lanes,
+		  [&](int j) { return weights[j] * values[j]; });
+}
+
+__attribute__((target("avx2")))
+static double Avx2WeightedFloatSum(const double *weights, const float *values,
+				   int count) {
+  __m256d low = _mm256_setzero_pd();
+  __m256d high = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + gKernelLanes <= count; i += gKernelLanes) {
+    __m256d low_values = _mm256_cvtps_pd(_mm_loadu_ps(values + i));
+    __m256d high_values = _mm256_cvtps_pd(_mm_loadu_ps(values + i + 4));
+    low = _mm256_add_pd(low, _mm256_mul_pd(_mm256_loadu_pd(weights + i),
+					   low_values));
+    high = _mm256_add_pd(high,
+			 _mm256_mul_pd(_mm256_loadu_pd(weights + i + 4),
+				       high_values));
+  }
+  double lanes[gKernelLanes];
+  StoreLanes(low, high, lanes);
+  return AddTerms(i, count, lanes,
+		  [&](int j) { return weights[j] * double(values[j]); });
+}
+
+__attribute__((target("avx2")))
+static double Avx2WeightedProductSum(const double *weights,
+				     const double *first,
+				     const double *second, int count) {
+  __m256d low = _mm256_setzero_pd();
+  __m256d high = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + gKernelLanes <= count; i += gKernelLanes) {
+    low = _mm256_add_pd(
+      low, _mm256_mul_pd(_mm256_mul_pd(_mm256_loadu_pd(weights + i),
+				       _mm256_loadu_pd(first + i)),
+			 _mm256_loadu_pd(second + i)));
+    high = _mm256_add_pd(
+      high, _mm256_mul_pd(_mm256_mul_pd(_mm256_loadu_pd(weights + i + 4),
+					_mm256_loadu_pd(first + i + 4)),
+			  _mm256_loadu_pd(second + i + 4)));
+  }
+  double lanes[gKernelLanes];
+  StoreLanes(low, high, lanes);
+  return AddTerms(i, count, lanes, [&](int j) {
+      return (weights[j] * first[j]) * second[j];
+    });
+}
+
+// Returns a mask with all bits of element k set if bit k of the four
+// given bits is set.
+__attribute__((target("avx2")))
+static inline __m256d NibbleMask(uint64_t nibble) {
+  const __m256i positions = _mm256_setr_epi64x(1, 2, 4, 8);
+  __m256i selected = _mm256_and_si256(_mm256_set1_epi64x(nibble), positions);
+  return _mm256_castsi256_pd(_mm256_cmpeq_epi64(selected, positions));
+}
+
+__attribute__((target("avx2")))
+static double Avx2MaskedWeightSum(const double *weights, const uint64_t *bits,
+				  size_t first_bit, int count) {
+  __m256d low = _mm256_setzero_pd();
+  __m256d high = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 64 <= count; i += 64) {
+    uint64_t word = WordAt(bits, first_bit + i);
+    for (int j = 0; j < 64; j += gKernelLanes, word >>= gKernelLanes) {
+      low = _mm256_add_pd(low, _mm256_and_pd(_mm256_loadu_pd(weights + i + j),
+					     NibbleMask(word & 15)));
+      high = _mm256_add_pd(high,
+			   _mm256_and_pd(_mm256_loadu_pd(weights + i + j + 4),
+					 NibbleMask((word >> 4) & 15)));
+    }
+  }
+  double lanes[gKernelLanes];
+  StoreLanes(low, high, lanes);
+  return AddTerms(i, count, lanes, [&](int j) {
+      return (BitAt(bits, first_bit + j) ? weights[j] : 0.0);
+    });
+}
+
+__attribute__((target("avx2")))
+static double Avx2StepExpSum(double step, const double *values, double shift,
+			     double *scores, double *weights, int count,
+			     double *max_score) {
+  __m256d sums[2] = {_mm256_setzero_pd(), _mm256_setzero_pd()};
+  __m256d maxima = _mm256_set1_pd(*max_score);
+  int i = 0;
+  for (; i + gKernelLanes <= count; i += gKernelLanes) {
+    for (int half = 0; half < 2; half++) {
+      int j = i + 4 * half;
+      __m256d score = _mm256_loadu_pd(scores + j);
+      if (values != NULL) {
+	score = _mm256_add_pd(score,
+			      _mm256_mul_pd(_mm256_set1_pd(step),
+					    _mm256_loadu_pd(values + j)));
+      }
+      _mm256_storeu_pd(scores + j, score);
+      __m256d weight = Exp(_mm256_sub_pd(score, _mm256_set1_pd(shift)));
+      _mm256_storeu_pd(weights + j, weight);
+      sums[half] = _mm256_add_pd(sums[half], weight);
+      maxima = _mm256_max_pd(score, maxima);
+    }
+  }
+  double lanes[gKernelLanes];
+  StoreLanes(maxima, maxima, lanes);
+  for (int lane = 0; lane < 4; lane++) {
+    *max_score = std::max(*max_score, lanes[lane]);
+  }
+  StoreLanes(sums[0], sums[1], lanes);
+  return AddTerms(i, count, lanes, [&](int j) {
+      return StepExp(step, values, shift, scores, weights, j, max_score);
+    });
+}
+
+// AVX-512 kernels keep all lanes in a single vector.
+// Operations without a mask are written as zero-masked operations on all
+// lanes: the compiler implements the unmasked ones with an undefined merge
+// source, which it then reports as possibly uninitialized.
+static const __mmask8 kAllLanes = 0xFF;
+
+// Returns KernelExp of every element of x.
+__attribute__((target("avx512f")))
+static inline __m512d Exp(__m512d x) {
+  __m512d clamped = _mm512_maskz_min_pd(
+    kAllLanes, _mm512_maskz_max_pd(kAllLanes, x, _mm512_set1_pd(kMinExp)),
+    _mm512_set1_pd(kMaxExp));
+  __m512d n = _mm512_maskz_roundscale_pd(
+    kAllLanes, _mm512_mul_pd(clamped, _mm512_set1_pd(kLog2E)),
+    _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m512d r = _mm512_sub_pd(
+    _mm512_sub_pd(clamped, _mm512_mul_pd(n, _mm512_set1_pd(kLn2High))),
+    _mm512_mul_pd(n, _mm512_set1_pd(kLn2Low)));
+  __m512d p = _mm512_set1_pd(kExpCoefficients[13]);
+  for (int k = 12; k >= 0; k--) {
+    p = _mm512_add_pd(_mm512_mul_pd(p, r),
+		      _mm512_set1_pd(kExpCoefficients[k]));
+  }
+  __m512d biased = _mm512_add_pd(_mm512_add_pd(n, _mm512_set1_pd(1022.0)),
+				 _mm512_set1_pd(6755399441055744.0));
+  __m512d scale = _mm512_castsi512_pd(
+    _mm512_maskz_slli_epi64(kAllLanes, _mm512_castpd_si512(biased), 52));
+  __m512d result = _mm512_mul_pd(_mm512_mul_pd(p, scale),
+				 _mm512_set1_pd(2.0));
+  result = _mm512_mask_blend_pd(
+    _mm512_cmp_pd_mask(x, _mm512_set1_pd(kMinExp), _CMP_LT_OQ),
+    result, _mm512_setzero_pd());
+  result = _mm512_mask_blend_pd(
+    _mm512_cmp_pd_mask(x, _mm512_set1_pd(kMaxExp), _CMP_GT_OQ),
+    result, _mm512_set1_pd(INFINITY));
+  return _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, x, _CMP_UNORD_Q),
+			      result, x);
+}
+
+__attribute__((target("avx512f")))
+static double Avx512Sum(const double *values, int count) {
+  __m512d sum = _mm512_setzero_pd();
+  int i = 0;
+  for (; i + gKernelLanes <= count; i += gKernelLanes) {
+    sum = _mm512_add_pd(sum, _mm512_loadu_pd(values + i));
+  }
+  double lanes[gKernelLanes];
+  _mm512_storeu_pd(lanes, sum);
+  return AddTerms(i, count, lanes, [&](int j) { return values[j]; });
+}
+
+__attribute__((target("avx512f")))
+static double Avx512WeightedSum(const double *weights, const double *values,
+				int count) {
+  __m512d sum = _mm512_setzero_pd();
+  int i = 0;
+  for (; i + gKernelLanes <= count; i += gKernelLanes) {
+    sum = _mm512_add_pd(sum, _mm512_mul_pd(_mm512_loadu_pd(weights + i),
+					   _mm512_loadu_pd(values + i)));
+  }
+  double lanes[gKernelLanes];
+  _mm512_storeu_pd(lanes, sum);
+  return AddTerms(i, count, lanes,
+		  [&](int j) { return weights[j] * values[j]; });
+}
+
+__attribute__((target("avx512f")))
+static double Avx512WeightedFloatSum(const double *weights,
+				     const float *values, int count) {
+  __m512d sum = _mm512_setzero_pd();
+  int i = 0;
+  for (; i + gKernelLanes <= count; i += gKernelLanes) {
+    __m512d value = _mm512_maskz_cvtps_pd(kAllLanes,
+					  _mm256_loadu_ps(values + i));
+    sum = _mm512_add_pd(sum, _mm512_mul_pd(_mm512_loadu_pd(weights + i),
+					   value));
+  }
+  double lanes[gKernelLanes];
+  _mm512_storeu_pd(lanes, sum);
+  return AddTerms(i, count, lanes,
+		  [&](int j) { return weights[j] * double(values[j]); });
+}
+
+__attribute__((target("avx512f")))
+static double Avx512WeightedProductSum(const double *weights,
+				       const double *first,
+				       const double *second, int count) {
+  __m512d sum = _mm512_setzero_pd();
+  int i = 0;
+  for (; i + gKernelLanes <= count; i += gKernelLanes) {
+    sum = _mm512_add_pd(
+      sum, _mm512_mul_pd(_mm512_mul_pd(_mm512_loadu_pd(weights + i),
+				       _mm512_loadu_pd(first + i)),
+			 _mm512_loadu_pd(second + i)));
+  }
+  double lanes[gKernelLanes];
+  _mm512_storeu_pd(lanes, sum);
+  return AddTerms(i, count, lanes, [&](int j) {
+      return (weights[j] * first[j]) * second[j];
+    });
+}
+
+__attribute__((target("avx512f")))
+static double Avx512MaskedWeightSum(const double *weights,
+				    const uint64_t *bits, size_t first_bit,
+				    int count) {
+  __m512d sum = _mm512_setzero_pd();
+  int i = 0;
+  for (; i + 64 <= count; i += 64) {
+    uint64_t word = WordAt(bits, first_bit + i);
+    for (int j = 0; j < 64; j += gKernelLanes, word >>= gKernelLanes) {
+      sum = _mm512_add_pd(sum, _mm512_maskz_mov_pd(
+			    __mmask8(word), _mm512_loadu_pd(weights + i + j)));
+    }
+  }
+  double lanes[gKernelLanes];
+  _mm512_storeu_pd(lanes, sum);
+  return AddTerms(i, count, lanes, [&](int j) {
+      return (BitAt(bits, first_bit + j) ? weights[j] : 0.0);
+    });
+}
+
+__attribute__((target("avx512f")))
+static double Avx512StepExpSum(double step, const double *values,
+			       double shift, double *scores, double *weights,
+			       int count, double *max_score) {
+  __m512d sum = _mm512_setzero_pd();
+  __m512d maxima = _mm512_set1_pd(*max_score);
+  int i = 0;
+  for (; i + gKernelLanes <= count; i += gKernelLanes) {
+    __m512d score = _mm512_loadu_pd(scores + i);
+    if (values != NULL) {
+      score = _mm512_add_pd(score, _mm512_mul_pd(_mm512_set1_pd(step),
+						 _mm512_loadu_pd(values + i)));
+    }
+    _mm512_storeu_pd(scores + i, score);
+    __m512d weight = Exp(_mm512_sub_pd(score, _mm512_set1_pd(shift)));
+    _mm512_storeu_pd(weights + i, weight);
+    sum = _mm512_add_pd(sum, weight);
+    maxima = _mm512_maskz_max_pd(kAllLanes, score, maxima);
+  }
+  double lanes[gKernelLanes];
+  _mm512_storeu_pd(lanes, maxima);
+  for (int lane = 0; lane < gKernelLanes; lane++) {
+    *max_score = std::max(*max_score, lanes[lane]);
+  }
+  _mm512_storeu_pd(lanes, sum);
+  return AddTerms(i, count, lanes, [&](int j) {
+      return StepExp(step, values, shift, scores, weights, j, max_score);
+    });
+}
+
+#endif
+
+// Returns the widest instruction set supported by this CPU.
+static KernelIsa DetectKernelIsa() {
+#ifdef KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return kAvx512Isa;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return kAvx2Isa;
+  }
+#endif
+  return kScalarIsa;
+}
+
+// Instruction set used by the kernels.
+static KernelIsa kernel_isa = DetectKernelIsa();
+
+// Returns the instruction set used by the kernels.
+KernelIsa GetKernelIsa() {
+  return kernel_isa;
+}
+
+// Returns true if the kernels can use the given instruction set on
+// this CPU.
+bool IsKernelIsaSupported(KernelIsa isa) {
+  return isa <= DetectKernelIsa();
+}
+
+// Makes the kernels use the given instruction set. Must not be called
+// while kernels are running. Returns 0 on success and -1 if the
+// instruction set is not supported by this CPU.
+int SetKernelIsa(KernelIsa isa) {
+  if (!IsKernelIsaSupported(isa)) {
+    return -1;
+  }
+  kernel_isa = isa;
+  return 0;
+}
+
+#ifdef KERNELS_X86
+#define DISPATCH(scalar, avx2, avx512)					\
+  switch (kernel_isa) {							\
+  case kAvx512Isa: return avx512;					\
+  case kAvx2Isa: return avx2;						\
+  default: return scalar;						\
+  }
+#else
+#define DISPATCH(scalar, avx2, avx512) return scalar;
+#endif
+
+// Returns the sum of count values.
+double KernelSum(const double *values, int count) {
+  DISPATCH(ScalarSum(values, count), Avx2Sum(values, count),
+	   Avx512Sum(values, count));
+}
+
+// Returns the sum of count values multiplied by the corresponding weights.
+double WeightedSum(const double *weights, const double *values, int count) {
+  DISPATCH(ScalarWeightedSum(weights, values, count),
+	   Avx2WeightedSum(weights, values, count),
+	   Avx512WeightedSum(weights, values, count));
+}
+
+// Returns the sum of count values (stored as floats) multiplied by
+// the corresponding weights.
+double WeightedSum(const double *weights, const float *values, int count) {
+  DISPATCH(ScalarWeightedFloatSum(weights, values, count),
+	   Avx2WeightedFloatSum(weights, values, count),
+	   Avx512WeightedFloatSum(weights, values, count));
+}
+
+// Returns the sum of count products of first and second values
+// multiplied by the corresponding weights.
+double WeightedProductSum(const double *weights, const double *first,
+			  const double *second, int count) {
+  DISPATCH(ScalarWeightedProductSum(weights, first, second, count),
+	   Avx2WeightedProductSum(weights, first, second, count),
+	   Avx512WeightedProductSum(weights, first, second, count));
+}
+
+// Returns the sum of those of count weights for which the corresponding
+// bit of the bit array is set. Bit of weights[i] is at position
+// first_bit + i.
+double MaskedWeightSum(const double *weights, const uint64_t *bits,
+		       size_t first_bit, int count) {
+  DISPATCH(ScalarMaskedWeightSum(weights, bits, first_bit, count),
+	   Avx2MaskedWeightSum(weights, bits, first_bit, count),
+	   Avx512MaskedWeightSum(weights, bits, first_bit, count));
+}
+
+// Returns the number of bits set in both of the given bit arrays of
+// the given number of words.
+uint64_t AndPopcount(const uint64_t *first, const uint64_t *second,
+		     size_t words) {
+  DISPATCH(ScalarAndPopcount(first, second, words),
+	   PopcntAndPopcount(first, second, words),
+	   PopcntAndPopcount(first, second, words));
+}
+
+// Adds step times values to count log-scores (unless values is NULL),
+// sets weights to KernelExp of the scores minus shift and returns the sum
+// of the new weights. The largest score is accumulated in max_score.
+double StepExpSum(double step, const double *values, double shift,
+		  double *scores, double *weights, int count,
+		  double *max_score) {
+  DISPATCH(ScalarStepExpSum(step, values, shift, scores, weights, count,
+			    max_score),
+	   Avx2StepExpSum(step, values, shift, scores, weights, count,
+			  max_score),
+	   Avx512StepExpSum(step, values, shift, scores, weights, count,
+			    max_score));
+}
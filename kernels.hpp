@@ -0,0 +1,41 @@
+#include <cstddef>
+#include <stdint.h>
+
+#ifndef KERNELS_HPP
+#define KERNELS_HPP
+
+// Instruction sets for which the reduction kernels below are compiled.
+// The kernels pick the widest one supported by the CPU at run time
+// unless it is changed with SetKernelIsa.
+enum KernelIsa {
+  kScalarIsa = 0,
+  kAvx2Isa = 1,
+  kAvx512Isa = 2
+};
+
+// Number of partial sums kept by every reduction kernel. Value at
+// position i is always added to partial sum i % gKernelLanes and partial
+// sums are combined in a fixed pairwise order, so the result of a kernel
+// is the same bit for bit whichever instruction set is used (kernels.cpp
+// is compiled with -ffp-contract=off for the same reason).
+static const int gKernelLanes = 8;
+
+KernelIsa GetKernelIsa();
+int SetKernelIsa(KernelIsa isa);
+bool IsKernelIsaSupported(KernelIsa isa);
+
+double KernelSum(const double *values, int count);
+double WeightedSum(const double *weights, const double *values, int count);
+double WeightedSum(const double *weights, const float *values, int count);
+double WeightedProductSum(const double *weights, const double *first,
+			  const double *second, int count);
+double MaskedWeightSum(const double *weights, const uint64_t *bits,
+		       size_t first_bit, int count);
+uint64_t AndPopcount(const uint64_t *first, const uint64_t *second,
+		     size_t words);
+double StepExpSum(double step, const double *values, double shift,
+		  double *scores, double *weights, int count,
+		  double *max_score);
+double KernelExp(double x);
+
+#endif
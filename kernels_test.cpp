@@ -0,0 +1,137 @@
+#include <cmath>
+#include <vector>
+#include "gtest/gtest.h"
+#include "kernels.hpp"
+#include "constants.hpp"
+
+// Returns count pseudo-random values in [-1, 1).
+static std::vector<double> RandomValues(int count, unsigned seed) {
+  std::vector<double> values(count);
+  for (int i = 0; i < count; i++) {
+    seed = seed * 1103515245 + 12345;
+    values[i] = double(seed % 65536) / 32768.0 - 1.0;
+  }
+  return values;
+}
+
+// Tests exp computed by kernels against the standard library.
+TEST(KernelsTest, TestKernelExp) {
+  for (double x = -700.0; x < 700.0; x += 0.37) {
+    EXPECT_NEAR(1.0, KernelExp(x) / std::exp(x), 1e-15);
+  }
+  EXPECT_EQ(1.0, KernelExp(0.0));
+  EXPECT_EQ(0.0, KernelExp(-INFINITY));
+  EXPECT_EQ(0.0, KernelExp(-1000.0));
+  EXPECT_TRUE(std::isinf(KernelExp(1000.0)));
+  EXPECT_TRUE(std::isnan(KernelExp(NAN)));
+}
+
+// Tests that reductions agree with plain sums.
+TEST(KernelsTest, TestReductions) {
+  int count = 203;
+  std::vector<double> weights = RandomValues(count, 1);
+  std::vector<double> values = RandomValues(count, 2);
+  std::vector<float> floats(values.begin(), values.end());
+  std::vector<uint64_t> bits(5, 0x00ff00ff0f0f3333ULL);
+  double sum = 0.0;
+  double weighted_sum = 0.0;
+  double float_sum = 0.0;
+  double product_sum = 0.0;
+  double masked_sum = 0.0;
+  for (int i = 0; i < count; i++) {
+    sum += values[i];
+    weighted_sum += weights[i] * values[i];
+    float_sum += weights[i] * floats[i];
+    product_sum += weights[i] * values[i] * weights[i];
+    if ((bits[(i + 13) / 64] >> ((i + 13) % 64)) & 1) {
+      masked_sum += weights[i];
+    }
+  }
+  EXPECT_NEAR(sum, KernelSum(values.data(), count), gTolerance);
+  EXPECT_NEAR(weighted_sum, WeightedSum(weights.data(), values.data(), count),
+	      gTolerance);
+  EXPECT_NEAR(float_sum, WeightedSum(weights.data(), floats.data(), count),
+	      gTolerance);
+  EXPECT_NEAR(product_sum, WeightedProductSum(weights.data(), values.data(),
+					      weights.data(), count),
+	      gTolerance);
+  EXPECT_NEAR(masked_sum, MaskedWeightSum(weights.data(), bits.data(), 13,
+					  count), gTolerance);
+  EXPECT_EQ(0.0, KernelSum(values.data(), 0));
+  std::vector<uint64_t> other_bits(5, 0x0f0f0f0f0f0f0f0fULL);
+  EXPECT_EQ(uint64_t(5 * 20), AndPopcount(bits.data(), other_bits.data(), 5));
+}
+
+// Tests that log-scores, weights and their sum are updated in one pass.
+TEST(KernelsTest, TestStepExpSum) {
+  int count = 37;
+  std::vector<double> values = RandomValues(count, 3);
+  std::vector<double> scores = RandomValues(count, 4);
+  std::vector<double> old_scores = scores;
+  std::vector<double> weights(count);
+  double max_score = -INFINITY;
+  double sum = StepExpSum(2.0, values.data(), 0.5, scores.data(),
+			  weights.data(), count, &max_score);
+  double expected_sum = 0.0;
+  double expected_max_score = -INFINITY;
+  for (int i = 0; i < count; i++) {
+    double score = old_scores[i] + 2.0 * values[i];
+    EXPECT_NEAR(score, scores[i], gTolerance);
+    EXPECT_NEAR(std::exp(score - 0.5), weights[i], gTolerance);
+    expected_sum += std::exp(score - 0.5);
+    expected_max_score = std::max(expected_max_score, score);
+  }
+  EXPECT_NEAR(expected_sum, sum, gTolerance);
+  EXPECT_EQ(expected_max_score, max_score);
+  sum = StepExpSum(0.0, NULL, 1.0, scores.data(), weights.data(), count,
+		   &max_score);
+  EXPECT_NEAR(expected_sum * std::exp(-0.5), sum, gTolerance);
+}
+
+// Tests that all instruction sets supported by the CPU give exactly
+// the same results.
+TEST(KernelsTest, TestSameResultsOnAllIsas) {
+  KernelIsa detected = GetKernelIsa();
+  EXPECT_TRUE(IsKernelIsaSupported(kScalarIsa));
+  EXPECT_EQ(0, SetKernelIsa(kScalarIsa));
+  EXPECT_EQ(kScalarIsa, GetKernelIsa());
+  int count = 1001;
+  std::vector<double> weights = RandomValues(count, 5);
+  std::vector<double> values = RandomValues(count, 6);
+  std::vector<float> floats(values.begin(), values.end());
+  std::vector<uint64_t> bits(17);
+  for (unsigned i = 0; i < bits.size(); i++) {
+    bits[i] = 0x9e3779b97f4a7c15ULL * (i + 1);
+  }
+  std::vector<double> results;
+  std::vector<double> expected_weights;
+  for (int isa = kScalarIsa; isa <= kAvx512Isa; isa++) {
+    if (SetKernelIsa(KernelIsa(isa)) != 0) {
+      continue;
+    }
+    std::vector<double> scores(values);
+    std::vector<double> new_weights(count);
+    double max_score = -INFINITY;
+    double exp_sum = StepExpSum(30.0, weights.data(), 2.0, scores.data(),
+				new_weights.data(), count, &max_score);
+    std::vector<double> isa_results = {
+      KernelSum(values.data(), count),
+      WeightedSum(weights.data(), values.data(), count),
+      WeightedSum(weights.data(), floats.data(), count),
+      WeightedProductSum(weights.data(), values.data(), values.data(), count),
+      MaskedWeightSum(weights.data(), bits.data(), 7, count),
+      MaskedWeightSum(weights.data(), bits.data(), 64, count),
+      double(AndPopcount(bits.data(), bits.data() + 1, bits.size() - 1)),
+      exp_sum, max_score
+    };
+    if (isa == kScalarIsa) {
+      results = isa_results;
+      expected_weights = new_weights;
+    }
+    for (unsigned i = 0; i < results.size(); i++) {
+      EXPECT_EQ(results[i], isa_results[i]);
+    }
+    EXPECT_TRUE(expected_weights == new_weights);
+  }
+  EXPECT_EQ(0, SetKernelIsa(detected));
+}
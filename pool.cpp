@@ -0,0 +1,213 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+#include "pool.hpp"
+
+// Number of ranges per thread the iterations of a loop are split into.
+// More ranges balance the load better at the cost of more locking.
+static const int gRangesPerThread = 8;
+
+// A pool of worker threads running the iterations of parallel loops (see
+// ParallelFor in pool.hpp). Worker 0 stands for the threads that are not
+// owned by the pool, workers 1 and above are threads owned by the pool.
+// Several loops may run at the same time, e.g. loops started by iterations
+// of another loop.
+class ThreadPool {
+public:
+  ThreadPool(int num_threads);
+  ~ThreadPool();
+  int NumThreads();
+  void ParallelFor(int count, const std::function<void(int)> &function);
+private:
+  // A loop started by ParallelFor.
+  struct Loop {
+    const std::function<void(int)> *function;
+    std::atomic<int> pending; // number of ranges not yet finished
+  };
+  // Iterations [begin, end) of a loop waiting to be run by a worker.
+  struct Range {
+    Loop *loop;
+    int begin;
+    int end;
+  };
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Range> ranges;
+  };
+  void WorkerLoop(int worker);
+  void RunRange(const Range &range);
+  bool TakeRange(int worker, Loop *loop, Range *range);
+  std::vector<std::thread> threads;
+  std::vector<std::unique_ptr<Queue> > queues; // one queue per worker
+  std::atomic<int> queued; // number of ranges in all queues
+  std::mutex mutex; // guards stopping and the condition variables
+  std::condition_variable work; // notified when ranges are queued
+  std::condition_variable finished; // notified when a loop is finished
+  bool stopping;
+};
+
+// Number of the worker of the calling thread in the pool (0 for threads
+// that are not owned by the pool).
+static thread_local int current_worker = 0;
+
+// Constructor for a pool of num_threads workers including the calling
+// thread, i.e. num_threads - 1 threads are started.
+ThreadPool::ThreadPool(int num_threads) {
+  queued = 0;
+  stopping = false;
+  for (int worker = 0; worker < num_threads; worker++) {
+    queues.push_back(std::unique_ptr<Queue>(new Queue()));
+  }
+  for (int worker = 1; worker < num_threads; worker++) {
+    threads.push_back(std::thread(&ThreadPool::WorkerLoop, this, worker));
+  }
+}
+
+// Destructor for this pool. Waits for its threads to exit.
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  work.notify_all();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+// Returns the number of workers of this pool.
+int ThreadPool::NumThreads() {
+  return queues.size();
+}
+
+// Runs ranges of iterations of any loop on the given worker thread until
+// the pool is destroyed.
+void ThreadPool::WorkerLoop(int worker) {
+  current_worker = worker;
+  while (true) {
+    Range range;
+    if (TakeRange(worker, NULL, &range)) {
+      RunRange(range);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    work.wait(lock, [&]() { return stopping || queued > 0; });
+    if (stopping) {
+      return;
+    }
+  }
+}
+
+// Runs the iterations of the given range and wakes up the thread waiting
+// for its loop if this was the last unfinished range of the loop.
+void ThreadPool::RunRange(const Range &range) {
+  for (int i = range.begin; i < range.end; i++) {
+    (*range.loop->function)(i);
+  }
+  if (--range.loop->pending == 0) {
+    std::lock_guard<std::mutex> lock(mutex);
+    finished.notify_all();
+  }
+}
+
+// Stores in range the next range of iterations of the given loop (of any
+// loop if loop is NULL) for the given worker: the first such range of its
+// own queue or the last such range of the queue of the next worker that
+// has one. Returns false if there is no such range.
+bool ThreadPool::TakeRange(int worker, Loop *loop, Range *range) {
+  for (int offset = 0; offset < NumThreads(); offset++) {
+    Queue &queue = *queues[(worker + offset) % NumThreads()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    int size = queue.ranges.size();
+    for (int i = 0; i < size; i++) {
+      int position = (offset == 0 ? i : size - 1 - i);
+      if (loop == NULL || queue.ranges[position].loop == loop) {
+	*range = queue.ranges[position];
+	queue.ranges.erase(queue.ranges.begin() + position);
+	queued--;
+	return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Runs function(i) for every i in [0, count) on the threads of this pool
+// and returns once all of them are done. The calling thread only runs
+// iterations of this loop, so that a loop nested in a long iteration of
+// another loop does not wait for that iteration to finish.
+void ThreadPool::ParallelFor(int count,
+			     const std::function<void(int)> &function) {
+  int num_ranges = std::min(count, NumThreads() * gRangesPerThread);
+  Loop loop;
+  loop.function = &function;
+  loop.pending = num_ranges;
+  for (int number = 0; number < num_ranges; number++) {
+    // Consecutive ranges go to the same worker, so that workers that do
+    // not steal run consecutive iterations.
+    Queue &queue = *queues[number * NumThreads() / num_ranges];
+    Range range;
+    range.loop = &loop;
+    range.begin = int(int64_t(count) * number / num_ranges);
+    range.end = int(int64_t(count) * (number + 1) / num_ranges);
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.ranges.push_back(range);
+  }
+  queued += num_ranges;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+  }
+  work.notify_all();
+  Range range;
+  while (TakeRange(current_worker, &loop, &range)) {
+    RunRange(range);
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  finished.wait(lock, [&]() { return loop.pending == 0; });
+}
+
+// The pool used by ParallelFor (or NULL if loops run in the calling
+// thread) and the mutex guarding it.
+static std::unique_ptr<ThreadPool> pool;
+static std::mutex pool_mutex;
+
+// Makes parallel loops use the given number of threads (including
+// the calling thread). Must not be called while loops are running.
+// Returns 0 on success and -1 if the number of threads is not positive.
+int SetNumThreads(int num_threads) {
+  if (num_threads < 1) {
+    return -1;
+  }
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  pool.reset(num_threads > 1 ? new ThreadPool(num_threads) : NULL);
+  return 0;
+}
+
+// Returns the number of threads used by parallel loops.
+int GetNumThreads() {
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  return (pool ? pool->NumThreads() : 1);
+}
+
+// Calls function(i) for every i in [0, count) on the threads of the pool
+// and returns once all of these calls are done.
+void ParallelFor(int count, const std::function<void(int)> &function) {
+  ThreadPool *current = NULL;
+  if (count > 1) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    current = pool.get();
+  }
+  if (current == NULL) {
+    for (int i = 0; i < count; i++) {
+      function(i);
+    }
+    return;
+  }
+  current->ParallelFor(count, function);
+}
@@ -0,0 +1,29 @@
+#include <functional>
+
+#ifndef POOL_HPP
+#define POOL_HPP
+
+// Parallel loops run by a process-wide pool of worker threads.
+// ParallelFor(count, function) calls function(i) for every i in [0, count)
+// and returns once all of these calls are done. Iterations are split into
+// ranges that are dealt out to per-thread queues; a thread takes ranges
+// from the front of its own queue and, once it is empty, steals ranges
+// from the back of the queues of other threads, so that iterations of
+// very different costs are still spread evenly over the threads. The
+// calling thread runs iterations of its loop as well. Loops may be
+// started from several threads at the same time and from inside
+// iterations of another loop, e.g. to run a few tasks of very different
+// costs concurrently while each of them still spreads its own inner
+// loops over the threads left idle by the others.
+// Iterations may run in any order, so callers that need deterministic
+// results store per-iteration results and combine them in a fixed order
+// afterwards.
+// Sample usage:
+//   SetNumThreads(8);
+//   std::vector<double> results(count);
+//   ParallelFor(count, [&](int i) { results[i] = Compute(i); });
+int SetNumThreads(int num_threads);
+int GetNumThreads();
+void ParallelFor(int count, const std::function<void(int)> &function);
+
+#endif
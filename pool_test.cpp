@@ -0,0 +1,55 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "pool.hpp"
+
+// Tests that every iteration of a parallel loop runs exactly once.
+TEST(PoolTest, TestParallelFor) {
+  EXPECT_EQ(-1, SetNumThreads(0));
+  for (int num_threads : {1, 2, 4}) {
+    EXPECT_EQ(0, SetNumThreads(num_threads));
+    EXPECT_EQ(num_threads, GetNumThreads());
+    for (int count : {0, 1, 3, 1000}) {
+      std::vector<int> runs(count, 0);
+      ParallelFor(count, [&](int i) { runs[i]++; });
+      EXPECT_TRUE(std::vector<int>(count, 1) == runs);
+    }
+  }
+  EXPECT_EQ(0, SetNumThreads(1));
+}
+
+// Tests that iterations of very different costs are all run and that
+// loops nested in parallel loops run all of their iterations too.
+TEST(PoolTest, TestUnbalancedAndNestedLoops) {
+  EXPECT_EQ(0, SetNumThreads(4));
+  std::atomic<long> total(0);
+  ParallelFor(64, [&](int i) {
+      std::atomic<long> sum(0);
+      int inner_count = (i < 4 ? 10000 : 10);
+      ParallelFor(inner_count, [&](int j) { sum += j; });
+      total += sum.load();
+    });
+  EXPECT_EQ(4 * (10000L * 9999 / 2) + 60 * 45, total.load());
+  EXPECT_EQ(0, SetNumThreads(1));
+}
+
+// Tests that loops started from several threads at the same time all run
+// every iteration exactly once.
+TEST(PoolTest, TestConcurrentLoops) {
+  EXPECT_EQ(0, SetNumThreads(3));
+  std::vector<std::vector<int> > runs(4, std::vector<int>(1000, 0));
+  std::vector<std::thread> threads;
+  for (int thread = 0; thread < 4; thread++) {
+    threads.push_back(std::thread([&runs, thread]() {
+	  ParallelFor(1000, [&](int i) { runs[thread][i]++; });
+	}));
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  for (int thread = 0; thread < 4; thread++) {
+    EXPECT_TRUE(std::vector<int>(1000, 1) == runs[thread]);
+  }
+  EXPECT_EQ(0, SetNumThreads(1));
+}
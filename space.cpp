@@ -1,19 +1,410 @@
 #include <cmath>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "space.hpp"
 
+// Magic bytes that start every binary space file.
+static const char kSpaceFileMagic[8] = "SMAXSPC";
+
+// Rounds given size up to the next multiple of gColumnAlignment.
+static uint64_t AlignedSize(uint64_t size) {
+  return (size + gColumnAlignment - 1) / gColumnAlignment * gColumnAlignment;
+}
+
+// Returns true iff given header describes a valid binary space file
+// of the given size.
+static bool IsValidHeader(const SpaceFileHeader &header, uint64_t size) {
+  uint64_t n = header.num_points;
+  return (memcmp(header.magic, kSpaceFileMagic, sizeof(header.magic)) == 0 &&
+	  header.version == gSpaceFileVersion &&
+	  header.ids_offset % gColumnAlignment == 0 &&
+	  header.counts_offset % gColumnAlignment == 0 &&
+	  header.multiplicities_offset % gColumnAlignment == 0 &&
+	  header.columns_offset % gColumnAlignment == 0 &&
+	  header.column_stride % gColumnAlignment == 0 &&
+	  header.column_stride >= n * sizeof(double) &&
+	  header.ids_offset + n * sizeof(int32_t) <= size &&
+	  header.counts_offset + n * sizeof(int32_t) <= size &&
+	  header.multiplicities_offset + n * sizeof(int32_t) <= size &&
+	  header.columns_offset +
+	  header.num_raw_features * header.column_stride <= size);
+}
+
+// Reads count bytes at the given offset of a file into buffer.
+// Returns true iff all the bytes have been read.
+static bool ReadFully(int fd, void *buffer, size_t count, uint64_t offset) {
+  char *bytes = static_cast<char*>(buffer);
+  while (count > 0) {
+    ssize_t result = pread(fd, bytes, count, offset);
+    if (result <= 0) {
+      return false;
+    }
+    bytes += result;
+    count -= result;
+    offset += result;
+  }
+  return true;
+}
+
+// Returns ids of CPUs of the specified NUMA node as listed by the kernel
+// (empty if there is no such node or the list is not available).
+static std::vector<int> NumaNodeCpus(int node) {
+  std::vector<int> cpus;
+  std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) +
+		     "/cpulist");
+  std::string range;
+  while (std::getline(file, range, ',')) {
+    int first;
+    int last;
+    int num_read = sscanf(range.c_str(), "%d-%d", &first, &last);
+    if (num_read == 1) {
+      last = first;
+    }
+    for (int cpu = first; num_read >= 1 && cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+// Restricts the calling thread to the given CPUs (if any).
+static void PinToCpus(const std::vector<int> &cpus) {
+  if (cpus.empty()) {
+    return;
+  }
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &cpu_set);
+  }
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+}
+
+// Threads that run passes over the shards of a space (see
+// Space::RunShards), one thread per shard pinned to the CPUs of its shard.
+// The threads are started once when the space is sharded and wait for
+// passes in between, so that a pass costs neither thread creation nor
+// setting CPU affinity.
+class ShardWorkers {
+public:
+  ShardWorkers(const std::vector<std::vector<int> > &shard_cpus);
+  ~ShardWorkers();
+  bool TryRun(const std::function<void(int)> &function);
+private:
+  void WorkerLoop(int shard, std::vector<int> cpus);
+  std::vector<std::thread> threads;
+  std::mutex run_mutex; // held by the thread whose pass is running
+  std::mutex mutex; // guards the state of the pass below
+  std::condition_variable work; // notified when a pass starts
+  std::condition_variable finished; // notified when a pass is finished
+  const std::function<void(int)> *function; // function of the pass
+  uint64_t pass; // number of passes started so far
+  int pending; // number of shards of the pass not finished yet
+  bool stopping;
+};
+
+// Constructor that starts a thread for each shard pinned to the given
+// CPUs of the shard.
+ShardWorkers::ShardWorkers(const std::vector<std::vector<int> > &shard_cpus) {
+  function = NULL;
+  pass = 0;
+  pending = 0;
+  stopping = false;
+  for (unsigned shard = 0; shard < shard_cpus.size(); shard++) {
+    threads.push_back(std::thread(&ShardWorkers::WorkerLoop, this, shard,
+				  shard_cpus[shard]));
+  }
+}
+
+// Destructor that waits for the threads to exit.
+ShardWorkers::~ShardWorkers() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  work.notify_all();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+// Calls the function of every pass with the given shard on the calling
+// thread until the workers are destroyed.
+void ShardWorkers::WorkerLoop(int shard, std::vector<int> cpus) {
+  PinToCpus(cpus);
+  uint64_t done = 0;
+  while (true) {
+    const std::function<void(int)> *current;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      work.wait(lock, [&]() { return stopping || pass != done; });
+      if (stopping) {
+	return;
+      }
+      done = pass;
+      current = function;
+    }
+    (*current)(shard);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--pending == 0) {
+      finished.notify_all();
+    }
+  }
+}
+
+// Calls the given function with the number of each shard on the thread
+// of the shard and returns once all of these calls are done. Returns false
+// without calling the function if another pass is running (e.g. a pass
+// started by another thread or by the function of that pass).
+bool ShardWorkers::TryRun(const std::function<void(int)> &function) {
+  std::unique_lock<std::mutex> run_lock(run_mutex, std::try_to_lock);
+  if (!run_lock.owns_lock()) {
+    return false;
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  this->function = &function;
+  pending = threads.size();
+  pass++;
+  work.notify_all();
+  finished.wait(lock, [&]() { return pending == 0; });
+  return true;
+}
+
 // Constructor for an instance of class space.
 Space::Space() {
   finalized = false;
+  deduplicate = false;
+  reserved_points = 0;
+  mapped_data = NULL;
+  mapped_size = 0;
+  chunked_fd = -1;
+  block_size = 0;
+}
+
+// Move constructor for an instance of class space. Points of the other
+// space become points of this one and the other space is left empty.
+Space::Space(Space &&other) {
+  mapped_data = NULL;
+  chunked_fd = -1;
+  *this = std::move(other);
+}
+
+// Move assignment for an instance of class space. Releases what this space
+// holds, takes over the contents of the other space and leaves it empty.
+Space &Space::operator=(Space &&other) {
+  if (this == &other) {
+    return *this;
+  }
+  if (mapped_data != NULL) {
+    munmap(mapped_data, mapped_size);
+  }
+  if (chunked_fd >= 0) {
+    close(chunked_fd);
+  }
+  finalized = other.finalized;
+  deduplicate = other.deduplicate;
+  reserved_points = other.reserved_points;
+  points = std::move(other.points);
+  columns = std::move(other.columns);
+  column_data = std::move(other.column_data);
+  quantized_columns = std::move(other.quantized_columns);
+  sparse_columns = std::move(other.sparse_columns);
+  weights = std::move(other.weights);
+  multiplicities = std::move(other.multiplicities);
+  keys_by_hash = std::move(other.keys_by_hash);
+  mapped_data = other.mapped_data;
+  mapped_size = other.mapped_size;
+  chunked_fd = other.chunked_fd;
+  block_size = other.block_size;
+  chunked_header = other.chunked_header;
+  chunked_columns = std::move(other.chunked_columns);
+  kept_keys = std::move(other.kept_keys);
+  kept_values = std::move(other.kept_values);
+  shard_begins = std::move(other.shard_begins);
+  shard_cpus = std::move(other.shard_cpus);
+  shard_workers = std::move(other.shard_workers);
+  for (auto &point : points) {
+    point.space = this;
+  }
+  other.finalized = false;
+  other.reserved_points = 0;
+  other.mapped_data = NULL;
+  other.mapped_size = 0;
+  other.chunked_fd = -1;
+  other.chunked_columns.clear();
+  other.kept_keys.clear();
+  other.kept_values.clear();
+  other.shard_begins.clear();
+  other.shard_cpus.clear();
+  other.points.clear();
+  other.columns.clear();
+  other.column_data.clear();
+  other.quantized_columns.clear();
+  other.sparse_columns.clear();
+  other.weights.clear();
+  other.multiplicities.clear();
+  other.keys_by_hash.clear();
+  return *this;
+}
+
+// Destructor for an instance of class space. Unmaps the space file
+// if this space was memory-mapped from one and closes it if this space
+// is chunked.
+Space::~Space() {
+  if (mapped_data != NULL) {
+    munmap(mapped_data, mapped_size);
+  }
+  if (chunked_fd >= 0) {
+    close(chunked_fd);
+  }
+}
+
+// Turns on deduplication of points added to this space from now on.
+// Returns 0 on success and -1 if some points have already been added.
+int Space::EnableDeduplication() {
+  if (!points.empty()) {
+    return -1;
+  }
+  deduplicate = true;
+  return 0;
+}
+
+// Reserves storage for the given number of points with the given number
+// of raw features, so that adding them does not reallocate columns.
+// Returns 0 on success and -1 if this space has already been finalized.
+int Space::Reserve(int num_points, int num_raw_features) {
+  if (finalized) {
+    return -1;
+  }
+  reserved_points = num_points;
+  if ((int) columns.size() < num_raw_features) {
+    columns.reserve(num_raw_features);
+  }
+  for (auto &column : columns) {
+    column.reserve(num_points);
+  }
+  weights.reserve(num_points);
+  multiplicities.reserve(num_points);
+  points.reserve(num_points);
+  return 0;
 }
 
 // Adds specified point to the space. Returns key of the point
 // on success and -1 if this space has already been finalized.
+// Raw features and weight of the point are copied into the space and
+// the space keeps a view of the point (see the other AddPoint).
 int Space::AddPoint(Point &point) {
+  if (point.space == NULL) {
+    return AddPoint(point.GetId(), point.raw_features.data(),
+		    point.raw_features.size(), point.GetProbWeight());
+  }
+  std::vector<double> values(point.NumRawFeatures());
+  for (unsigned index = 0; index < values.size(); index++) {
+    values[index] = point.GetRawFeature(index);
+  }
+  return AddPoint(point.GetId(), values.data(), values.size(),
+		  point.GetProbWeight());
+}
+
+// Returns a hash of count raw feature values. Values that compare equal
+// (i.e. 0.0 and -0.0) have equal hashes.
+static uint64_t HashRawFeatures(const double *values, int count) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (int index = 0; index < count; index++) {
+    double value = (values[index] == 0.0 ? 0.0 : values[index]);
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    hash = (hash ^ bits) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Returns true iff the point with a given key has exactly count raw
+// features stored in the given columns and they are equal to values.
+static bool HasRawFeatures(const std::vector<Column> &columns, int key,
+			   const double *values, int count) {
+  if (count != (int) columns.size()) {
+    return false;
+  }
+  for (int index = 0; index < count; index++) {
+    if (columns[index][key] != values[index]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Adds a point with specified id, raw feature values and probabilistic
+// weight to the space. Returns key of the point on success and -1 if this
+// space has already been finalized.
+// Raw feature values are appended to the columns of the space and
+// the space keeps a view of the point that refers to these columns.
+// Points with fewer raw features than the others are padded with NAN.
+// If deduplication is enabled and the space already has a point with
+// the same raw features, the key of that point is returned instead and
+// its multiplicity and weight are increased. Points with missing values
+// are never merged. Existing points are looked up by a hash of the raw
+// features and compared against the columns of the space, so no copy of
+// the raw features is kept for deduplication.
+int Space::AddPoint(int id, const double *values, int num_raw_features,
+		    double weight) {
   if (finalized) {
     return -1;
   }
-  points.push_back(point);
-  return (points.size() - 1);
+  int key = points.size();
+  if (deduplicate) {
+    // Points with fewer raw features than the others are padded with NAN,
+    // so they have missing values as well.
+    bool missing = (num_raw_features < (int) columns.size());
+    for (int index = 0; index < num_raw_features; index++) {
+      missing = missing || std::isnan(values[index]);
+    }
+    if (!missing) {
+      uint64_t hash = HashRawFeatures(values, num_raw_features);
+      auto candidates = keys_by_hash.equal_range(hash);
+      for (auto it = candidates.first; it != candidates.second; it++) {
+	if (HasRawFeatures(columns, it->second, values, num_raw_features)) {
+	  weights[it->second] += weight;
+	  multiplicities[it->second]++;
+	  return it->second;
+	}
+      }
+      keys_by_hash.insert(std::make_pair(hash, key));
+    }
+  }
+  while ((int) columns.size() < num_raw_features) {
+    columns.push_back(Column());
+    columns.back().reserve(std::max(reserved_points, key + 1));
+    columns.back().resize(key, NAN);
+  }
+  for (unsigned index = 0; index < columns.size(); index++) {
+    columns[index].push_back((int) index < num_raw_features ? values[index] :
+			     NAN);
+  }
+  UpdateColumnData();
+  weights.push_back(weight);
+  multiplicities.push_back(1);
+  Point view(id);
+  view.space = this;
+  view.key = key;
+  view.finalized = true;
+  points.push_back(view);
+  return key;
 }
 
 // Returns a reference to a point with a specified key in the space.
@@ -24,19 +415,871 @@ Point& Space::GetPoint(int key) {
 }
 
 // Finalizes this space. Once space is finalized no points can be added to
-// it and all points in the space are finalized themselves.
+// it and all points in the space are finalized themselves. Columns
+// release any spare capacity left after adding points.
 void Space::Finalize() {
   for (auto &point : points) {
     point.Finalize();
   }
+  for (auto &column : columns) {
+    column.shrink_to_fit();
+  }
+  UpdateColumnData();
+  weights.shrink_to_fit();
+  multiplicities.shrink_to_fit();
+  std::unordered_multimap<uint64_t, int>().swap(keys_by_hash);
   finalized = true;
 }
 
+// Points column_data to the columns owned by this space. Needs to be
+// called every time these columns may have been reallocated.
+void Space::UpdateColumnData() {
+  column_data.resize(columns.size());
+  for (unsigned index = 0; index < columns.size(); index++) {
+    column_data[index] = columns[index].data();
+  }
+}
+
 // Returns number of points in this space.
 int Space::NumPoints() {
   return points.size();
 }
 
+// Returns number of raw features (columns) in this space.
+int Space::NumRawFeatures() {
+  return column_data.size();
+}
+
+// Returns specified raw feature value of the point with a given key.
+// NAN is returned if there is no such raw feature in the space.
+// Values of sparse raw features are looked up using binary search and
+// values of chunked spaces are read from the file unless they are kept
+// in memory (see KeepRawFeatures). Passes over many points of a chunked
+// space should read blocks instead (see ForEachBlock, GatherRawFeature).
+double Space::GetRawFeature(int key, int index) {
+  if (index < 0 || index >= (int) column_data.size()) {
+    return NAN;
+  }
+  if (column_data[index] != NULL) {
+    return column_data[index][key];
+  }
+  if (IsChunkedColumn(index)) {
+    std::vector<int>::const_iterator it =
+      std::lower_bound(kept_keys.begin(), kept_keys.end(), key);
+    if (it != kept_keys.end() && *it == key) {
+      return kept_values[index][it - kept_keys.begin()];
+    }
+    double value = NAN;
+    ReadFully(chunked_fd, &value, sizeof(double), ColumnOffset(index, key));
+    return value;
+  }
+  if (!IsSparse(index)) {
+    return NAN;
+  }
+  const SparseColumn &sparse = sparse_columns[index];
+  std::vector<int>::const_iterator it =
+    std::lower_bound(sparse.keys.begin(), sparse.keys.end(), key);
+  if (it == sparse.keys.end() || *it != key) {
+    return 0.0;
+  }
+  return sparse.values[it - sparse.keys.begin()];
+}
+
+// Returns a pointer to the contiguous column of values of the specified
+// raw feature indexed by keys of points. No bounds checking is done and
+// the pointer is only guaranteed to remain valid once space is finalized.
+// NULL is returned if the column has been released, if the raw feature
+// is stored sparsely or if the space is chunked (see ForEachBlock).
+const double *Space::RawFeatureColumn(int index) {
+  return column_data[index];
+}
+
+// Returns probabilistic weight of the point with a given key.
+double Space::GetProbWeight(int key) {
+  return weights[key];
+}
+
+// Sets probabilistic weight of the point with a given key.
+void Space::SetProbWeight(int key, double value) {
+  weights[key] = value;
+}
+
+// Returns a view of probabilistic weights of all the points in the
+// space indexed by keys of points. Weights can be modified through it.
+Span<double> Space::ProbWeights() {
+  return Span<double>(weights.data(), weights.size());
+}
+
+// Returns the sum of probabilistic weights of all the points in the space.
+double Space::TotalProbWeight() {
+  double total = 0.0;
+  for (double weight : weights) {
+    total += weight;
+  }
+  return total;
+}
+
+// Returns the number of points merged into the point with a given key.
+// This is 1 unless deduplication is enabled.
+int Space::GetMultiplicity(int key) {
+  return multiplicities[key];
+}
+
+// Returns the total number of points added to the space (before they
+// were merged by deduplication).
+int Space::TotalMultiplicity() {
+  int total = 0;
+  for (int multiplicity : multiplicities) {
+    total += multiplicity;
+  }
+  return total;
+}
+
+// Quantizes the specified raw feature of a finalized space using given
+// thresholds sorted in ascending order. The bin code of a value is the
+// number of thresholds strictly below it, so that value > thresholds[bin]
+// iff code > bin. Codes are stored in uint8 columns if there are at most
+// 255 thresholds and in uint16 columns otherwise.
+// Returns 0 on success and -1 if space is not finalized, there is no such
+// raw feature, its column has missing values or thresholds are not sorted
+// or there are too many of them.
+int Space::QuantizeRawFeature(int index,
+			      const std::vector<double> &thresholds) {
+  if (!finalized || index < 0 || index >= NumRawFeatures() ||
+      thresholds.size() > UINT16_MAX ||
+      !std::is_sorted(thresholds.begin(), thresholds.end())) {
+    return -1;
+  }
+  if (!IsDense(index) && !IsSparse(index)) {
+    return -1;
+  }
+  QuantizedColumn quantized;
+  quantized.thresholds = thresholds;
+  if (thresholds.size() <= UINT8_MAX) {
+    quantized.codes8.resize(points.size());
+  } else {
+    quantized.codes16.resize(points.size());
+  }
+  bool missing = false;
+  // Computes bin codes of count values of the raw feature starting at
+  // the point with key begin.
+  auto quantize = [&](int begin, int count, const double *values) {
+    for (int offset = 0; offset < count; offset++) {
+      missing = missing || std::isnan(values[offset]);
+      int code = std::lower_bound(thresholds.begin(), thresholds.end(),
+				  values[offset]) - thresholds.begin();
+      if (thresholds.size() <= UINT8_MAX) {
+	quantized.codes8[begin + offset] = code;
+      } else {
+	quantized.codes16[begin + offset] = code;
+      }
+    }
+  };
+  if (IsSparse(index)) {
+    std::vector<double> buffer;
+    quantize(0, points.size(), DenseColumn(index, &buffer));
+  } else {
+    std::vector<int> indices(1, index);
+    ForEachBlock(&indices, [&](SpaceBlock &block) {
+      quantize(block.begin, block.size, block.columns[index]);
+    });
+  }
+  if (missing) {
+    return -1;
+  }
+  quantized_columns.resize(NumRawFeatures());
+  std::swap(quantized_columns[index], quantized);
+  return 0;
+}
+
+// Returns true iff the specified raw feature has been quantized.
+bool Space::IsQuantized(int index) {
+  return (index >= 0 && index < (int) quantized_columns.size() &&
+	  !(quantized_columns[index].codes8.empty() &&
+	    quantized_columns[index].codes16.empty()));
+}
+
+// Returns bin code of the specified raw feature of the point with a given
+// key or -1 if this raw feature has not been quantized.
+int Space::GetBinCode(int key, int index) {
+  if (!IsQuantized(index)) {
+    return -1;
+  }
+  QuantizedColumn &quantized = quantized_columns[index];
+  return (quantized.codes8.empty() ? quantized.codes16[key] :
+	  quantized.codes8[key]);
+}
+
+// Returns the index of the given threshold among the thresholds used to
+// quantize the specified raw feature or -1 if there is no such threshold.
+int Space::FindBin(int index, double threshold) {
+  if (!IsQuantized(index)) {
+    return -1;
+  }
+  const std::vector<double> &thresholds = quantized_columns[index].thresholds;
+  std::vector<double>::const_iterator it =
+    std::lower_bound(thresholds.begin(), thresholds.end(), threshold);
+  if (it == thresholds.end() || *it != threshold) {
+    return -1;
+  }
+  return it - thresholds.begin();
+}
+
+// Returns the thresholds used to quantize the specified raw feature.
+// The raw feature must have been quantized.
+const std::vector<double> &Space::BinThresholds(int index) {
+  return quantized_columns[index].thresholds;
+}
+
+// Returns a pointer to the uint8 column of bin codes of the specified raw
+// feature or NULL if it is not quantized or its codes do not fit in uint8.
+const uint8_t *Space::BinCodes8(int index) {
+  if (!IsQuantized(index) || quantized_columns[index].codes8.empty()) {
+    return NULL;
+  }
+  return quantized_columns[index].codes8.data();
+}
+
+// Returns a pointer to the uint16 column of bin codes of the specified raw
+// feature or NULL if it is not quantized or its codes fit in uint8.
+const uint16_t *Space::BinCodes16(int index) {
+  if (!IsQuantized(index) || quantized_columns[index].codes16.empty()) {
+    return NULL;
+  }
+  return quantized_columns[index].codes16.data();
+}
+
+// Releases double values of the specified raw feature (both dense and
+// sparse ones). Afterwards this raw feature is NAN at every point and only
+// its bin codes (if any) remain available.
+void Space::ReleaseRawFeatureColumn(int index) {
+  if (index < 0 || index >= NumRawFeatures()) {
+    return;
+  }
+  if (IsSparse(index)) {
+    sparse_columns[index] = SparseColumn();
+  }
+  DropColumn(index);
+}
+
+// Releases the dense column of the specified raw feature if it is still
+// present. Memory of owned columns is freed and pages of memory-mapped
+// columns are returned to the kernel. Columns of chunked spaces are no
+// longer read from the file.
+void Space::DropColumn(int index) {
+  if (IsChunkedColumn(index)) {
+    chunked_columns[index] = false;
+  }
+  if (column_data[index] == NULL) {
+    return;
+  }
+  if (index < (int) columns.size() &&
+      column_data[index] == columns[index].data()) {
+    Column().swap(columns[index]);
+  } else if (mapped_data != NULL) {
+    // Let the kernel reclaim the whole pages of this column.
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = reinterpret_cast<uintptr_t>(column_data[index]);
+    uintptr_t end = begin + points.size() * sizeof(double);
+    begin = (begin + page - 1) / page * page;
+    end = end / page * page;
+    if (begin < end) {
+      madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+    }
+  }
+  column_data[index] = NULL;
+}
+
+// Returns dense values of the specified raw feature indexed by keys of
+// points. Sparse raw features are expanded into the given buffer and
+// columns of chunked spaces are read into it as a whole.
+// NULL is returned if values of this raw feature have been released.
+const double *Space::DenseColumn(int index, std::vector<double> *buffer) {
+  if (IsChunkedColumn(index)) {
+    buffer->assign(points.size(), NAN);
+    ReadFully(chunked_fd, buffer->data(), points.size() * sizeof(double),
+	      ColumnOffset(index, 0));
+    return buffer->data();
+  }
+  if (column_data[index] != NULL || !IsSparse(index)) {
+    return column_data[index];
+  }
+  const SparseColumn &sparse = sparse_columns[index];
+  buffer->assign(points.size(), 0.0);
+  for (unsigned i = 0; i < sparse.keys.size(); i++) {
+    (*buffer)[sparse.keys[i]] = sparse.values[i];
+  }
+  return buffer->data();
+}
+
+// Stores the specified raw feature of a finalized space sparsely: keys of
+// points with non-zero values (missing values included) and these values
+// are kept and the dense column is released.
+// Returns 0 on success and -1 if space is not finalized or there is no
+// such raw feature or its values have been released.
+int Space::SparsifyRawFeature(int index) {
+  if (!finalized || index < 0 || index >= NumRawFeatures()) {
+    return -1;
+  }
+  if (IsSparse(index)) {
+    return 0;
+  }
+  std::vector<double> buffer;
+  const double *column = DenseColumn(index, &buffer);
+  if (column == NULL) {
+    return -1;
+  }
+  if ((int) sparse_columns.size() < NumRawFeatures()) {
+    SparseColumn dense;
+    dense.used = false;
+    sparse_columns.resize(NumRawFeatures(), dense);
+  }
+  SparseColumn &sparse = sparse_columns[index];
+  for (unsigned key = 0; key < points.size(); key++) {
+    if (column[key] != 0.0) {
+      sparse.keys.push_back(key);
+      sparse.values.push_back(column[key]);
+    }
+  }
+  sparse.keys.shrink_to_fit();
+  sparse.values.shrink_to_fit();
+  sparse.used = true;
+  DropColumn(index);
+  return 0;
+}
+
+// Stores sparsely every raw feature of a finalized space whose fraction
+// of non-zero values is at most max_density. Returns the number of raw
+// features that are stored sparsely afterwards. Columns of chunked
+// spaces are read one at a time.
+int Space::Sparsify(double max_density) {
+  int num_sparse = 0;
+  std::vector<double> buffer;
+  for (int index = 0; index < NumRawFeatures(); index++) {
+    const double *column = (IsSparse(index) ? NULL :
+			    DenseColumn(index, &buffer));
+    if (column != NULL) {
+      int num_non_zeros = 0;
+      for (unsigned key = 0; key < points.size(); key++) {
+	num_non_zeros += (column[key] != 0.0);
+      }
+      if (num_non_zeros <= max_density * points.size()) {
+	SparsifyRawFeature(index);
+      }
+    }
+    num_sparse += IsSparse(index);
+  }
+  return num_sparse;
+}
+
+// Returns true iff the specified raw feature is stored sparsely.
+bool Space::IsSparse(int index) {
+  return (index >= 0 && index < (int) sparse_columns.size() &&
+	  sparse_columns[index].used);
+}
+
+// Returns the number of non-zero values of a sparse raw feature.
+// The raw feature must be stored sparsely.
+int Space::NumNonZeros(int index) {
+  return sparse_columns[index].keys.size();
+}
+
+// Returns a pointer to the sorted keys of points with non-zero values of
+// a sparse raw feature. The raw feature must be stored sparsely.
+const int *Space::SparseKeys(int index) {
+  return sparse_columns[index].keys.data();
+}
+
+// Returns a pointer to the non-zero values of a sparse raw feature in the
+// order of SparseKeys. The raw feature must be stored sparsely.
+const double *Space::SparseValues(int index) {
+  return sparse_columns[index].values.data();
+}
+
+// Stores values of the specified raw feature at points with given keys
+// (sorted in ascending order) in values. Values of sparse raw features
+// are found by advancing through their keys, so the cost depends on the
+// number of given keys rather than on the number of points in the space.
+// Values of chunked spaces are read block by block and only blocks that
+// contain some of the keys are read.
+void Space::GatherRawFeature(int index, const std::vector<int> &keys,
+			     std::vector<double> *values) {
+  values->resize(keys.size());
+  if (index >= NumRawFeatures() || (!IsDense(index) && !IsSparse(index))) {
+    std::fill(values->begin(), values->end(), NAN);
+    return;
+  }
+  if (IsChunkedColumn(index)) {
+    std::vector<double> buffer(block_size);
+    int begin = -1;
+    for (unsigned i = 0; i < keys.size(); i++) {
+      if (begin < 0 || keys[i] < begin || keys[i] >= begin + block_size) {
+	begin = keys[i] / block_size * block_size;
+	int size = std::min<int>(block_size, points.size() - begin);
+	std::fill(buffer.begin(), buffer.end(), NAN);
+	ReadFully(chunked_fd, buffer.data(), size * sizeof(double),
+		  ColumnOffset(index, begin));
+      }
+      (*values)[i] = buffer[keys[i] - begin];
+    }
+    return;
+  }
+  if (column_data[index] != NULL) {
+    const double *column = column_data[index];
+    for (unsigned i = 0; i < keys.size(); i++) {
+      (*values)[i] = column[keys[i]];
+    }
+    return;
+  }
+  const SparseColumn &sparse = sparse_columns[index];
+  std::vector<int>::const_iterator it = sparse.keys.begin();
+  for (unsigned i = 0; i < keys.size(); i++) {
+    it = std::lower_bound(it, sparse.keys.end(), keys[i]);
+    if (it != sparse.keys.end() && *it == keys[i]) {
+      (*values)[i] = sparse.values[it - sparse.keys.begin()];
+    } else {
+      (*values)[i] = 0.0;
+    }
+  }
+}
+
+// Returns true iff the specified raw feature has dense values, i.e. it
+// is neither stored sparsely nor released. Dense values are either stored
+// in memory (see RawFeatureColumn) or read from the file of a chunked
+// space (see ForEachBlock).
+bool Space::IsDense(int index) {
+  return (index >= 0 && index < NumRawFeatures() &&
+	  (column_data[index] != NULL || IsChunkedColumn(index)));
+}
+
+// Returns true iff this space reads raw feature values from a file
+// block by block instead of keeping them in memory.
+bool Space::IsChunked() {
+  return chunked_fd >= 0;
+}
+
+// Keeps values of all raw features at the points with given keys (in any
+// order, possibly repeated) of this chunked space in memory instead of
+// those kept before, so that GetRawFeature does not read them from
+// the file. This is meant for points that are evaluated one by one, such
+// as points of samples. Values are read by GatherRawFeature, i.e. only
+// blocks containing some of the keys are read.
+// Returns 0 on success and -1 if the space is not chunked or some key is
+// not a key of a point of the space.
+int Space::KeepRawFeatures(const std::vector<int> &keys) {
+  if (!IsChunked()) {
+    return -1;
+  }
+  for (int key : keys) {
+    if (key < 0 || key >= NumPoints()) {
+      return -1;
+    }
+  }
+  std::vector<int> sorted_keys(keys);
+  std::sort(sorted_keys.begin(), sorted_keys.end());
+  sorted_keys.erase(std::unique(sorted_keys.begin(), sorted_keys.end()),
+		    sorted_keys.end());
+  std::vector<std::vector<double> > values(NumRawFeatures());
+  for (int index = 0; index < NumRawFeatures(); index++) {
+    GatherRawFeature(index, sorted_keys, &values[index]);
+  }
+  kept_keys.swap(sorted_keys);
+  kept_values.swap(values);
+  return 0;
+}
+
+// Returns true iff values of the specified raw feature are read from
+// the file of a chunked space.
+bool Space::IsChunkedColumn(int index) {
+  return (chunked_fd >= 0 && index >= 0 &&
+	  index < (int) chunked_columns.size() && chunked_columns[index]);
+}
+
+// Returns the offset in the file of a chunked space of the value of the
+// specified raw feature of the point with a given key.
+uint64_t Space::ColumnOffset(int index, int key) {
+  return (chunked_header.columns_offset +
+	  index * chunked_header.column_stride + key * sizeof(double));
+}
+
+// Reads values of the specified raw features of count points starting at
+// the point with key begin into the corresponding buffers. Values that
+// can not be read are set to NAN.
+void Space::ReadBlock(const std::vector<int> &indices, int begin, int count,
+		      std::vector<Column> *buffers) {
+  for (int index : indices) {
+    if (!IsChunkedColumn(index)) {
+      continue;
+    }
+    Column &buffer = (*buffers)[index];
+    buffer.resize(count);
+    if (!ReadFully(chunked_fd, buffer.data(), count * sizeof(double),
+		   ColumnOffset(index, begin))) {
+      std::fill(buffer.begin(), buffer.end(), NAN);
+    }
+  }
+}
+
+// Calls the given function for consecutive blocks of points that cover
+// the whole space. Each block provides values of the specified raw
+// features (or of all raw features if indices is NULL) and weights of
+// its points; weights can be modified through the block.
+// Space that keeps its raw features in memory is processed as a single
+// block that refers to its columns. Chunked space reads blocks of
+// block_size points from its file and the next block is read in
+// the background while the function processes the current one.
+// Values of raw features that are not dense are NULL in every block.
+void Space::ForEachBlock(const std::vector<int> *indices,
+			 const std::function<void(SpaceBlock&)> &function) {
+  SpaceBlock block;
+  block.space = this;
+  if (!IsChunked()) {
+    block.begin = 0;
+    block.size = points.size();
+    block.columns = column_data;
+    block.weights = weights.data();
+    function(block);
+    return;
+  }
+  std::vector<int> all_indices;
+  if (indices == NULL) {
+    for (int index = 0; index < NumRawFeatures(); index++) {
+      all_indices.push_back(index);
+    }
+    indices = &all_indices;
+  }
+  std::vector<Column> buffers[2];
+  buffers[0].resize(NumRawFeatures());
+  buffers[1].resize(NumRawFeatures());
+  int num_points = points.size();
+  int num_blocks = (num_points + block_size - 1) / block_size;
+  std::future<void> next_block;
+  if (num_blocks > 0) {
+    next_block = std::async(std::launch::async, &Space::ReadBlock, this,
+			    std::cref(*indices), 0,
+			    std::min(block_size, num_points), &buffers[0]);
+  }
+  for (int number = 0; number < num_blocks; number++) {
+    next_block.get();
+    block.begin = number * block_size;
+    block.size = std::min(block_size, num_points - block.begin);
+    if (number + 1 < num_blocks) {
+      int next_begin = block.begin + block_size;
+      next_block = std::async(std::launch::async, &Space::ReadBlock, this,
+			      std::cref(*indices), next_begin,
+			      std::min(block_size, num_points - next_begin),
+			      &buffers[(number + 1) % 2]);
+    }
+    std::vector<Column> &buffer = buffers[number % 2];
+    block.columns.assign(NumRawFeatures(), NULL);
+    for (int index : *indices) {
+      if (IsChunkedColumn(index)) {
+	block.columns[index] = buffer[index].data();
+      }
+    }
+    block.weights = weights.data() + block.begin;
+    function(block);
+  }
+}
+
+// Splits this finalized space into the given number of shards of
+// (almost) equally many consecutive points. Shards are assigned to NUMA
+// nodes round-robin and a thread pinned to the node of each shard is
+// started. Owned columns and weights are copied into new memory whose
+// pages are first touched by the thread of each shard, so that later
+// passes over a shard by its thread (see ForEachShard) read local
+// memory. Columns of a shard are still parts of the columns of the
+// space, so RawFeatureColumn works as before.
+// Returns 0 on success and -1 if space is not finalized, the number of
+// shards is not positive or the space does not own its columns (i.e. it
+// is memory-mapped or chunked).
+int Space::Shard(int num_shards) {
+  if (!finalized || num_shards < 1 || mapped_data != NULL || IsChunked()) {
+    return -1;
+  }
+  int num_nodes = 0;
+  while (!NumaNodeCpus(num_nodes).empty()) {
+    num_nodes++;
+  }
+  int num_points = points.size();
+  shard_begins.clear();
+  shard_cpus.clear();
+  for (int shard = 0; shard < num_shards; shard++) {
+    shard_begins.push_back((int64_t) num_points * shard / num_shards);
+    shard_cpus.push_back(num_nodes > 0 ? NumaNodeCpus(shard % num_nodes) :
+			 std::vector<int>());
+  }
+  shard_begins.push_back(num_points);
+  shard_workers.reset(num_shards > 1 ? new ShardWorkers(shard_cpus) : NULL);
+  std::vector<Column> new_columns(columns.size());
+  for (unsigned index = 0; index < columns.size(); index++) {
+    if ((int) columns[index].size() == num_points) {
+      new_columns[index].resize(num_points);
+    }
+  }
+  Column new_weights(num_points);
+  RunShards([&](int shard) {
+      int begin = shard_begins[shard];
+      int end = shard_begins[shard + 1];
+      for (unsigned index = 0; index < columns.size(); index++) {
+	if (!new_columns[index].empty()) {
+	  std::copy(columns[index].begin() + begin,
+		    columns[index].begin() + end,
+		    new_columns[index].begin() + begin);
+	}
+      }
+      std::copy(weights.begin() + begin, weights.begin() + end,
+		new_weights.begin() + begin);
+    });
+  for (unsigned index = 0; index < columns.size(); index++) {
+    if (!new_columns[index].empty()) {
+      columns[index].swap(new_columns[index]);
+    }
+  }
+  weights.swap(new_weights);
+  UpdateColumnData();
+  return 0;
+}
+
+// Returns the number of shards of this space (one if it is not sharded).
+int Space::NumShards() {
+  return (shard_begins.empty() ? 1 : shard_begins.size() - 1);
+}
+
+// Calls the given function with the number of each shard. If there are
+// several shards, each call runs on the thread of the shard (see Shard)
+// and this method returns once all of them are done. If these threads are
+// busy with another pass (e.g. passes started concurrently by several
+// weak learners or a pass started by the function of a pass), the calls
+// run one after another on the calling thread instead.
+void Space::RunShards(const std::function<void(int)> &function) {
+  if (shard_workers && shard_workers->TryRun(function)) {
+    return;
+  }
+  for (int shard = 0; shard < NumShards(); shard++) {
+    function(shard);
+  }
+}
+
+// Calls the given function for blocks of points that cover the whole
+// space together with the shard each block belongs to. Each shard of
+// a sharded space is a single block processed in parallel with the other
+// shards on its own NUMA node (see RunShards), so the function must only
+// modify state of its shard (e.g. a partial result per shard that is
+// combined once this method returns). Unsharded spaces are processed as by
+// ForEachBlock with every block belonging to shard 0.
+void Space::ForEachShard
+  (const std::vector<int> *indices,
+   const std::function<void(SpaceBlock&, int)> &function) {
+  if (NumShards() == 1) {
+    ForEachBlock(indices, [&](SpaceBlock &block) { function(block, 0); });
+    return;
+  }
+  RunShards([&](int shard) {
+      SpaceBlock block;
+      block.space = this;
+      block.begin = shard_begins[shard];
+      block.size = shard_begins[shard + 1] - block.begin;
+      block.columns.assign(column_data.size(), NULL);
+      for (unsigned index = 0; index < column_data.size(); index++) {
+	if (column_data[index] != NULL) {
+	  block.columns[index] = column_data[index] + block.begin;
+	}
+      }
+      block.weights = weights.data() + block.begin;
+      function(block, shard);
+    });
+}
+
+// Writes this space together with specified counts of observations at
+// each point to a binary file (see SpaceFileHeader for the layout).
+// Sparse raw features are written densely and released ones as NAN.
+// Returns 0 on success and -1 if the file could not be written or
+// the number of counts does not match the number of points.
+int Space::WriteBinary(const std::string &filename,
+		       const std::vector<int> &counts) {
+  if (counts.size() != points.size()) {
+    return -1;
+  }
+  SpaceFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kSpaceFileMagic, sizeof(header.magic));
+  header.version = gSpaceFileVersion;
+  header.num_raw_features = NumRawFeatures();
+  header.num_points = points.size();
+  header.ids_offset = AlignedSize(sizeof(header));
+  header.counts_offset = header.ids_offset +
+    AlignedSize(header.num_points * sizeof(int32_t));
+  header.multiplicities_offset = header.counts_offset +
+    AlignedSize(header.num_points * sizeof(int32_t));
+  header.columns_offset = header.multiplicities_offset +
+    AlignedSize(header.num_points * sizeof(int32_t));
+  header.column_stride = AlignedSize(header.num_points * sizeof(double));
+
+  std::ofstream file(filename.c_str(), std::ios::binary | std::ios::trunc);
+  if (!file.is_open()) {
+    return -1;
+  }
+  std::vector<char> padding(gColumnAlignment, 0);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(padding.data(), header.ids_offset - sizeof(header));
+  std::vector<int32_t> values(points.size());
+  for (unsigned key = 0; key < points.size(); key++) {
+    values[key] = points[key].GetId();
+  }
+  file.write(reinterpret_cast<const char*>(values.data()),
+	     values.size() * sizeof(int32_t));
+  file.write(padding.data(), header.counts_offset - header.ids_offset -
+	     values.size() * sizeof(int32_t));
+  for (unsigned key = 0; key < points.size(); key++) {
+    values[key] = counts[key];
+  }
+  file.write(reinterpret_cast<const char*>(values.data()),
+	     values.size() * sizeof(int32_t));
+  file.write(padding.data(), header.multiplicities_offset -
+	     header.counts_offset - values.size() * sizeof(int32_t));
+  for (unsigned key = 0; key < points.size(); key++) {
+    values[key] = multiplicities[key];
+  }
+  file.write(reinterpret_cast<const char*>(values.data()),
+	     values.size() * sizeof(int32_t));
+  file.write(padding.data(), header.columns_offset -
+	     header.multiplicities_offset - values.size() * sizeof(int32_t));
+  std::vector<double> buffer;
+  for (int index = 0; index < NumRawFeatures(); index++) {
+    const double *column = DenseColumn(index, &buffer);
+    if (column == NULL) {
+      buffer.assign(points.size(), NAN);
+      column = buffer.data();
+    }
+    file.write(reinterpret_cast<const char*>(column),
+	       points.size() * sizeof(double));
+    file.write(padding.data(),
+	       header.column_stride - points.size() * sizeof(double));
+  }
+  file.close();
+  return (file.fail() ? -1 : 0);
+}
+
+// Memory-maps a binary space file written by WriteBinary into this space.
+// Columns of raw features are used in place without copying, weights of
+// all points are set to their multiplicities and counts of observations
+// at each point are stored in the provided vector. The space is finalized
+// afterwards.
+// Returns 0 on success and -1 if this space is not empty or the file
+// could not be mapped or is not a valid space file.
+int Space::MapBinary(const std::string &filename, std::vector<int> *counts) {
+  if (finalized || !points.empty()) {
+    return -1;
+  }
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 ||
+      file_stat.st_size < (off_t) sizeof(SpaceFileHeader)) {
+    close(fd);
+    return -1;
+  }
+  size_t size = file_stat.st_size;
+  void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return -1;
+  }
+  const char *bytes = static_cast<const char*>(data);
+  SpaceFileHeader header;
+  memcpy(&header, bytes, sizeof(header));
+  if (!IsValidHeader(header, size)) {
+    munmap(data, size);
+    return -1;
+  }
+  mapped_data = data;
+  mapped_size = size;
+  madvise(mapped_data, mapped_size, MADV_SEQUENTIAL);
+
+  column_data.resize(header.num_raw_features);
+  for (unsigned index = 0; index < header.num_raw_features; index++) {
+    column_data[index] = reinterpret_cast<const double*>
+      (bytes + header.columns_offset + index * header.column_stride);
+  }
+  AddViews(reinterpret_cast<const int32_t*>(bytes + header.ids_offset),
+	   reinterpret_cast<const int32_t*>(bytes + header.counts_offset),
+	   reinterpret_cast<const int32_t*>
+	   (bytes + header.multiplicities_offset),
+	   header.num_points, counts);
+  return 0;
+}
+
+// Opens a binary space file written by WriteBinary as a chunked space.
+// Only ids, multiplicities and weights of points are kept in memory while
+// raw feature values are read from the file in blocks of the given number
+// of points (see ForEachBlock). Weights of all points are set to their
+// multiplicities and counts of observations at each point are stored in
+// the provided vector. The space is finalized afterwards.
+// Returns 0 on success and -1 if this space is not empty, block size is
+// not positive or the file could not be opened or is not a valid space file.
+int Space::OpenChunked(const std::string &filename, int points_per_block,
+		       std::vector<int> *counts) {
+  if (finalized || !points.empty() || points_per_block <= 0) {
+    return -1;
+  }
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat file_stat;
+  SpaceFileHeader header;
+  if (fstat(fd, &file_stat) != 0 ||
+      !ReadFully(fd, &header, sizeof(header), 0) ||
+      !IsValidHeader(header, file_stat.st_size)) {
+    close(fd);
+    return -1;
+  }
+  uint64_t n = header.num_points;
+  std::vector<int32_t> ids(n);
+  std::vector<int32_t> point_counts(n);
+  std::vector<int32_t> point_multiplicities(n);
+  if (!ReadFully(fd, ids.data(), n * sizeof(int32_t), header.ids_offset) ||
+      !ReadFully(fd, point_counts.data(), n * sizeof(int32_t),
+		 header.counts_offset) ||
+      !ReadFully(fd, point_multiplicities.data(), n * sizeof(int32_t),
+		 header.multiplicities_offset)) {
+    close(fd);
+    return -1;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  chunked_fd = fd;
+  chunked_header = header;
+  block_size = points_per_block;
+  column_data.assign(header.num_raw_features, NULL);
+  chunked_columns.assign(header.num_raw_features, true);
+  AddViews(ids.data(), point_counts.data(), point_multiplicities.data(), n,
+	   counts);
+  return 0;
+}
+
+// Adds n points with given ids and multiplicities read from a space file
+// to this empty space and finalizes it. Weights of the points are set to
+// their multiplicities and given counts are stored in the provided vector.
+void Space::AddViews(const int32_t *ids, const int32_t *point_counts,
+		     const int32_t *point_multiplicities, uint64_t n,
+		     std::vector<int> *counts) {
+  multiplicities.assign(point_multiplicities, point_multiplicities + n);
+  weights.assign(multiplicities.begin(), multiplicities.end());
+  points.reserve(n);
+  counts->assign(point_counts, point_counts + n);
+  for (uint64_t key = 0; key < n; key++) {
+    Point view(ids[key]);
+    view.space = this;
+    view.key = key;
+    view.finalized = true;
+    points.push_back(view);
+  }
+  finalized = true;
+}
+
 // Returns iterator to the beginning of the space container.
 Space::SpaceIterator Space::begin() {
   return points.begin();
@@ -52,20 +1295,33 @@ Point::Point(int point_id) {
   id = point_id;
   finalized = false;
   probability_weight = 1.0;
+  space = NULL;
+  key = -1;
 }
 
 // Returns probabilistic weight of this point.
 double Point::GetProbWeight() {
+  if (space != NULL) {
+    return space->GetProbWeight(key);
+  }
   return probability_weight;
 }
 
 // Returns specified raw feature value of this point.
 double Point::GetRawFeature(int index) {
-  return (index < raw_features.size() ? raw_features[index] : NAN);
+  if (space != NULL) {
+    return space->GetRawFeature(key, index);
+  }
+  return (index >= 0 && index < (int) raw_features.size() ?
+	  raw_features[index] : NAN);
 }
 
 // Sets probabilistic weight of this point with specified value.
 void Point::SetProbWeight(double value) {
+  if (space != NULL) {
+    space->SetProbWeight(key, value);
+    return;
+  }
   probability_weight = value;
 }
 
@@ -91,7 +1347,34 @@ int Point::GetId() {
 }
 
 
+// Returns bin code of the specified raw feature of this point or -1 if
+// this point is not in a space or the raw feature is not quantized.
+int Point::GetBinCode(int index) {
+  if (space != NULL) {
+    return space->GetBinCode(key, index);
+  }
+  return -1;
+}
+
+// Returns the number of points merged into this point (see
+// Space::GetMultiplicity) or 1 if this point is not in a space.
+int Point::GetMultiplicity() {
+  if (space != NULL) {
+    return space->GetMultiplicity(key);
+  }
+  return 1;
+}
+
+// Returns the key of this point in its space (or -1 if the point is not
+// in a space).
+int Point::GetKey() {
+  return space != NULL ? key : -1;
+}
+
 // Returns number of raw features for this point.
 int Point::NumRawFeatures() {
+  if (space != NULL) {
+    return space->NumRawFeatures();
+  }
   return raw_features.size();
 }
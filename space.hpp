@@ -1,13 +1,87 @@
 #include <vector>
+#include <string>
+#include <unordered_map>
+#include <cstddef>
+#include <cstdlib>
+#include <stdint.h>
+#include <new>
+#include <utility>
+#include <functional>
+#include <memory>
 
 #ifndef SPACE_HPP
 #define SPACE_HPP
 
+class Space;
+class ShardWorkers;
+
+// Alignment (in bytes) of the columns stored in the space. This is
+// a cache line on most of the current hardware and it is also enough
+// for the widest vector loads.
+static const size_t gColumnAlignment = 64;
+
+// A minimal allocator that returns memory aligned to gColumnAlignment.
+// It is used for contiguous per-feature columns stored in the space.
+template <typename T>
+class AlignedAllocator {
+public:
+  typedef T value_type;
+  AlignedAllocator() {}
+  template <typename U> AlignedAllocator(const AlignedAllocator<U>&) {}
+  T *allocate(size_t n) {
+    void *memory = NULL;
+    if (posix_memalign(&memory, gColumnAlignment, n * sizeof(T)) != 0) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T*>(memory);
+  }
+  void deallocate(T *memory, size_t) {
+    free(memory);
+  }
+  // Values constructed without arguments are left uninitialized, so that
+  // pages of a new column are first touched by the thread that fills them.
+  template <typename U> void construct(U *pointer) {
+    ::new (static_cast<void*>(pointer)) U;
+  }
+  template <typename U, typename... Args>
+  void construct(U *pointer, Args&&... args) {
+    ::new (static_cast<void*>(pointer)) U(std::forward<Args>(args)...);
+  }
+  template <typename U> struct rebind { typedef AlignedAllocator<U> other; };
+  bool operator==(const AlignedAllocator&) const { return true; }
+  bool operator!=(const AlignedAllocator&) const { return false; }
+};
+
+// A contiguous aligned column of values of a single raw feature.
+typedef std::vector<double, AlignedAllocator<double> > Column;
+
+// A non-owning view of a contiguous array of values.
+// Sample usage:
+//   Span<double> weights = space.ProbWeights();
+//   for (double weight : weights) { ... }
+template <typename T>
+class Span {
+public:
+  Span(T *data, size_t size) : values(data), count(size) {}
+  T *data() const { return values; }
+  size_t size() const { return count; }
+  T &operator[](size_t index) const { return values[index]; }
+  T *begin() const { return values; }
+  T *end() const { return values + count; }
+private:
+  T *values;
+  size_t count;
+};
+
 // This class represents a point in space to which
 // DMaxEnt assigns probabilities. Inital probabilitstic weight is 1.0.
 // Please remember to finalize your point once you are done adding features
 // otherwise behavior is undefined. Note that probabilistic weight
 // of finalzied points is allowed to be modified.
+// Once a point is added to a space, the space keeps a view of this point
+// whose raw features are stored in the columns of the space and whose
+// probabilistic weight is stored in the weight vector of the space.
+// Raw features of such views can not be modified.
 // Sample usage:
 //   Point point = new Point(id);
 //   point.AddRawFeature(value1);
@@ -25,39 +99,236 @@ public:
   double GetProbWeight();
   void SetProbWeight(double value);
   int NumRawFeatures();
+  int GetBinCode(int index);
+  int GetMultiplicity();
+  int GetKey();
   void Finalize();
 private:
+  friend class Space;
   int id;
   bool finalized;
-  double probability_weight;
+  double probability_weight; // only used if point is not in a space
   std::vector<double> raw_features;
+  Space *space; // space storing this point (or NULL)
+  int key; // key of this point in the space
+};
+
+
+// Version of the binary space file layout written by Space::WriteBinary.
+static const uint32_t gSpaceFileVersion = 2;
+
+// Header of a binary space file. The header is followed by (in order)
+// ids of points, counts of observations at each point, multiplicities of
+// points and columns of raw feature values. Each of these arrays starts
+// at an offset that is a multiple of gColumnAlignment and all values are
+// stored in the native byte order. Columns are num_raw_features
+// consecutive arrays of doubles, each of them padded to column_stride
+// bytes.
+struct SpaceFileHeader {
+  char magic[8]; // "SMAXSPC" followed by a zero byte
+  uint32_t version;
+  uint32_t num_raw_features;
+  uint64_t num_points;
+  uint64_t ids_offset; // int32_t[num_points]
+  uint64_t counts_offset; // int32_t[num_points]
+  uint64_t multiplicities_offset; // int32_t[num_points]
+  uint64_t columns_offset; // double[num_points] for each raw feature
+  uint64_t column_stride;
 };
 
+// A block of consecutive points of a space passed to the function given to
+// Space::ForEachBlock. Values of raw features and weights of the points
+// are indexed by the offset of a point in the block, i.e. the point with
+// key begin + offset has value columns[index][offset] of raw feature index.
+struct SpaceBlock {
+  Space *space;
+  int begin; // key of the first point in the block
+  int size; // number of points in the block
+  std::vector<const double*> columns; // NULL for raw features not provided
+  double *weights;
+  // Returns values of the specified raw feature (or NULL).
+  const double *RawFeatureColumn(int index) const {
+    return index >= 0 && index < (int) columns.size() ? columns[index] : NULL;
+  }
+};
 
 // This class represents underlying space X. Space is a set of points.
 // Each point in the space has a unique identifier (integer key).
+// Raw features of the points are stored column-wise: there is one
+// contiguous aligned array per raw feature indexed by the keys of points.
+// Probabilistic weights of the points are stored in a single dense
+// array indexed by the keys of points as well.
 // Once you are done building your space please finalize it
-// otherwise behaviour is undefined. 
+// otherwise behaviour is undefined.
+// Raw features can also be quantized: given sorted thresholds, each value
+// is replaced by a bin code (the number of thresholds strictly below it)
+// stored in a uint8 or uint16 column. Consumers that only compare raw
+// values against these thresholds can read bin codes instead of doubles
+// and double values can then be released altogether.
+// Raw features that are mostly zero can be stored sparsely instead: only
+// keys of points with non-zero values and these values are kept (compressed
+// sparse column form) so that consumers can iterate over non-zeros only.
+// Points can be added either from Point objects or directly from arrays
+// of raw feature values, which avoids constructing a Point per line when
+// reading large data sets. Storage for the expected number of points can
+// be reserved upfront. Space can be moved but not copied since its points
+// refer to it.
+// Space can also deduplicate points as they are added: a point whose raw
+// features are identical to those of a point already in the space is not
+// stored again, instead multiplicity of the existing point is incremented
+// and its probabilistic weight is increased by the weight of the new point.
+// Weight of such a point is thus the total weight of all the points it
+// represents, so expectations wrt weights need no further adjustment.
+// Space can also be saved to a binary file (see SpaceFileHeader) and
+// later memory-mapped from it, in which case columns of the space are
+// used in place without copying and the space is finalized.
+// For data sets larger than memory the binary file can be opened as
+// a chunked space instead: only ids, weights and multiplicities of points
+// are kept in memory and raw feature values are streamed from the file
+// in blocks of points (see ForEachBlock) while the next block is prefetched.
+// Raw features of a few points, e.g. of sample points that are evaluated
+// one by one, can be kept in memory as well (see KeepRawFeatures).
+// Finalized space that owns its columns can also be split into shards of
+// consecutive points. Each shard gets a thread running on the NUMA node of
+// the shard for the lifetime of the space. Memory of each shard is first
+// touched by this thread and passes over the space process shards in
+// parallel on these threads (see ForEachShard).
 // DMaxEnt fits probability density over this space. Sample Usage:
 //   Space X = new Space();
 //   X.AddPoint(key1, point1);
 //   X.AddPoint(key2, point2);
+//   X.AddPoint(id3, values3, num_raw_features, weight3);
 //   ...
 //   X.Finalize();
 //   X.GetPoint(some_key);
+//   X.GetMultiplicity(some_key);
+//   const double *column = X.RawFeatureColumn(index);
+//   X.Sparsify(max_density);
+//   const int *keys = X.SparseKeys(index);
+//   Span<double> weights = X.ProbWeights();
+//   X.WriteBinary(filename, counts);
+//   Space Y = new Space();
+//   Y.MapBinary(filename, &counts);
+//   Space Z = new Space();
+//   Z.OpenChunked(filename, block_size, &counts);
+//   Z.ForEachBlock(&indices, [&](SpaceBlock &block) { ... });
+//   Z.KeepRawFeatures(sample_keys);
+//   X.Shard(num_shards);
+//   X.ForEachShard(&indices, [&](SpaceBlock &block, int shard) { ... });
 class Space{
 public:
   Space();
+  ~Space();
+  Space(Space &&other);
+  Space &operator=(Space &&other);
+  int EnableDeduplication();
+  int Reserve(int num_points, int num_raw_features);
   int AddPoint(Point &point);
+  int AddPoint(int id, const double *values, int num_raw_features,
+	       double weight);
   Point& GetPoint(int key);
   void Finalize();
   int NumPoints();
+  int NumRawFeatures();
+  double GetRawFeature(int key, int index);
+  const double *RawFeatureColumn(int index);
+  double GetProbWeight(int key);
+  void SetProbWeight(int key, double value);
+  Span<double> ProbWeights();
+  double TotalProbWeight();
+  int GetMultiplicity(int key);
+  int TotalMultiplicity();
+  int QuantizeRawFeature(int index, const std::vector<double> &thresholds);
+  bool IsQuantized(int index);
+  int GetBinCode(int key, int index);
+  int FindBin(int index, double threshold);
+  const std::vector<double> &BinThresholds(int index);
+  const uint8_t *BinCodes8(int index);
+  const uint16_t *BinCodes16(int index);
+  void ReleaseRawFeatureColumn(int index);
+  int SparsifyRawFeature(int index);
+  int Sparsify(double max_density);
+  bool IsSparse(int index);
+  int NumNonZeros(int index);
+  const int *SparseKeys(int index);
+  const double *SparseValues(int index);
+  void GatherRawFeature(int index, const std::vector<int> &keys,
+			std::vector<double> *values);
+  int WriteBinary(const std::string &filename, const std::vector<int> &counts);
+  int MapBinary(const std::string &filename, std::vector<int> *counts);
+  int OpenChunked(const std::string &filename, int points_per_block,
+		  std::vector<int> *counts);
+  bool IsChunked();
+  int KeepRawFeatures(const std::vector<int> &keys);
+  bool IsDense(int index);
+  void ForEachBlock(const std::vector<int> *indices,
+		    const std::function<void(SpaceBlock&)> &function);
+  int Shard(int num_shards);
+  int NumShards();
+  void ForEachShard(const std::vector<int> *indices,
+		    const std::function<void(SpaceBlock&, int)> &function);
   typedef std::vector<Point>::iterator SpaceIterator;
   SpaceIterator begin();
   SpaceIterator end();
 private:
+  Space(const Space&); // points of the space refer to it, so no copies
+  Space &operator=(const Space&);
+  void UpdateColumnData();
+  void DropColumn(int index);
+  const double *DenseColumn(int index, std::vector<double> *buffer);
+  void AddViews(const int32_t *ids, const int32_t *point_counts,
+		const int32_t *point_multiplicities, uint64_t n,
+		std::vector<int> *counts);
+  bool IsChunkedColumn(int index);
+  uint64_t ColumnOffset(int index, int key);
+  void ReadBlock(const std::vector<int> &indices, int begin, int count,
+		 std::vector<Column> *buffers);
+  void RunShards(const std::function<void(int)> &function);
   bool finalized;
   std::vector<Point> points;
+  std::vector<Column> columns; // raw feature values owned by the space
+  std::vector<const double*> column_data; // column_data[index][key]
+  // Bin codes of a quantized raw feature. Only one of the code vectors
+  // is used depending on the number of thresholds.
+  struct QuantizedColumn {
+    std::vector<double> thresholds;
+    std::vector<uint8_t> codes8;  // used if there are less than 256 bins
+    std::vector<uint16_t> codes16;  // used otherwise
+  };
+  std::vector<QuantizedColumn> quantized_columns;
+  // Non-zero values of a raw feature stored in compressed sparse column
+  // form: values[i] is the value of the point with key keys[i].
+  struct SparseColumn {
+    bool used; // true iff this raw feature is stored sparsely
+    std::vector<int> keys; // sorted in ascending order
+    std::vector<double> values;
+  };
+  std::vector<SparseColumn> sparse_columns;
+  void *mapped_data; // memory-mapped space file (or NULL)
+  size_t mapped_size;
+  Column weights; // weights[key] is a probabilistic weight of a point
+  std::vector<int> multiplicities; // number of points merged into each key
+  bool deduplicate;
+  int reserved_points; // number of points storage is reserved for
+  // Keys of points by hashes of their raw features (see AddPoint). Only
+  // used for deduplication while points are being added. Raw features of
+  // points with equal hashes are compared in the columns of the space.
+  std::unordered_multimap<uint64_t, int> keys_by_hash;
+  int chunked_fd; // file of a chunked space (or -1)
+  int block_size; // number of points per block of a chunked space
+  SpaceFileHeader chunked_header;
+  std::vector<bool> chunked_columns; // true iff a column is read from file
+  // Keys (sorted in ascending order) of points of a chunked space whose raw
+  // features are kept in memory: kept_values[index][i] is the value of raw
+  // feature index at the point with key kept_keys[i].
+  std::vector<int> kept_keys;
+  std::vector<std::vector<double> > kept_values;
+  // Keys of the first points of shards followed by the number of points
+  // (empty if the space is not sharded) and CPUs that threads processing
+  // each shard run on (empty if they are not pinned).
+  std::vector<int> shard_begins;
+  std::vector<std::vector<int> > shard_cpus;
+  std::unique_ptr<ShardWorkers> shard_workers; // NULL unless sharded
 };
 
 // An example is a pointer to a point in space
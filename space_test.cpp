@@ -1,4 +1,8 @@
 #include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <thread>
+#include <atomic>
 #include "gtest/gtest.h"
 #include "space.hpp"
 #include "constants.hpp"
@@ -131,3 +135,542 @@ TEST(SpaceTest, TestBeginEndIteratesThroughSpace) {
     i++;
   }
 }
+
+// Tests that raw features of points in space are stored column-wise
+// and that points with missing raw features are padded with NAN.
+TEST(SpaceTest, TestRawFeatureColumns) {
+  Point *point = new Point(1);
+  point->AddRawFeature(0.5);
+  point->AddRawFeature(-1.0);
+  Point *point2 = new Point(7);
+  point2->AddRawFeature(2.0);
+  Point *point3 = new Point(99);
+  point3->AddRawFeature(3.0);
+  point3->AddRawFeature(4.0);
+  point3->AddRawFeature(5.0);
+  Space *space = new Space();
+  space->AddPoint(*point);
+  space->AddPoint(*point2);
+  space->AddPoint(*point3);
+  space->Finalize();
+  EXPECT_EQ(3, space->NumRawFeatures());
+  const double *column = space->RawFeatureColumn(0);
+  EXPECT_NEAR(0.5, column[0], gTolerance);
+  EXPECT_NEAR(2.0, column[1], gTolerance);
+  EXPECT_NEAR(3.0, column[2], gTolerance);
+  column = space->RawFeatureColumn(1);
+  EXPECT_NEAR(-1.0, column[0], gTolerance);
+  EXPECT_TRUE(isnan(column[1]));
+  EXPECT_NEAR(4.0, column[2], gTolerance);
+  column = space->RawFeatureColumn(2);
+  EXPECT_TRUE(isnan(column[0]));
+  EXPECT_TRUE(isnan(column[1]));
+  EXPECT_NEAR(5.0, column[2], gTolerance);
+  EXPECT_EQ(0, reinterpret_cast<size_t>(column) % gColumnAlignment);
+  EXPECT_NEAR(-1.0, space->GetRawFeature(0, 1), gTolerance);
+  EXPECT_TRUE(isnan(space->GetRawFeature(0, 3)));
+  EXPECT_NEAR(4.0, space->GetPoint(2).GetRawFeature(1), gTolerance);
+  EXPECT_EQ(3, space->GetPoint(1).NumRawFeatures());
+}
+
+// Tests that probabilistic weights of points in space are stored in
+// a dense vector owned by the space and are shared with points in it.
+TEST(SpaceTest, TestProbWeights) {
+  Point *point = new Point(1);
+  Point *point2 = new Point(7);
+  Point *point3 = new Point(99);
+  point->SetProbWeight(2.0);
+  point3->SetProbWeight(0.5);
+  Space *space = new Space();
+  space->AddPoint(*point);
+  space->AddPoint(*point2);
+  space->AddPoint(*point3);
+  space->Finalize();
+  Span<double> weights = space->ProbWeights();
+  EXPECT_EQ(3, weights.size());
+  EXPECT_NEAR(2.0, weights[0], gTolerance);
+  EXPECT_NEAR(1.0, weights[1], gTolerance);
+  EXPECT_NEAR(0.5, weights[2], gTolerance);
+  EXPECT_NEAR(3.5, space->TotalProbWeight(), gTolerance);
+  weights[1] = 4.0;
+  EXPECT_NEAR(4.0, space->GetPoint(1).GetProbWeight(), gTolerance);
+  space->GetPoint(2).SetProbWeight(3.0);
+  EXPECT_NEAR(3.0, weights[2], gTolerance);
+  EXPECT_NEAR(3.0, space->GetProbWeight(2), gTolerance);
+  EXPECT_NEAR(1.0, point2->GetProbWeight(), gTolerance);
+  EXPECT_NEAR(9.0, space->TotalProbWeight(), gTolerance);
+}
+
+// Tests that space written to a binary file can be memory-mapped back
+// together with the counts of observations at each point.
+TEST(SpaceTest, TestWriteMapBinary) {
+  Point *point = new Point(1);
+  point->AddRawFeature(0.5);
+  point->AddRawFeature(-1.0);
+  Point *point2 = new Point(7);
+  point2->AddRawFeature(2.0);
+  point2->AddRawFeature(3.0);
+  point2->SetProbWeight(5.0);
+  Space *space = new Space();
+  space->AddPoint(*point);
+  space->AddPoint(*point2);
+  space->Finalize();
+  std::vector<int> counts;
+  counts.push_back(3);
+  counts.push_back(0);
+  std::string filename = "space_test.bin";
+  EXPECT_EQ(-1, space->WriteBinary(filename, std::vector<int>(1, 0)));
+  EXPECT_EQ(0, space->WriteBinary(filename, counts));
+
+  Space *mapped_space = new Space();
+  std::vector<int> mapped_counts;
+  EXPECT_EQ(0, mapped_space->MapBinary(filename, &mapped_counts));
+  EXPECT_EQ(2, mapped_space->NumPoints());
+  EXPECT_EQ(2, mapped_space->NumRawFeatures());
+  EXPECT_EQ(counts, mapped_counts);
+  EXPECT_EQ(1, mapped_space->GetPoint(0).GetId());
+  EXPECT_EQ(7, mapped_space->GetPoint(1).GetId());
+  EXPECT_NEAR(-1.0, mapped_space->GetPoint(0).GetRawFeature(1), gTolerance);
+  const double *column = mapped_space->RawFeatureColumn(0);
+  EXPECT_NEAR(0.5, column[0], gTolerance);
+  EXPECT_NEAR(2.0, column[1], gTolerance);
+  EXPECT_EQ(0, reinterpret_cast<size_t>(column) % gColumnAlignment);
+  EXPECT_NEAR(1.0, mapped_space->GetPoint(1).GetProbWeight(), gTolerance);
+  EXPECT_EQ(-1, mapped_space->AddPoint(*point));
+  EXPECT_EQ(-1, mapped_space->MapBinary(filename, &mapped_counts));
+  delete mapped_space;
+  std::remove(filename.c_str());
+}
+
+// Tests that deduplicated points keep their multiplicities when they
+// are written to and mapped from a binary file.
+TEST(SpaceTest, TestWriteMapBinaryWithMultiplicities) {
+  Space *space = new Space();
+  space->EnableDeduplication();
+  for (int id = 0; id < 3; id++) {
+    Point *point = new Point(id);
+    point->AddRawFeature(id == 0 ? 1.0 : 2.0);
+    space->AddPoint(*point);
+  }
+  space->Finalize();
+  std::string filename = "space_test.bin";
+  EXPECT_EQ(0, space->WriteBinary(filename, std::vector<int>(2, 1)));
+  Space *mapped_space = new Space();
+  std::vector<int> counts;
+  EXPECT_EQ(0, mapped_space->MapBinary(filename, &counts));
+  EXPECT_EQ(2, mapped_space->NumPoints());
+  EXPECT_EQ(1, mapped_space->GetMultiplicity(0));
+  EXPECT_EQ(2, mapped_space->GetMultiplicity(1));
+  EXPECT_EQ(3, mapped_space->TotalMultiplicity());
+  EXPECT_NEAR(2.0, mapped_space->GetPoint(1).GetProbWeight(), gTolerance);
+  delete mapped_space;
+  std::remove(filename.c_str());
+}
+
+// Tests that mapping a file which is not a binary space file fails.
+TEST(SpaceTest, TestMapBinaryFailsOnInvalidFile) {
+  std::string filename = "space_test.txt";
+  std::ofstream file(filename.c_str());
+  file << "0.1 0.2 1" << std::endl;
+  file.close();
+  Space *space = new Space();
+  std::vector<int> counts;
+  EXPECT_EQ(-1, space->MapBinary(filename, &counts));
+  EXPECT_EQ(-1, space->MapBinary("no_such_file.bin", &counts));
+  EXPECT_EQ(0, space->NumPoints());
+  delete space;
+  std::remove(filename.c_str());
+}
+
+// Tests that a binary space file opened as a chunked space provides
+// raw feature values block by block and on demand.
+TEST(SpaceTest, TestOpenChunked) {
+  Space *space = new Space();
+  for (int key = 0; key < 5; key++) {
+    double values[2] = {double(key), 10.0 * key};
+    space->AddPoint(key + 1, values, 2, 1.0);
+  }
+  space->Finalize();
+  std::string filename = "space_test.bin";
+  EXPECT_EQ(0, space->WriteBinary(filename, std::vector<int>(5, 2)));
+  EXPECT_EQ(-1, space->KeepRawFeatures(std::vector<int>(1, 0)));
+  delete space;
+
+  Space *chunked_space = new Space();
+  std::vector<int> counts;
+  EXPECT_EQ(-1, chunked_space->OpenChunked(filename, 0, &counts));
+  EXPECT_EQ(-1, chunked_space->OpenChunked("no_such_file.bin", 2, &counts));
+  EXPECT_EQ(0, chunked_space->OpenChunked(filename, 2, &counts));
+  EXPECT_EQ(-1, chunked_space->OpenChunked(filename, 2, &counts));
+  EXPECT_TRUE(chunked_space->IsChunked());
+  EXPECT_EQ(5, chunked_space->NumPoints());
+  EXPECT_EQ(2, chunked_space->NumRawFeatures());
+  EXPECT_EQ(std::vector<int>(5, 2), counts);
+  EXPECT_EQ(4, chunked_space->GetPoint(3).GetId());
+  EXPECT_EQ(3, chunked_space->GetPoint(3).GetKey());
+  EXPECT_TRUE(chunked_space->IsDense(1));
+  EXPECT_TRUE(chunked_space->RawFeatureColumn(1) == NULL);
+  EXPECT_NEAR(30.0, chunked_space->GetRawFeature(3, 1), gTolerance);
+  EXPECT_NEAR(4.0, chunked_space->GetPoint(4).GetRawFeature(0), gTolerance);
+
+  std::vector<int> block_sizes;
+  std::vector<int> indices(1, 1);
+  chunked_space->ForEachBlock(&indices, [&](SpaceBlock &block) {
+      block_sizes.push_back(block.size);
+      EXPECT_TRUE(block.RawFeatureColumn(0) == NULL);
+      for (int offset = 0; offset < block.size; offset++) {
+	EXPECT_NEAR(10.0 * (block.begin + offset), block.columns[1][offset],
+		    gTolerance);
+	block.weights[offset] = block.begin + offset;
+      }
+    });
+  EXPECT_EQ(3, block_sizes.size());
+  EXPECT_EQ(2, block_sizes[0]);
+  EXPECT_EQ(1, block_sizes[2]);
+  EXPECT_NEAR(10.0, chunked_space->TotalProbWeight(), gTolerance);
+
+  std::vector<int> keys;
+  keys.push_back(4);
+  keys.push_back(0);
+  keys.push_back(3);
+  std::vector<double> values;
+  chunked_space->GatherRawFeature(0, keys, &values);
+  EXPECT_NEAR(4.0, values[0], gTolerance);
+  EXPECT_NEAR(0.0, values[1], gTolerance);
+  EXPECT_NEAR(3.0, values[2], gTolerance);
+
+  EXPECT_EQ(-1, chunked_space->KeepRawFeatures(std::vector<int>(1, 5)));
+  keys.push_back(4);
+  EXPECT_EQ(0, chunked_space->KeepRawFeatures(keys));
+  EXPECT_NEAR(40.0, chunked_space->GetRawFeature(4, 1), gTolerance);
+  EXPECT_NEAR(3.0, chunked_space->GetPoint(3).GetRawFeature(0), gTolerance);
+  EXPECT_NEAR(20.0, chunked_space->GetRawFeature(2, 1), gTolerance);
+
+  EXPECT_EQ(0, chunked_space->QuantizeRawFeature(0,
+						 std::vector<double>(1, 2.5)));
+  EXPECT_EQ(0, chunked_space->GetBinCode(2, 0));
+  EXPECT_EQ(1, chunked_space->GetBinCode(3, 0));
+  chunked_space->ReleaseRawFeatureColumn(0);
+  EXPECT_FALSE(chunked_space->IsDense(0));
+  EXPECT_TRUE(isnan(chunked_space->GetRawFeature(3, 0)));
+  delete chunked_space;
+  std::remove(filename.c_str());
+}
+
+// Tests that sharding a space keeps its values and that shards cover
+// all of its points.
+TEST(SpaceTest, TestShard) {
+  Space *space = new Space();
+  for (int key = 0; key < 10; key++) {
+    double values[2] = {double(key), -1.0 * key};
+    space->AddPoint(key, values, 2, key + 1.0);
+  }
+  EXPECT_EQ(-1, space->Shard(3));
+  space->Finalize();
+  EXPECT_EQ(-1, space->Shard(0));
+  EXPECT_EQ(1, space->NumShards());
+  EXPECT_EQ(0, space->Shard(3));
+  EXPECT_EQ(3, space->NumShards());
+  EXPECT_NEAR(-7.0, space->RawFeatureColumn(1)[7], gTolerance);
+  EXPECT_NEAR(55.0, space->TotalProbWeight(), gTolerance);
+  std::vector<int> shard_sizes(3, 0);
+  std::vector<double> shard_sums(3, 0.0);
+  space->ForEachShard(NULL, [&](SpaceBlock &block, int shard) {
+      shard_sizes[shard] = block.size;
+      for (int offset = 0; offset < block.size; offset++) {
+	EXPECT_NEAR(block.begin + offset, block.columns[0][offset],
+		    gTolerance);
+	shard_sums[shard] += block.weights[offset];
+	block.weights[offset] = 1.0;
+      }
+    });
+  EXPECT_EQ(3, shard_sizes[0]);
+  EXPECT_EQ(10, shard_sizes[0] + shard_sizes[1] + shard_sizes[2]);
+  EXPECT_NEAR(55.0, shard_sums[0] + shard_sums[1] + shard_sums[2],
+	      gTolerance);
+  EXPECT_NEAR(10.0, space->TotalProbWeight(), gTolerance);
+  delete space;
+}
+
+// Tests that the threads of shards run many passes, passes started by
+// several threads at once and passes nested in a pass, also after
+// the sharded space has been moved.
+TEST(SpaceTest, TestShardPasses) {
+  Space space;
+  for (int key = 0; key < 100; key++) {
+    double value = key;
+    space.AddPoint(key, &value, 1, 1.0);
+  }
+  space.Finalize();
+  EXPECT_EQ(0, space.Shard(4));
+  std::atomic<long> sum(0);
+  for (int pass = 0; pass < 1000; pass++) {
+    space.ForEachShard(NULL, [&](SpaceBlock &block, int) {
+	for (int offset = 0; offset < block.size; offset++) {
+	  sum += block.columns[0][offset];
+	}
+      });
+  }
+  EXPECT_EQ(4950000, sum);
+  Space moved_space(std::move(space));
+  sum = 0;
+  std::vector<std::thread> threads;
+  for (int thread = 0; thread < 4; thread++) {
+    threads.push_back(std::thread([&]() {
+	  for (int pass = 0; pass < 100; pass++) {
+	    moved_space.ForEachShard(NULL, [&](SpaceBlock &block, int) {
+		sum += block.size;
+	      });
+	  }
+	}));
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(40000, sum);
+  sum = 0;
+  moved_space.ForEachShard(NULL, [&](SpaceBlock &, int) {
+      moved_space.ForEachShard(NULL, [&](SpaceBlock &block, int) {
+	  sum += block.size;
+	});
+    });
+  EXPECT_EQ(400, sum);
+}
+
+// Tests quantizing raw features into bin codes and releasing raw values.
+TEST(SpaceTest, TestQuantizeRawFeature) {
+  Space *space = new Space();
+  double values[5] = {-1.0, 0.5, 2.0, 0.0, 3.5};
+  for (int index = 0; index < 5; index++) {
+    Point *point = new Point(index);
+    point->AddRawFeature(values[index]);
+    point->AddRawFeature(index);
+    space->AddPoint(*point);
+  }
+  std::vector<double> thresholds;
+  thresholds.push_back(0.0);
+  thresholds.push_back(1.0);
+  thresholds.push_back(3.0);
+  EXPECT_EQ(-1, space->QuantizeRawFeature(0, thresholds));
+  space->Finalize();
+  EXPECT_FALSE(space->IsQuantized(0));
+  EXPECT_EQ(-1, space->GetBinCode(0, 0));
+  EXPECT_EQ(-1, space->QuantizeRawFeature(2, thresholds));
+  std::vector<double> unsorted(thresholds.rbegin(), thresholds.rend());
+  EXPECT_EQ(-1, space->QuantizeRawFeature(0, unsorted));
+  EXPECT_EQ(0, space->QuantizeRawFeature(0, thresholds));
+  EXPECT_TRUE(space->IsQuantized(0));
+  EXPECT_FALSE(space->IsQuantized(1));
+  int codes[5] = {0, 1, 2, 0, 3};
+  const uint8_t *column = space->BinCodes8(0);
+  EXPECT_TRUE(space->BinCodes16(0) == NULL);
+  for (int key = 0; key < 5; key++) {
+    EXPECT_EQ(codes[key], column[key]);
+    EXPECT_EQ(codes[key], space->GetBinCode(key, 0));
+    EXPECT_EQ(codes[key], space->GetPoint(key).GetBinCode(0));
+  }
+  EXPECT_EQ(1, space->FindBin(0, 1.0));
+  EXPECT_EQ(-1, space->FindBin(0, 2.0));
+  EXPECT_EQ(-1, space->FindBin(1, 1.0));
+  EXPECT_EQ(thresholds, space->BinThresholds(0));
+
+  std::vector<double> many_thresholds;
+  for (int index = 0; index < 300; index++) {
+    many_thresholds.push_back(index * 0.01);
+  }
+  EXPECT_EQ(0, space->QuantizeRawFeature(1, many_thresholds));
+  EXPECT_TRUE(space->BinCodes8(1) == NULL);
+  EXPECT_EQ(300, space->BinCodes16(1)[4]);
+  EXPECT_EQ(100, space->GetBinCode(1, 1));
+
+  space->ReleaseRawFeatureColumn(0);
+  EXPECT_TRUE(space->RawFeatureColumn(0) == NULL);
+  EXPECT_TRUE(isnan(space->GetPoint(1).GetRawFeature(0)));
+  EXPECT_EQ(1, space->GetPoint(1).GetBinCode(0));
+  EXPECT_NEAR(1.0, space->GetPoint(1).GetRawFeature(1), gTolerance);
+  EXPECT_EQ(-1, space->QuantizeRawFeature(0, thresholds));
+
+  Point *missing = new Point(5);
+  missing->AddRawFeature(1.0);
+  Space *missing_space = new Space();
+  missing_space->AddPoint(*missing);
+  missing_space->AddPoint(*(new Point(6)));
+  missing_space->Finalize();
+  EXPECT_EQ(-1, missing_space->QuantizeRawFeature(0, thresholds));
+  EXPECT_EQ(-1, missing->GetBinCode(0));
+}
+
+// Tests storing raw features sparsely.
+TEST(SpaceTest, TestSparsifyRawFeature) {
+  Space *space = new Space();
+  double values[5][2] = {{0.0, 1.0}, {2.0, 0.0}, {0.0, 0.0},
+			 {-1.5, 3.0}, {0.0, 4.0}};
+  for (int key = 0; key < 5; key++) {
+    Point *point = new Point(key);
+    point->AddRawFeature(values[key][0]);
+    point->AddRawFeature(values[key][1]);
+    space->AddPoint(*point);
+  }
+  EXPECT_EQ(-1, space->SparsifyRawFeature(0));
+  space->Finalize();
+  EXPECT_FALSE(space->IsSparse(0));
+  EXPECT_EQ(-1, space->SparsifyRawFeature(2));
+  EXPECT_EQ(0, space->SparsifyRawFeature(0));
+  EXPECT_TRUE(space->IsSparse(0));
+  EXPECT_FALSE(space->IsSparse(1));
+  EXPECT_TRUE(space->RawFeatureColumn(0) == NULL);
+  EXPECT_EQ(2, space->NumNonZeros(0));
+  EXPECT_EQ(1, space->SparseKeys(0)[0]);
+  EXPECT_EQ(3, space->SparseKeys(0)[1]);
+  EXPECT_NEAR(2.0, space->SparseValues(0)[0], gTolerance);
+  EXPECT_NEAR(-1.5, space->SparseValues(0)[1], gTolerance);
+  for (int key = 0; key < 5; key++) {
+    EXPECT_NEAR(values[key][0], space->GetPoint(key).GetRawFeature(0),
+		gTolerance);
+  }
+
+  std::vector<int> keys;
+  keys.push_back(0);
+  keys.push_back(3);
+  keys.push_back(4);
+  std::vector<double> gathered;
+  space->GatherRawFeature(0, keys, &gathered);
+  EXPECT_NEAR(0.0, gathered[0], gTolerance);
+  EXPECT_NEAR(-1.5, gathered[1], gTolerance);
+  EXPECT_NEAR(0.0, gathered[2], gTolerance);
+  space->GatherRawFeature(1, keys, &gathered);
+  EXPECT_NEAR(1.0, gathered[0], gTolerance);
+  EXPECT_NEAR(3.0, gathered[1], gTolerance);
+  EXPECT_NEAR(4.0, gathered[2], gTolerance);
+
+  EXPECT_EQ(1, space->Sparsify(0.5));
+  EXPECT_EQ(2, space->Sparsify(0.8));
+  EXPECT_EQ(3, space->NumNonZeros(1));
+
+  std::vector<double> thresholds;
+  thresholds.push_back(0.0);
+  thresholds.push_back(1.0);
+  EXPECT_EQ(0, space->QuantizeRawFeature(0, thresholds));
+  int codes[5] = {0, 2, 0, 0, 0};
+  for (int key = 0; key < 5; key++) {
+    EXPECT_EQ(codes[key], space->GetBinCode(key, 0));
+  }
+
+  space->ReleaseRawFeatureColumn(0);
+  EXPECT_FALSE(space->IsSparse(0));
+  EXPECT_TRUE(isnan(space->GetPoint(1).GetRawFeature(0)));
+  EXPECT_EQ(-1, space->SparsifyRawFeature(0));
+}
+
+// Tests that points with identical raw features are merged if
+// deduplication is enabled.
+TEST(SpaceTest, TestDeduplication) {
+  double values[6][2] = {{1.0, 2.0}, {0.5, 2.0}, {1.0, 2.0},
+			 {1.0, NAN}, {1.0, 2.0}, {1.0, NAN}};
+  Space *space = new Space();
+  EXPECT_EQ(0, space->EnableDeduplication());
+  int keys[6] = {0, 1, 0, 2, 0, 3};
+  for (int id = 0; id < 6; id++) {
+    Point *point = new Point(id);
+    point->AddRawFeature(values[id][0]);
+    point->AddRawFeature(values[id][1]);
+    point->SetProbWeight(0.5 * (id + 1));
+    EXPECT_EQ(keys[id], space->AddPoint(*point));
+  }
+  Point *short_point = new Point(6);
+  short_point->AddRawFeature(1.0);
+  EXPECT_EQ(4, space->AddPoint(*short_point));
+  space->Finalize();
+  EXPECT_EQ(5, space->NumPoints());
+  EXPECT_EQ(3, space->GetMultiplicity(0));
+  EXPECT_EQ(1, space->GetMultiplicity(1));
+  EXPECT_EQ(1, space->GetPoint(3).GetMultiplicity());
+  EXPECT_EQ(7, space->TotalMultiplicity());
+  EXPECT_EQ(0, space->GetPoint(0).GetId());
+  EXPECT_NEAR(4.5, space->GetProbWeight(0), gTolerance);
+  EXPECT_NEAR(1.0, space->GetProbWeight(1), gTolerance);
+  EXPECT_NEAR(11.5, space->TotalProbWeight(), gTolerance);
+  EXPECT_EQ(1, (new Point(7))->GetMultiplicity());
+
+  Space *other_space = new Space();
+  other_space->AddPoint(*(new Point(0)));
+  EXPECT_EQ(-1, other_space->EnableDeduplication());
+  other_space->AddPoint(*(new Point(1)));
+  EXPECT_EQ(2, other_space->NumPoints());
+}
+
+// Tests that deduplication finds equal points among many points added
+// from arrays, including zeros of either sign, and that a point with more
+// raw features than the points added before is not merged with them.
+TEST(SpaceTest, TestDeduplicationOfManyPoints) {
+  Space *space = new Space();
+  EXPECT_EQ(0, space->EnableDeduplication());
+  for (int id = 0; id < 1000; id++) {
+    double values[2] = {double(id % 37), double(id % 11)};
+    if (id % 2 == 1 && values[0] == 0.0) {
+      values[0] = -0.0;
+    }
+    EXPECT_EQ(id % 407, space->AddPoint(id, values, 2, 1.0));
+  }
+  double longer_values[3] = {0.0, 0.0, 0.0};
+  EXPECT_EQ(407, space->AddPoint(1000, longer_values, 3, 1.0));
+  EXPECT_EQ(408, space->AddPoint(1001, longer_values, 2, 1.0));
+  EXPECT_EQ(407, space->AddPoint(1002, longer_values, 3, 1.0));
+  space->Finalize();
+  EXPECT_EQ(409, space->NumPoints());
+  EXPECT_EQ(1003, space->TotalMultiplicity());
+  EXPECT_EQ(3, space->GetMultiplicity(0));
+  EXPECT_EQ(2, space->GetMultiplicity(406));
+  EXPECT_EQ(2, space->GetMultiplicity(407));
+  EXPECT_NEAR(1003.0, space->TotalProbWeight(), gTolerance);
+  delete space;
+}
+
+// Tests adding points from arrays of raw feature values.
+TEST(SpaceTest, TestAddPointFromValues) {
+  Space *space = new Space();
+  EXPECT_EQ(0, space->Reserve(3, 2));
+  double values[3][2] = {{1.0, 2.0}, {3.0, 4.0}, {5.0, 6.0}};
+  EXPECT_EQ(0, space->AddPoint(10, values[0], 1, 0.5));
+  EXPECT_EQ(1, space->AddPoint(11, values[1], 2, 1.0));
+  EXPECT_EQ(2, space->AddPoint(12, values[2], 2, 2.0));
+  space->Finalize();
+  EXPECT_EQ(-1, space->Reserve(4, 2));
+  EXPECT_EQ(-1, space->AddPoint(13, values[0], 2, 1.0));
+  EXPECT_EQ(3, space->NumPoints());
+  EXPECT_EQ(2, space->NumRawFeatures());
+  EXPECT_EQ(11, space->GetPoint(1).GetId());
+  EXPECT_NEAR(1.0, space->GetRawFeature(0, 0), gTolerance);
+  EXPECT_TRUE(isnan(space->GetRawFeature(0, 1)));
+  EXPECT_NEAR(6.0, space->GetRawFeature(2, 1), gTolerance);
+  EXPECT_NEAR(3.5, space->TotalProbWeight(), gTolerance);
+
+  Space *other_space = new Space();
+  EXPECT_EQ(0, other_space->AddPoint(space->GetPoint(2)));
+  other_space->Finalize();
+  EXPECT_EQ(12, other_space->GetPoint(0).GetId());
+  EXPECT_NEAR(5.0, other_space->GetPoint(0).GetRawFeature(0), gTolerance);
+  EXPECT_NEAR(2.0, other_space->GetPoint(0).GetProbWeight(), gTolerance);
+}
+
+// Tests that points of a moved space refer to the new space.
+TEST(SpaceTest, TestMoveSpace) {
+  Space space;
+  double values[2] = {1.0, 2.0};
+  space.AddPoint(0, values, 2, 1.0);
+  space.AddPoint(1, values + 1, 1, 3.0);
+  space.Finalize();
+  const double *column = space.RawFeatureColumn(0);
+  Space moved_space(std::move(space));
+  EXPECT_EQ(0, space.NumPoints());
+  EXPECT_EQ(2, moved_space.NumPoints());
+  EXPECT_EQ(column, moved_space.RawFeatureColumn(0));
+  Point &point = moved_space.GetPoint(1);
+  EXPECT_NEAR(2.0, point.GetRawFeature(0), gTolerance);
+  point.SetProbWeight(4.0);
+  EXPECT_NEAR(5.0, moved_space.TotalProbWeight(), gTolerance);
+  Space assigned_space;
+  assigned_space = std::move(moved_space);
+  EXPECT_NEAR(4.0, assigned_space.GetPoint(1).GetProbWeight(), gTolerance);
+  EXPECT_NEAR(2.0, assigned_space.GetPoint(0).GetRawFeature(1), gTolerance);
+}
@@ -1,5 +1,19 @@
 #include "tree.hpp"
 #include <cstddef>
+#include <cmath>
+#include <algorithm>
+
+// Constructor for a node. The node is a leaf with zero value
+// and no points or samples.
+Node::Node() {
+  feature = 0;
+  threshold = 0.0;
+  bin = -1;
+  value = 0.0;
+  left_child = NULL;
+  right_child = NULL;
+  weight = 0.0;
+}
 
 // Returns the value of this node.
 double Node::GetValue() {
@@ -26,6 +40,21 @@ Node *Node::GetRightChild() {
   return right_child;
 }
 
+// Returns the feature (index of a raw feature) of this node.
+int Node::GetFeature() {
+  return feature;
+}
+
+// Returns the threshold of this node.
+double Node::GetThreshold() {
+  return threshold;
+}
+
+// Returns the bin of the threshold of this node (or -1 if it is not set).
+int Node::GetBin() {
+  return bin;
+}
+
 // Sets threshold for this node to the given value.
 void Node::SetThreshold(double val) {
   threshold = val;
@@ -36,6 +65,12 @@ void Node::SetFeature(int index) {
   feature = index;
 }
 
+// Sets bin of the threshold of this node. Bins are only used for points
+// in a space that has the feature of this node quantized.
+void Node::SetBin(int val) {
+  bin = val;
+}
+
 // Sets left child of this node.
 void Node::SetLeftChild(Node *child) {
   left_child = child;
@@ -83,7 +118,33 @@ bool Node::IsLeaf() {
 // Returns the child of this node that contains given point.
 // NULL is returned if this node is a leaf.
 Node *Node::Child(Point *point) {
-  if (point->GetRawFeature(feature) < threshold) {
+  if (bin >= 0) {
+    int code = point->GetBinCode(feature);
+    if (code >= 0) {
+      return (code <= bin ? left_child : right_child);
+    }
+  }
+  if (point->GetRawFeature(feature) <= threshold) {
+    return left_child;
+  }
+  return right_child;
+}
+
+// Returns the child of this node that contains the point at the given
+// offset in a block of points (see Space::ForEachBlock). Value of the
+// feature is read from the block if the block provides it.
+Node *Node::Child(const SpaceBlock &block, int offset) {
+  int key = block.begin + offset;
+  if (bin >= 0) {
+    int code = block.space->GetBinCode(key, feature);
+    if (code >= 0) {
+      return (code <= bin ? left_child : right_child);
+    }
+  }
+  const double *column = block.RawFeatureColumn(feature);
+  double raw_value = (column != NULL ? column[offset] :
+		      block.space->GetRawFeature(key, feature));
+  if (raw_value <= threshold) {
     return left_child;
   }
   return right_child;
@@ -109,3 +170,186 @@ std::vector<Point*>::iterator Node::SamplesBegin() {
 std::vector<Point*>::iterator Node::SamplesEnd() {
   return samples.end();
 }
+
+// Number of points of a block evaluated together by FlatTree.
+static const int gTreeTileSize = 256;
+
+// Constructor for an empty flat tree that has a single leaf with zero
+// value.
+FlatTree::FlatTree() {
+  FlatNode leaf = {-1, -1, NAN, -1};
+  nodes.assign(1, leaf);
+  leaf_values.assign(1, 0.0);
+  depth = 0;
+}
+
+// Constructor for a flat tree compiled from the tree with the given root.
+// A leaf is stored as a node that leads to itself: its threshold is NAN,
+// so comparisons with it are false and points go to the node at left + 1.
+FlatTree::FlatTree(Node *root) {
+  depth = 0;
+  std::vector<Node*> level(1, root);
+  while (!level.empty()) {
+    std::vector<Node*> next_level;
+    int next_level_begin = nodes.size() + level.size();
+    for (Node *node : level) {
+      FlatNode flat_node = {-1, -1, NAN, int(nodes.size()) - 1};
+      if (!node->IsLeaf()) {
+	flat_node.feature = node->GetFeature();
+	flat_node.bin = node->GetBin();
+	flat_node.threshold = node->GetThreshold();
+	flat_node.left = next_level_begin + next_level.size();
+	next_level.push_back(node->GetLeftChild());
+	next_level.push_back(node->GetRightChild());
+      }
+      nodes.push_back(flat_node);
+      leaf_values.push_back(node->IsLeaf() ? node->GetValue() : 0.0);
+    }
+    if (!next_level.empty()) {
+      depth++;
+    }
+    level.swap(next_level);
+  }
+}
+
+// Returns the index of the child of the node at the given position that
+// contains the given point. Returns position itself for a leaf.
+int FlatTree::Child(int position, Point *point) const {
+  const FlatNode &node = nodes[position];
+  if (node.feature < 0) {
+    return position;
+  }
+  if (node.bin >= 0) {
+    int code = point->GetBinCode(node.feature);
+    if (code >= 0) {
+      return node.left + (code > node.bin);
+    }
+  }
+  return node.left + !(point->GetRawFeature(node.feature) <= node.threshold);
+}
+
+// Returns the index of the child of the node at the given position that
+// contains the point at the given offset in a block of points (see
+// Node::Child). Returns position itself for a leaf.
+int FlatTree::Child(int position, const SpaceBlock &block, int offset) const {
+  const FlatNode &node = nodes[position];
+  if (node.feature < 0) {
+    return position;
+  }
+  int key = block.begin + offset;
+  if (node.bin >= 0) {
+    int code = block.space->GetBinCode(key, node.feature);
+    if (code >= 0) {
+      return node.left + (code > node.bin);
+    }
+  }
+  const double *column = block.RawFeatureColumn(node.feature);
+  double raw_value = (column != NULL ? column[offset] :
+		      block.space->GetRawFeature(key, node.feature));
+  return node.left + !(raw_value <= node.threshold);
+}
+
+// Returns the value of this tree at the given point.
+double FlatTree::Evaluate(Point *point) const {
+  int position = 0;
+  for (int level = 0; level < depth; level++) {
+    position = Child(position, point);
+  }
+  return leaf_values[position];
+}
+
+// Stores the values of this tree at count given points in values.
+// Points are evaluated level by level a tile at a time and points a few
+// steps ahead are prefetched, since they are often scattered in memory.
+void FlatTree::EvaluateBatch(Point *const *points, int count,
+			     double *values) const {
+  static const int kPrefetchDistance = 8;
+  std::vector<int> positions(gTreeTileSize);
+  for (int start = 0; start < count; start += gTreeTileSize) {
+    int size = std::min(gTreeTileSize, count - start);
+    Point *const *tile = points + start;
+    std::fill(positions.begin(), positions.begin() + size, 0);
+    for (int level = 0; level < depth; level++) {
+      for (int i = 0; i < size; i++) {
+	if (i + kPrefetchDistance < size) {
+	  __builtin_prefetch(tile[i + kPrefetchDistance]);
+	}
+	positions[i] = Child(positions[i], tile[i]);
+      }
+    }
+    for (int i = 0; i < size; i++) {
+      values[start + i] = leaf_values[positions[i]];
+    }
+  }
+}
+
+// Stores the values of this tree at the points of the given block in
+// values. If the block provides raw values for all internal nodes and
+// none of them uses bin codes, a point descends one level without
+// branches: every node has a column of the block to compare against
+// (leaves use the weights, which compare false with their NAN thresholds
+// so that points stay at the leaf). Columns of the next tile are
+// prefetched (one cache line of 8 values at a time) while the current
+// one is evaluated.
+void FlatTree::EvaluateBlock(const SpaceBlock &block, double *values) const {
+  std::vector<const double*> columns(nodes.size());
+  std::vector<const double*> distinct_columns;
+  bool branchless = true;
+  for (unsigned position = 0; position < nodes.size(); position++) {
+    const FlatNode &node = nodes[position];
+    if (node.feature < 0) {
+      columns[position] = block.weights;
+      continue;
+    }
+    columns[position] = block.RawFeatureColumn(node.feature);
+    distinct_columns.push_back(columns[position]);
+    if (columns[position] == NULL ||
+	(node.bin >= 0 && block.space->IsQuantized(node.feature))) {
+      branchless = false;
+    }
+  }
+  std::sort(distinct_columns.begin(), distinct_columns.end());
+  distinct_columns.erase(std::unique(distinct_columns.begin(),
+				     distinct_columns.end()),
+			 distinct_columns.end());
+  std::vector<int> positions(gTreeTileSize);
+  for (int start = 0; start < block.size; start += gTreeTileSize) {
+    int size = std::min(gTreeTileSize, block.size - start);
+    std::fill(positions.begin(), positions.begin() + size, 0);
+    if (!branchless) {
+      for (int level = 0; level < depth; level++) {
+	for (int i = 0; i < size; i++) {
+	  positions[i] = Child(positions[i], block, start + i);
+	}
+      }
+    } else {
+      int next_end = std::min(start + 2 * gTreeTileSize, block.size);
+      for (const double *column : distinct_columns) {
+	for (int offset = start + size; offset < next_end; offset += 8) {
+	  __builtin_prefetch(column + offset);
+	}
+      }
+      for (int level = 0; level < depth; level++) {
+	for (int i = 0; i < size; i++) {
+	  const FlatNode &node = nodes[positions[i]];
+	  positions[i] = node.left +
+	    !(columns[positions[i]][start + i] <= node.threshold);
+	}
+      }
+    }
+    for (int i = 0; i < size; i++) {
+      values[start + i] = leaf_values[positions[i]];
+    }
+  }
+}
+
+// Returns the number of nodes of this tree.
+int FlatTree::NumNodes() const {
+  return nodes.size();
+}
+
+// Returns the depth of this tree (number of edges on the longest path
+// from the root to a leaf).
+int FlatTree::Depth() const {
+  return depth;
+}
@@ -9,16 +9,24 @@
 // contained in it and the value associated with it.
 // If node is an internal node then it will contain a binary question
 // (threshold, feature), as well as both left and right child.
+// If the feature is quantized, node may also store the bin of the
+// threshold, in which case points go to the left child iff their bin
+// code of the feature does not exceed this bin.
 // See tree_test.cpp and tree.cpp for sample usage.
 class Node {
 public:
+  Node();
   double GetValue();
   double GetPopulationWeight();
   int GetSampleCount();
   Node *GetLeftChild();
   Node *GetRightChild();
+  int GetFeature();
+  double GetThreshold();
+  int GetBin();
   void SetThreshold(double threshold);
   void SetFeature(int feature);
+  void SetBin(int bin);
   void SetLeftChild(Node *child);
   void SetRightChild(Node *child);
   void SetValue(double value);
@@ -32,9 +40,11 @@ public:
   void AddSample(Point *point);
   bool IsLeaf();
   Node *Child(Point *point);
+  Node *Child(const SpaceBlock &block, int offset);
 private:
   int feature;
   double threshold;
+  int bin; // bin of the threshold for quantized features (or -1)
   double value;
   Node *left_child;
   Node *right_child;
@@ -43,4 +53,40 @@ private:
   std::vector<Point*> samples;
 };
 
+// This class represents a decision tree compiled into contiguous arrays
+// for fast evaluation. Nodes are stored in breadth-first order and both
+// children of an internal node are stored next to each other, so a point
+// goes from node to nodes[left] or nodes[left + 1]. Values of leaves
+// are stored in a separate array. Points of a block are evaluated
+// a tile at a time and level by level: all points of the tile descend
+// one level before any of them descends further, which keeps the nodes
+// and raw feature values of the tile in cache and lets loads for
+// different points overlap.
+// The tree must not change once it is compiled.
+// Sample usage:
+//   FlatTree tree(root);
+//   tree.EvaluateBlock(block, values);
+class FlatTree {
+public:
+  FlatTree();
+  FlatTree(Node *root);
+  double Evaluate(Point *point) const;
+  void EvaluateBatch(Point *const *points, int count, double *values) const;
+  void EvaluateBlock(const SpaceBlock &block, double *values) const;
+  int NumNodes() const;
+  int Depth() const;
+private:
+  struct FlatNode {
+    int feature; // raw feature of an internal node (or -1 for a leaf)
+    int bin; // bin of the threshold for quantized features (or -1)
+    double threshold; // NAN for a leaf
+    int left; // index of the left child (index of the leaf minus 1 for a leaf)
+  };
+  int Child(int position, Point *point) const;
+  int Child(int position, const SpaceBlock &block, int offset) const;
+  std::vector<FlatNode> nodes;
+  std::vector<double> leaf_values; // values of leaves indexed as nodes
+  int depth; // number of edges on the longest path from the root
+};
+
 #endif
@@ -1,3 +1,4 @@
+#include <cmath>
 #include "gtest/gtest.h"
 #include "constants.hpp"
 #include "tree.hpp"
@@ -98,3 +99,155 @@ TEST(TreeTest, TestChildren) {
   point2->AddRawFeature(-2.0);
   EXPECT_EQ(right_child, node->Child(point2));
 }
+
+// Tests that points in a quantized space are routed using bin codes
+// whenever the node stores the bin of its threshold.
+TEST(TreeTest, TestChildWithBins) {
+  Node *node = new Node();
+  Node *left_child = new Node();
+  Node *right_child = new Node();
+  node->SetLeftChild(left_child);
+  node->SetRightChild(right_child);
+  node->SetFeature(0);
+  node->SetThreshold(0.5);
+  Space *space = new Space();
+  double values[3] = {0.0, 0.7, 1.5};
+  for (int index = 0; index < 3; index++) {
+    Point *point = new Point(index);
+    point->AddRawFeature(values[index]);
+    space->AddPoint(*point);
+  }
+  space->Finalize();
+  std::vector<double> thresholds;
+  thresholds.push_back(0.5);
+  thresholds.push_back(1.0);
+  space->QuantizeRawFeature(0, thresholds);
+  node->SetBin(0);
+  EXPECT_EQ(left_child, node->Child(&(space->GetPoint(0))));
+  EXPECT_EQ(right_child, node->Child(&(space->GetPoint(1))));
+  EXPECT_EQ(right_child, node->Child(&(space->GetPoint(2))));
+  space->ReleaseRawFeatureColumn(0);
+  node->SetThreshold(1.0);
+  node->SetBin(1);
+  EXPECT_EQ(left_child, node->Child(&(space->GetPoint(0))));
+  EXPECT_EQ(left_child, node->Child(&(space->GetPoint(1))));
+  EXPECT_EQ(right_child, node->Child(&(space->GetPoint(2))));
+  Point *point = new Point(3);
+  point->AddRawFeature(0.7);
+  EXPECT_EQ(left_child, node->Child(point));
+}
+
+// Tests that a point whose raw value equals the threshold of a node goes
+// to the left child both in a quantized and in a raw space, whether it
+// is routed by the node or by a flat tree, one point or a block at a time.
+TEST(TreeTest, TestChildAtThreshold) {
+  Node *root = new Node();
+  root->SetFeature(0);
+  root->SetThreshold(0.5);
+  root->SetLeftChild(new Node());
+  root->SetRightChild(new Node());
+  root->GetLeftChild()->SetValue(1.0);
+  root->GetRightChild()->SetValue(2.0);
+  std::vector<double> thresholds;
+  thresholds.push_back(0.5);
+  thresholds.push_back(1.0);
+  double values[3] = {0.25, 0.5, 0.75};
+  for (int quantized = 0; quantized < 2; quantized++) {
+    Space *space = new Space();
+    for (int key = 0; key < 3; key++) {
+      space->AddPoint(key, values + key, 1, 1.0);
+    }
+    space->Finalize();
+    if (quantized) {
+      EXPECT_EQ(0, space->QuantizeRawFeature(0, thresholds));
+      EXPECT_EQ(0, space->FindBin(0, 0.5));
+      root->SetBin(0);
+    }
+    FlatTree flat_tree(root);
+    std::vector<double> block_values(3);
+    space->ForEachBlock(NULL, [&](SpaceBlock &block) {
+	for (int offset = 0; offset < block.size; offset++) {
+	  EXPECT_EQ(block.begin + offset == 2 ? root->GetRightChild() :
+		    root->GetLeftChild(), root->Child(block, offset));
+	}
+	flat_tree.EvaluateBlock(block, block_values.data() + block.begin);
+      });
+    for (int key = 0; key < 3; key++) {
+      Point *point = &(space->GetPoint(key));
+      double value = (key == 2 ? 2.0 : 1.0);
+      EXPECT_EQ(value == 1.0 ? root->GetLeftChild() : root->GetRightChild(),
+		root->Child(point));
+      EXPECT_EQ(value, flat_tree.Evaluate(point));
+      EXPECT_EQ(value, block_values[key]);
+    }
+    delete space;
+  }
+}
+
+// Returns the value of the tree with the given root at the given point.
+static double TreeValue(Node *root, Point *point) {
+  Node *node = root;
+  while (!node->IsLeaf()) {
+    node = node->Child(point);
+  }
+  return node->GetValue();
+}
+
+// Tests that a flat tree compiled from a tree has the same values as
+// the tree at single points, batches of points and blocks of a space,
+// both with raw values and with bin codes of quantized features.
+TEST(TreeTest, TestFlatTree) {
+  Node *root = new Node();
+  root->SetFeature(0);
+  root->SetThreshold(0.5);
+  root->SetLeftChild(new Node());
+  root->SetRightChild(new Node());
+  root->GetLeftChild()->SetValue(1.0);
+  Node *right_child = root->GetRightChild();
+  right_child->SetFeature(1);
+  right_child->SetThreshold(0.3);
+  right_child->SetLeftChild(new Node());
+  right_child->SetRightChild(new Node());
+  right_child->GetLeftChild()->SetValue(2.0);
+  right_child->GetRightChild()->SetValue(3.0);
+  EXPECT_EQ(1, FlatTree().NumNodes());
+  EXPECT_NEAR(0.0, FlatTree().Evaluate(new Point(0)), gTolerance);
+  FlatTree flat_tree(root);
+  EXPECT_EQ(5, flat_tree.NumNodes());
+  EXPECT_EQ(2, flat_tree.Depth());
+
+  Space *space = new Space();
+  for (int key = 0; key < 600; key++) {
+    double values[2] = {(key % 10) * 0.1, (key % 7) * 0.1};
+    if (key == 123) {
+      values[0] = NAN;
+    }
+    space->AddPoint(key, values, 2, 1.0);
+  }
+  space->Finalize();
+  for (int quantized = 0; quantized < 2; quantized++) {
+    if (quantized) {
+      space->QuantizeRawFeature(1, std::vector<double>(1, 0.3));
+      right_child->SetBin(0);
+      flat_tree = FlatTree(root);
+    }
+    std::vector<Example> points;
+    for (int key = 0; key < space->NumPoints(); key++) {
+      points.push_back(&(space->GetPoint(key)));
+    }
+    std::vector<double> batch_values(points.size());
+    flat_tree.EvaluateBatch(points.data(), points.size(),
+			    batch_values.data());
+    std::vector<double> block_values(points.size());
+    space->ForEachBlock(NULL, [&](SpaceBlock &block) {
+	flat_tree.EvaluateBlock(block, block_values.data() + block.begin);
+      });
+    for (int key = 0; key < space->NumPoints(); key++) {
+      double value = TreeValue(root, points[key]);
+      EXPECT_EQ(value, flat_tree.Evaluate(points[key]));
+      EXPECT_EQ(value, batch_values[key]);
+      EXPECT_EQ(value, block_values[key]);
+    }
+    EXPECT_EQ(3.0, batch_values[123]);
+  }
+}
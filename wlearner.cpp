@@ -1,10 +1,13 @@
 #include <queue>
 #include <cmath>
 #include <map>
+#include <algorithm>
+#include <iterator>
 #include "constants.hpp"
 #include "wlearner.hpp"
 #include "space.hpp"
 #include "feature.hpp"
+#include "kernels.hpp"
 #include "tree.hpp"
 
 // Trains and returns a new Tree Feature based on given
@@ -13,6 +16,7 @@
 // to correct values. The gradient of the trained feature is also returned.
 void TreeLearner::Train(Space &space, Sample &sample,
 			Feature **feature, double *tree_gradient) {
+  training_space = &space;
   Node *root = new Node();
   for (auto &point : space) {
     root->AddPoint(&point);
@@ -24,7 +28,7 @@ void TreeLearner::Train(Space &space, Sample &sample,
   double old_diff = 0.0;
   int tree_size = 1;
   double old_gradient = 0.0;
-  double normalizer = root->GetPopulationWeight();
+  double normalizer = space.TotalProbWeight();
   std::queue<Node*> q;
   q.push(root);
   while (!q.empty()) {
@@ -67,6 +71,7 @@ void TreeLearner::Train(Space &space, Sample &sample,
   *tree_gradient = old_gradient;
   TreeFeature* tfeature = new TreeFeature(root);
   tfeature->ComputeTreeExpectations();
+  tfeature->Compact(space);
   tfeature->SetComplexity(TreeComplexity(tree_size, sample.size()));
   *feature = tfeature;
 }
@@ -148,9 +153,12 @@ double TreeLearner::TreeComplexity(int tree_size, int sample_size) {
 // The value of the left child is given and the value of the right one
 // one minus that value.
 // Node also updates its threshold and raw feature to the specified ones.
-// All samples and points stored in this node with raw feature less than
+// All samples and points stored in this node with raw feature at most
 // the threshold are moved to the left child and the rest are moved to
-// the left child.
+// the left child. If the raw feature is quantized in the training space
+// the node also stores the bin of the threshold and bin codes are used.
+// Otherwise, if the training space is chunked, values of the raw feature
+// at points and samples of the node are read from the space at once.
 void TreeLearner::GrowTree(Node *node, double threshold,
 			   int feature_index, int left_val,
 			   Node **left_child, Node **right_child) {
@@ -158,14 +166,27 @@ void TreeLearner::GrowTree(Node *node, double threshold,
   *right_child = new Node();
   node->SetThreshold(threshold);
   node->SetFeature(feature_index);
+  node->SetBin(ThresholdBin(feature_index, threshold));
   node->SetLeftChild(*left_child);
   node->SetRightChild(*right_child);
   (*left_child)->SetValue(left_val);
   (*right_child)->SetValue(1-left_val);
+  std::vector<double> values;
+  std::vector<double> sample_values;
+  bool gathered = (training_space != NULL && training_space->IsChunked() &&
+		   !training_space->IsQuantized(feature_index));
+  if (gathered) {
+    GatherRawFeature(node->PointsBegin(), node->PointsEnd(), feature_index,
+		     &values);
+    GatherRawFeature(node->SamplesBegin(), node->SamplesEnd(), feature_index,
+		     &sample_values);
+  }
   for (std::vector<Point*>::iterator it = node->PointsBegin();
        it != node->PointsEnd(); it++) {
     Point *point = *it;
-    if (point->GetRawFeature(feature_index) < threshold) {
+    bool left = (gathered ? values[it - node->PointsBegin()] <= threshold :
+		 node->Child(point) == *left_child);
+    if (left) {
       (*left_child)->AddPoint(point);
     } else {
       (*right_child)->AddPoint(point);
@@ -174,7 +195,10 @@ void TreeLearner::GrowTree(Node *node, double threshold,
   for (std::vector<Point*>::iterator it = node->SamplesBegin();
        it != node->SamplesEnd(); it++) {
     Point *point = *it;
-    if (point->GetRawFeature(feature_index) < threshold) {
+    bool left = (gathered ?
+		 sample_values[it - node->SamplesBegin()] <= threshold :
+		 node->Child(point) == *left_child);
+    if (left) {
       (*left_child)->AddSample(point);
     } else {
       (*right_child)->AddSample(point);
@@ -189,24 +213,115 @@ void TreeLearner::GrowTree(Node *node, double threshold,
 // at a given index between this threshold the next smallest one. The count
 // is the total number of sample points in this node with a feature at
 // a given index between this threshold the next smallest one.
+// If the raw feature is quantized in the training space, weights and
+// counts are first accumulated per bin code of the points (which avoids
+// looking up every raw value in value_to_thresholds) and bin b is mapped
+// to the b-th quantization threshold (or infinity for the last bin).
+// Otherwise, if the training space is chunked, values of the raw feature
+// at points and samples of the node are read from the space at once.
 std::map<double, std::pair<double, int> >
 TreeLearner::BuildThresholdToWeightsMap(Node *node, int index) {
   std::map<double, std::pair<double, int> > threshold_to_weights;
+  bool quantized = (training_space != NULL &&
+		    training_space->IsQuantized(index));
+  int num_bins = (quantized ?
+		  training_space->BinThresholds(index).size() + 1 : 0);
+  std::vector<std::pair<double, int> > bin_to_weights(num_bins);
+  std::vector<bool> bin_is_used(num_bins, false);
+  std::vector<double> values;
+  std::vector<double> sample_values;
+  bool gathered = (!quantized && training_space != NULL &&
+		   training_space->IsChunked());
+  if (gathered) {
+    GatherRawFeature(node->PointsBegin(), node->PointsEnd(), index, &values);
+    GatherRawFeature(node->SamplesBegin(), node->SamplesEnd(), index,
+		     &sample_values);
+  }
   for (std::vector<Point*>::iterator it = node->PointsBegin();
        it != node->PointsEnd(); it++) {
     Point *point = *it;
-    threshold_to_weights[value_to_thresholds
-			 [index][point->GetRawFeature(index)]].first +=
+    int code = (quantized ? point->GetBinCode(index) : -1);
+    if (code >= 0) {
+      bin_to_weights[code].first += point->GetProbWeight();
+      bin_is_used[code] = true;
+      continue;
+    }
+    double value = (gathered ? values[it - node->PointsBegin()] :
+		    point->GetRawFeature(index));
+    threshold_to_weights[value_to_thresholds[index][value]].first +=
       point->GetProbWeight();
   }
   for (std::vector<Point*>::iterator it = node->SamplesBegin();
        it != node->SamplesEnd(); it++) {
     Point *point = *it;
-    threshold_to_weights[value_to_thresholds
-			 [index][point->GetRawFeature(index)]].second += 1;
+    int code = (quantized ? point->GetBinCode(index) : -1);
+    if (code >= 0) {
+      bin_to_weights[code].second += 1;
+      bin_is_used[code] = true;
+      continue;
+    }
+    double value = (gathered ? sample_values[it - node->SamplesBegin()] :
+		    point->GetRawFeature(index));
+    threshold_to_weights[value_to_thresholds[index][value]].second += 1;
+  }
+  for (int code = 0; code < num_bins; code++) {
+    if (bin_is_used[code]) {
+      double threshold = (code < num_bins - 1 ?
+			  training_space->BinThresholds(index)[code] :
+			  INFINITY);
+      threshold_to_weights[threshold].first += bin_to_weights[code].first;
+      threshold_to_weights[threshold].second += bin_to_weights[code].second;
+    }
   }
   return threshold_to_weights;
-} 
+}
+
+// Stores values of the raw feature at a given index at the points in
+// [begin, end) (in the order of the points) in values. The points need to
+// be points of the training space. Values are read from the training space
+// in a single pass over the keys of the points in ascending order (keys of
+// points of a node are already ascending, keys of samples are sorted).
+void TreeLearner::GatherRawFeature(std::vector<Point*>::iterator begin,
+				   std::vector<Point*>::iterator end,
+				   int index, std::vector<double> *values) {
+  std::vector<int> keys;
+  for (std::vector<Point*>::iterator it = begin; it != end; it++) {
+    keys.push_back((*it)->GetKey());
+  }
+  if (std::is_sorted(keys.begin(), keys.end())) {
+    training_space->GatherRawFeature(index, keys, values);
+    return;
+  }
+  std::vector<int> order(keys.size());
+  for (unsigned i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(),
+	    [&](int a, int b) { return keys[a] < keys[b]; });
+  std::vector<int> sorted_keys;
+  for (int position : order) {
+    sorted_keys.push_back(keys[position]);
+  }
+  std::vector<double> sorted_values;
+  training_space->GatherRawFeature(index, sorted_keys, &sorted_values);
+  values->resize(keys.size());
+  for (unsigned i = 0; i < order.size(); i++) {
+    (*values)[order[i]] = sorted_values[i];
+  }
+}
+
+// Returns the bin of the given threshold of the raw feature at a given
+// index if this raw feature is quantized in the training space and -1
+// otherwise. Infinite threshold corresponds to the last bin.
+int TreeLearner::ThresholdBin(int index, double threshold) {
+  if (training_space == NULL || !training_space->IsQuantized(index)) {
+    return -1;
+  }
+  if (std::isinf(threshold)) {
+    return training_space->BinThresholds(index).size();
+  }
+  return training_space->FindBin(index, threshold);
+}
 
 // Constructs Tree Learner with specified parameters
 TreeLearner::TreeLearner(int n_features, double alpha, double beta,
@@ -215,6 +330,7 @@ TreeLearner::TreeLearner(int n_features, double alpha, double beta,
   model_parameter_alpha = alpha;
   model_parameter_beta = beta;
   value_to_thresholds = vtot;
+  training_space = NULL;
 }
 
 // Trains and returns a new Monomial Feature based on given
@@ -224,17 +340,16 @@ TreeLearner::TreeLearner(int n_features, double alpha, double beta,
 void MonomialLearner::Train(Space &space, Sample &sample,
 			    Feature **feature, double *monomial_gradient) {
   std::vector<int> monomial(num_features);
-  std::vector<double> point_values;
-  double normalizer = 0.0;
+  Span<double> weights = space.ProbWeights();
+  std::vector<double> point_values(weights.begin(), weights.end());
+  double normalizer = space.TotalProbWeight();
   double best_gradient = 0.0;
   double monomial_population_expectation;
   double monomial_sample_expectation;
   int power = 0;
-  for (auto &point : space) {
-    point_values.push_back(point.GetProbWeight());
-    normalizer += point.GetProbWeight();
-  }
   std::vector<double> sample_values(sample.size(), 1.0);
+  sparse_support = false;
+  support.clear();
 
   bool stop = false;
   while (!stop) {
@@ -253,12 +368,8 @@ void MonomialLearner::Train(Space &space, Sample &sample,
       monomial_sample_expectation = candidate_sample_expectation;
       monomial[candidate_feature] += 1;
       power += 1;
+      MultiplyPointValues(space, candidate_feature, &point_values);
       int index = 0;
-      for (auto &point : space) {
-	point_values[index] *= point.GetRawFeature(candidate_feature);
-	index++;
-      }
-      index = 0;
       for (auto point : sample) {
 	sample_values[index] *= point->GetRawFeature(candidate_feature);
 	index++;
@@ -273,6 +384,47 @@ void MonomialLearner::Train(Space &space, Sample &sample,
     *monomial_gradient = best_gradient;
     *feature = mfeature;
   }
+  sparse_support = false;
+  support.clear();
+}
+
+// Multiplies values of the monomial at each space point by the values of
+// the specified raw feature. Once a sparse raw feature is multiplied in,
+// the monomial is zero outside of its non-zeros and only point values
+// at these points (stored in support) are maintained from then on.
+void MonomialLearner::MultiplyPointValues(Space &space, int feature,
+					  std::vector<double> *point_values) {
+  if (space.IsSparse(feature)) {
+    const int *keys = space.SparseKeys(feature);
+    int num_non_zeros = space.NumNonZeros(feature);
+    if (!sparse_support) {
+      support.assign(keys, keys + num_non_zeros);
+      sparse_support = true;
+    } else {
+      std::vector<int> intersection;
+      std::set_intersection(support.begin(), support.end(),
+			    keys, keys + num_non_zeros,
+			    std::back_inserter(intersection));
+      support.swap(intersection);
+    }
+  }
+  if (sparse_support) {
+    std::vector<double> values;
+    space.GatherRawFeature(feature, support, &values);
+    for (unsigned i = 0; i < support.size(); i++) {
+      (*point_values)[support[i]] *= values[i];
+    }
+    return;
+  }
+  std::vector<int> indices(1, feature);
+  space.ForEachShard(&indices, [&](SpaceBlock &block, int) {
+      const double *column = block.columns[feature];
+      for (int offset = 0; offset < block.size; offset++) {
+	int key = block.begin + offset;
+	(*point_values)[key] *= (column != NULL ? column[offset] :
+				 space.GetRawFeature(key, feature));
+      }
+    });
 }
 
 // Returns the value of the gradient of the structural maxent
@@ -303,7 +455,10 @@ double MonomialLearner::MonomialComplexity(int power, int sample_size) {
 // sample_values). Note that point values need to be weighted by
 // by the corresponding (unnormalized) point weights.
 // The computation also requires the current power of monomial
-// and normalizer for point weights.
+// and normalizer for point weights. Only non-zeros of sparse raw features
+// (and only points in support of the monomial during training) are visited.
+// Dense raw features are all streamed in a single pass over the space
+// (with shards of a sharded space processed in parallel).
 // The results (best gradient and feature) are returned via pointers.
 void MonomialLearner::BestFeature(const std::vector<double> &point_values,
 				  const std::vector<double> &sample_values,
@@ -317,16 +472,57 @@ void MonomialLearner::BestFeature(const std::vector<double> &point_values,
     *candidate_feature = 0;
     *candidate_population_expectation = 0.0;
     *candidate_sample_expectation = 0.0;
+    std::vector<std::vector<double> >
+      shard_expectations(space.NumShards(),
+			 std::vector<double>(num_features, 0.0));
+    std::vector<int> dense_features;
+    for (int feature = 0; feature < num_features; feature++) {
+      if (!sparse_support && !space.IsSparse(feature)) {
+	dense_features.push_back(feature);
+      }
+    }
+    if (!dense_features.empty()) {
+      space.ForEachShard(&dense_features, [&](SpaceBlock &block, int shard) {
+	  for (int feature : dense_features) {
+	    const double *column = block.columns[feature];
+	    double expectation = shard_expectations[shard][feature];
+	    if (column != NULL) {
+	      expectation += WeightedSum(point_values.data() + block.begin,
+					 column, block.size);
+	    } else {
+	      for (int offset = 0; offset < block.size; offset++) {
+		int key = block.begin + offset;
+		expectation += (point_values[key] *
+				space.GetRawFeature(key, feature));
+	      }
+	    }
+	    shard_expectations[shard][feature] = expectation;
+	  }
+	});
+    }
     for (int feature = 0; feature < num_features; feature++) {
       double population_expectation = 0.0;
-      int index = 0;
-      for (auto &point : space) {
-	population_expectation += point_values[index] *
-	  point.GetRawFeature(feature);
-	index++;
+      if (sparse_support) {
+	std::vector<double> values;
+	space.GatherRawFeature(feature, support, &values);
+	for (unsigned i = 0; i < support.size(); i++) {
+	  population_expectation += point_values[support[i]] * values[i];
+	}
+      } else if (space.IsSparse(feature)) {
+	const int *keys = space.SparseKeys(feature);
+	const double *values = space.SparseValues(feature);
+	for (int i = 0; i < space.NumNonZeros(feature); i++) {
+	  population_expectation += point_values[keys[i]] * values[i];
+	}
+      } else {
+	std::vector<double> partials;
+	for (auto &expectations : shard_expectations) {
+	  partials.push_back(expectations[feature]);
+	}
+	population_expectation = SumShardPartials(partials);
       }
       population_expectation /= normalizer;
-      index = 0;
+      int index = 0;
       double sample_expectation = 0.0;
       for (auto point : sample) {
 	sample_expectation += sample_values[index] *
@@ -352,4 +548,5 @@ MonomialLearner::MonomialLearner(int n_features, double alpha, double beta,
   model_parameter_alpha = alpha;
   model_parameter_beta = beta;
   feature_bound = bound;
+  sparse_support = false;
 }
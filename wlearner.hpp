@@ -8,6 +8,12 @@
 
 // This is an abstract class that represents a generic weak learner.
 // The main purpose of weak learners is to train feature maps.
+// Train does not modify the space or the sample, but it may modify
+// the learner itself (e.g. TreeLearner stores the training space and
+// MonomialLearner its current support). Different learners are trained
+// concurrently on the same space (see DMaxEntModel), which is only safe
+// as long as every learner is a separate object and learners share no
+// mutable state with each other.
 class WLearner{
 public:
   virtual void Train(Space &space, Sample &sample,
@@ -24,6 +30,8 @@ public:
 // are regularization parameters for structural maxent model and
 // vtot is a vector of maps from feature values to thresholds.
 // Each value is mapped to the next largest threshold for this feature.
+// If a raw feature is quantized in the space used for training, bin codes
+// of this feature and thresholds used to quantize it are used instead.
 // This class also provides a number of auxillilary methods used in
 // training. For further details consult wlearner.cpp.
 class TreeLearner : public WLearner{
@@ -48,6 +56,11 @@ private:
   double model_parameter_alpha;
   double model_parameter_beta;
   std::vector< std::map<double, double> > value_to_thresholds;
+  Space *training_space; // space of the last call to Train (or NULL)
+  int ThresholdBin(int index, double threshold);
+  void GatherRawFeature(std::vector<Point*>::iterator begin,
+			std::vector<Point*>::iterator end, int index,
+			std::vector<double> *values);
 };
 
 class MonomialLearner : public WLearner{
@@ -69,6 +82,13 @@ private:
   double model_parameter_alpha;
   double model_parameter_beta;
   double feature_bound;
+  // While sparse_support is set the monomial being trained is known to be
+  // zero outside of points with keys in support and point values of other
+  // points are neither read nor updated.
+  bool sparse_support;
+  std::vector<int> support;
+  void MultiplyPointValues(Space &space, int feature,
+			   std::vector<double> *point_values);
 };
 
 #endif 
@@ -1,4 +1,6 @@
 #include <map>
+#include <cstdio>
+#include <string>
 #include "gtest/gtest.h"
 #include "wlearner.hpp"
 #include "constants.hpp"
@@ -268,7 +270,8 @@ TEST_F(TreeLearnerTest, TestBuildThresholdToWeightsMap) {
   EXPECT_EQ(0, ttow[124].second);
 }
 
-// Tests that growing tree is performed correctly.
+// Tests that growing tree is performed correctly. Points and samples with
+// raw feature equal to the threshold (point 3) go to the left child.
 TEST_F(TreeLearnerTest, TestGrowTree) {
   tlearner = new TreeLearner(4, 0.5, 0.1, vtot);
   Node *left_child;
@@ -278,7 +281,9 @@ TEST_F(TreeLearnerTest, TestGrowTree) {
   EXPECT_NEAR(0.0, right_child->GetValue(), gTolerance);
   EXPECT_EQ(node->PointsBegin(), node->PointsEnd());
   EXPECT_EQ(node->SamplesBegin(), node->SamplesEnd());
-  int left_ids[6] = {1, 2, 5, 6, 9, 10};
+  EXPECT_EQ(7, left_child->PointsEnd() - left_child->PointsBegin());
+  EXPECT_EQ(4, left_child->SamplesEnd() - left_child->SamplesBegin());
+  int left_ids[7] = {1, 2, 3, 5, 6, 9, 10};
   int i = 0;
   for (std::vector<Point*>::iterator it = left_child->PointsBegin();
        it != left_child->PointsEnd(); it++) {
@@ -286,7 +291,7 @@ TEST_F(TreeLearnerTest, TestGrowTree) {
     EXPECT_EQ(left_ids[i], point->GetId());
     i++;
   }
-  int right_ids[6] = {3, 4, 7, 8, 11, 12};
+  int right_ids[5] = {4, 7, 8, 11, 12};
   i = 0;
   for (std::vector<Point*>::iterator it = right_child->PointsBegin();
        it != right_child->PointsEnd(); it++) {
@@ -294,7 +299,7 @@ TEST_F(TreeLearnerTest, TestGrowTree) {
     EXPECT_EQ(right_ids[i], point->GetId());
     i++;
   }
-  int left_sample_ids[3] = {6, 6, 10};
+  int left_sample_ids[4] = {3, 6, 6, 10};
   i = 0;
   for (std::vector<Point*>::iterator it = left_child->SamplesBegin();
        it != left_child->SamplesEnd(); it++) {
@@ -302,7 +307,7 @@ TEST_F(TreeLearnerTest, TestGrowTree) {
     EXPECT_EQ(left_sample_ids[i], point->GetId());
     i++;
   }
-  int right_sample_ids[5] = {3, 7, 7, 8, 11};
+  int right_sample_ids[4] = {7, 7, 8, 11};
   i = 0;
   for (std::vector<Point*>::iterator it = right_child->SamplesBegin();
        it != right_child->SamplesEnd(); it++) {
@@ -421,6 +426,21 @@ TEST_F(TreeLearnerTest, TestTrain) {
   EXPECT_NEAR(0.31561580448702714, gradient, gTolerance);
   EXPECT_NEAR(3.1527052655830015, feature->Complexity(), gTolerance);
   EXPECT_EQ(3, dynamic_cast<TreeFeature*>(feature)->TreeSize());
+  // Leaves of trained trees are 0 or 1, so values at points of the space
+  // are kept as bits and agree with the tree.
+  EXPECT_TRUE(feature->IsPacked(*space));
+  std::vector<double> packed_values(space->NumPoints());
+  std::vector<int> indices;
+  space->ForEachBlock(&indices, [&](SpaceBlock &block) {
+      feature->FeatureMapBlock(block, packed_values.data() + block.begin);
+    });
+  for (int key = 0; key < space->NumPoints(); key++) {
+    EXPECT_EQ(feature->FeatureMap(&(space->GetPoint(key))),
+	      packed_values[key]);
+  }
+  feature->ComputeUnnormalizedPopulationExpectation(*space);
+  EXPECT_NEAR(6.0, feature->GetUnnormalizedPopulationExpectation(),
+	      gTolerance);
 
   vtot.clear();
   std::map<double, double> feature_map;
@@ -469,6 +489,73 @@ TEST_F(TreeLearnerTest, TestTrain) {
   EXPECT_EQ(5, dynamic_cast<TreeFeature*>(feature)->TreeSize());
 }
 
+// Tests that Tree Learner trains the same tree feature when raw features
+// are quantized with the thresholds of value to threshold maps and raw
+// values are released.
+TEST_F(TreeLearnerTest, TestTrainOnQuantizedSpace) {
+  for (int index = 0; index < 4; index++) {
+    std::vector<double> thresholds;
+    for (auto &value_threshold : vtot[index]) {
+      if (thresholds.empty() || thresholds.back() != value_threshold.second) {
+	thresholds.push_back(value_threshold.second);
+      }
+    }
+    EXPECT_EQ(0, space->QuantizeRawFeature(index, thresholds));
+    space->ReleaseRawFeatureColumn(index);
+  }
+  sample.clear();
+  int sample_keys[8] = {2, 5, 5, 6, 6, 7, 9, 10};
+  for (int key : sample_keys) {
+    sample.push_back(&(space->GetPoint(key)));
+  }
+  tlearner = new TreeLearner(4, 0.01, 0.01, vtot);
+  double gradient;
+  Feature *feature;
+  tlearner->Train(*space, sample, &feature, &gradient);
+  EXPECT_NEAR(0.5, feature->GetSampleExpectation(), gTolerance);
+  EXPECT_NEAR(6.0, feature->GetUnnormalizedPopulationExpectation(),
+	      gTolerance);
+  EXPECT_NEAR(0.31561580448702714, gradient, gTolerance);
+  EXPECT_NEAR(3.1527052655830015, feature->Complexity(), gTolerance);
+  EXPECT_EQ(3, dynamic_cast<TreeFeature*>(feature)->TreeSize());
+  feature->ComputeUnnormalizedPopulationExpectation(*space);
+  EXPECT_NEAR(6.0, feature->GetUnnormalizedPopulationExpectation(),
+	      gTolerance);
+}
+
+// Tests that Tree Learner trains the same tree feature on the space saved
+// to a file and opened as a chunked space, with sample points in any order.
+TEST_F(TreeLearnerTest, TestTrainOnChunkedSpace) {
+  std::string filename = "wlearner_test.bin";
+  EXPECT_EQ(0, space->WriteBinary(filename, std::vector<int>(12, 1)));
+  Space *chunked_space = new Space();
+  std::vector<int> counts;
+  EXPECT_EQ(0, chunked_space->OpenChunked(filename, 5, &counts));
+  for (int key = 0; key < 12; key++) {
+    chunked_space->SetProbWeight(key, space->GetProbWeight(key));
+  }
+  sample.clear();
+  int sample_keys[8] = {9, 5, 2, 6, 10, 5, 7, 6};
+  for (int key : sample_keys) {
+    sample.push_back(&(chunked_space->GetPoint(key)));
+  }
+  tlearner = new TreeLearner(4, 0.01, 0.01, vtot);
+  double gradient;
+  Feature *feature;
+  tlearner->Train(*chunked_space, sample, &feature, &gradient);
+  EXPECT_NEAR(0.5, feature->GetSampleExpectation(), gTolerance);
+  EXPECT_NEAR(6.0, feature->GetUnnormalizedPopulationExpectation(),
+	      gTolerance);
+  EXPECT_NEAR(0.31561580448702714, gradient, gTolerance);
+  EXPECT_NEAR(3.1527052655830015, feature->Complexity(), gTolerance);
+  EXPECT_EQ(3, dynamic_cast<TreeFeature*>(feature)->TreeSize());
+  feature->ComputeUnnormalizedPopulationExpectation(*chunked_space);
+  EXPECT_NEAR(6.0, feature->GetUnnormalizedPopulationExpectation(),
+	      gTolerance);
+  delete chunked_space;
+  std::remove(filename.c_str());
+}
+
 class MonomialLearnerTest : public ::testing::Test {
 protected:
   virtual void SetUp() {
@@ -643,3 +730,19 @@ TEST_F(MonomialLearnerTest, TestTrain) {
  EXPECT_NEAR(1, feature->FeatureMap(test_point2), gTolerance);
  EXPECT_NEAR(2, feature->FeatureMap(test_point3), gTolerance);
 }
+
+// Tests that training monomial feature over a space with sparse raw
+// features gives the same monomial as over the dense space.
+TEST_F(MonomialLearnerTest, TestTrainOnSparseSpace) {
+  space->SparsifyRawFeature(1);
+  space->SparsifyRawFeature(2);
+  mlearner = new MonomialLearner(3, 0.1, 0.01, 1.0);
+  Feature *feature;
+  double gradient;
+  mlearner->Train(*space, sample, &feature, &gradient);
+  EXPECT_NEAR(0.16897040093882765, gradient, gTolerance);
+  EXPECT_EQ(2, dynamic_cast<MonomialFeature*>(feature)->GetPower());
+  feature->ComputeUnnormalizedPopulationExpectation(*space);
+  EXPECT_NEAR(-1.0, feature->GetUnnormalizedPopulationExpectation(),
+	      gTolerance);
+}